@@ -147,17 +147,12 @@ int ToMs(vtkm::Float64 t)
 void PrintTimeStats(const std::string& label, vtkm::Float64 time)
 {
   auto mpi = pilot::mpi::Environment::Get();
-  auto comm = mpi->Comm;
-  MPI_Comm mpiComm = vtkmdiy::mpi::mpi_cast(comm->handle());
-  std::vector<vtkm::Float64> allTimes(mpi->Size, -1.0f);
-  MPI_Gather(&time, 1, MPI_DOUBLE, allTimes.data(), 1, MPI_DOUBLE, 0, mpiComm);
+  TimeStats stats = ReduceTimeStats(time);
   if (mpi->Rank == 0)
   {
-    auto minMaxTime = std::minmax_element(allTimes.begin(), allTimes.end());
-    auto minTime = ToMs(*(minMaxTime.first));
-    auto maxTime = ToMs(*(minMaxTime.second));
-    auto avgTime = ToMs(std::accumulate(allTimes.begin(), allTimes.end(), 0.0) /
-                        static_cast<vtkm::Float64>(allTimes.size()));
+    auto minTime = ToMs(stats.MinTime);
+    auto maxTime = ToMs(stats.MaxTime);
+    auto avgTime = ToMs(stats.AvgTime);
     LOG::Println("{}: Min = {} ms, Max = {} ms, Avg = {} ms", label, minTime, maxTime, avgTime);
   }
 }
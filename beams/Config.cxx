@@ -7,6 +7,7 @@
 #include <vtkm/io/FileUtils.h>
 
 #include <fstream>
+#include <map>
 #include <sstream>
 
 namespace beams
@@ -137,6 +138,31 @@ beams::Result DeserializeToVectorNative(const PJObj& obj,
   return Result::Succeeded();
 }
 
+beams::Result DeserializeExchangeMode(const PJObj& obj,
+                                      const std::string& attrName,
+                                      beams::rendering::TransmittanceExchangeMode& mode)
+{
+  using Mode = beams::rendering::TransmittanceExchangeMode;
+  static const std::map<std::string, Mode> modes = {
+    { "rootRouted", Mode::RootRouted }, { "direct", Mode::Direct },
+    { "neighborhood", Mode::Neighborhood }, { "push", Mode::Push },
+    { "faceImages", Mode::FaceImages }, { "pipelined", Mode::Pipelined },
+    { "messages", Mode::Messages }, { "nodeAggregated", Mode::NodeAggregated },
+    { "oneSided", Mode::OneSided }, { "replicated", Mode::Replicated },
+    { "auto", Mode::Auto },
+  };
+
+  std::string name;
+  CHECK_RESULT_BEAMS(DeserializeToNativeType(obj, attrName, name), "Error reading exchange mode");
+  auto entry = modes.find(name);
+  if (entry == modes.end())
+  {
+    return Result::Failed(fmt::format("Unknown exchange mode '{}'", name));
+  }
+  mode = entry->second;
+  return Result::Succeeded();
+}
+
 beams::Result DataSetOptions::Deserialize(const PJObj& optionsObj)
 {
   CHECK_RESULT_BEAMS(DeserializeToNativeType(optionsObj, "factory", this->Factory),
@@ -149,6 +175,7 @@ beams::Result DataSetOptions::Deserialize(const PJObj& optionsObj)
 beams::Result OpacityMapOptions::Deserialize(const PJObj& optionsObj)
 {
   const auto DeserializeToIdComponent = DeserializeToNativeType<vtkm::IdComponent, int64_t>;
+  const auto DeserializeToId = DeserializeToNativeType<vtkm::Id, int64_t>;
   const auto DeserializeToFloat32 = DeserializeToNativeType<vtkm::Float32, double>;
   const auto DeserializeToId3 = DeserializeToVectorNative<vtkm::Id, double>;
 
@@ -174,6 +201,68 @@ beams::Result OpacityMapOptions::Deserialize(const PJObj& optionsObj)
   }
   CHECK_RESULT_BEAMS(DeserializeToIdComponent(optionsObj, "numSteps", this->NumSteps),
                      "Error reading opacityMapOptions");
+  this->ExchangeMode = beams::rendering::TransmittanceExchangeMode::Neighborhood;
+  if (optionsObj.find("exchangeMode") != optionsObj.end())
+  {
+    CHECK_RESULT_BEAMS(DeserializeExchangeMode(optionsObj, "exchangeMode", this->ExchangeMode),
+                       "Error reading opacityMapOptions");
+  }
+  this->WireFormat = beams::rendering::TransmittanceWireFormat::Full;
+  if (optionsObj.find("wireFormat") != optionsObj.end())
+  {
+    std::string tmpFormat;
+    CHECK_RESULT_BEAMS(DeserializeToNativeType(optionsObj, "wireFormat", tmpFormat),
+                       "Error reading opacityMapOptions");
+    if (tmpFormat == "compact")
+    {
+      this->WireFormat = beams::rendering::TransmittanceWireFormat::Compact;
+    }
+    else if (tmpFormat != "full")
+    {
+      return Result::Failed(
+        fmt::format("Error reading opacityMapOptions: Unknown wire format '{}'", tmpFormat));
+    }
+  }
+  this->PipelineChunks = 8;
+  if (optionsObj.find("pipelineChunks") != optionsObj.end())
+  {
+    CHECK_RESULT_BEAMS(DeserializeToId(optionsObj, "pipelineChunks", this->PipelineChunks),
+                       "Error reading opacityMapOptions");
+  }
+  this->ReplicationThreshold = 16 * 1024 * 1024;
+  if (optionsObj.find("replicationThreshold") != optionsObj.end())
+  {
+    CHECK_RESULT_BEAMS(
+      DeserializeToId(optionsObj, "replicationThreshold", this->ReplicationThreshold),
+      "Error reading opacityMapOptions");
+  }
+  this->RemoteRefreshInterval = 1;
+  this->RemoteRefreshAngle = 5.0f;
+  if (optionsObj.find("remoteRefreshInterval") != optionsObj.end())
+  {
+    CHECK_RESULT_BEAMS(
+      DeserializeToId(optionsObj, "remoteRefreshInterval", this->RemoteRefreshInterval),
+      "Error reading opacityMapOptions");
+  }
+  if (optionsObj.find("remoteRefreshAngle") != optionsObj.end())
+  {
+    CHECK_RESULT_BEAMS(
+      DeserializeToFloat32(optionsObj, "remoteRefreshAngle", this->RemoteRefreshAngle),
+      "Error reading opacityMapOptions");
+  }
+  this->UseSweptMap = false;
+  if (optionsObj.find("useSweptMap") != optionsObj.end())
+  {
+    CHECK_RESULT_BEAMS(DeserializeToNativeType(optionsObj, "useSweptMap", this->UseSweptMap),
+                       "Error reading opacityMapOptions");
+  }
+  this->LocalMapTolerance = 0.0f;
+  if (optionsObj.find("localMapTolerance") != optionsObj.end())
+  {
+    CHECK_RESULT_BEAMS(
+      DeserializeToFloat32(optionsObj, "localMapTolerance", this->LocalMapTolerance),
+      "Error reading opacityMapOptions");
+  }
   return Result::Succeeded();
 }
 
@@ -202,6 +291,10 @@ beams::Result LightOption::Deserialize(const PJObj& optionsObj)
   const auto DeserializeToVecFloat32 = DeserializeToVectorNative<vtkm::Float32, double>;
   CHECK_RESULT_BEAMS(DeserializeToNativeType(optionsObj, "type", this->Type),
                      "Error reading lightOption");
+  if (this->Type != "point" && this->Type != "directional")
+  {
+    return Result::Failed(fmt::format("Error reading lightOption: Unknown type '{}'", this->Type));
+  }
   std::vector<vtkm::Float32> tmpPos;
   std::vector<vtkm::Float32> tmpColor;
   CHECK_RESULT_BEAMS(DeserializeToVecFloat32(optionsObj, "position", tmpPos),
@@ -366,7 +459,15 @@ std::ostream& operator<<(std::ostream& os, const OpacityMapOptions& options)
 {
   os << std::boolalpha;
   os << "Enabled = " << options.Enabled << ", Size = " << options.Size
-     << ", NumSteps = " << options.NumSteps;
+     << ", NumSteps = " << options.NumSteps
+     << ", ExchangeMode = " << static_cast<int>(options.ExchangeMode)
+     << ", WireFormat = " << static_cast<int>(options.WireFormat)
+     << ", PipelineChunks = " << options.PipelineChunks
+     << ", ReplicationThreshold = " << options.ReplicationThreshold
+     << ", RemoteRefreshInterval = " << options.RemoteRefreshInterval
+     << ", RemoteRefreshAngle = " << options.RemoteRefreshAngle
+     << ", UseSweptMap = " << options.UseSweptMap
+     << ", LocalMapTolerance = " << options.LocalMapTolerance;
   os << std::noboolalpha;
   return os;
 }
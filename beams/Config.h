@@ -2,6 +2,8 @@
 #define beams_config_h
 
 #include "Result.h"
+#include "rendering/TransmittanceExchange.h"
+#include "utils/Json.h"
 
 #include <pilot/Result.h>
 #include <pilot/staging/DescriptorResult.h>
@@ -24,7 +26,10 @@ struct DataSetOptions
   std::string Factory;
   std::unordered_map<std::string, std::string> Params;
 };
+*/
 
+// Compiled outside of the preset block so that the scenes can take their opacity map
+// settings from it
 struct OpacityMapOptions
 {
   beams::Result Deserialize(const PJObj& optionsObj);
@@ -50,8 +55,17 @@ struct OpacityMapOptions
   vtkm::Id3 Size;
   vtkm::Float32 SizeRatio;
   vtkm::IdComponent NumSteps;
+  beams::rendering::TransmittanceExchangeMode ExchangeMode;
+  beams::rendering::TransmittanceWireFormat WireFormat;
+  vtkm::Id PipelineChunks;
+  vtkm::Id ReplicationThreshold;
+  vtkm::Id RemoteRefreshInterval;
+  vtkm::Float32 RemoteRefreshAngle;
+  bool UseSweptMap;
+  vtkm::Float32 LocalMapTolerance;
 };
 
+/*
 struct CameraOptions
 {
   beams::Result Deserialize(const PJObj& optionsObj);
@@ -15,6 +15,26 @@ int ToMs(vtkm::Float64 t)
 
 namespace beams
 {
+TimeStats ReduceTimeStats(vtkm::Float64 time)
+{
+  auto mpi = pilot::mpi::Environment::Get();
+  auto comm = mpi->Comm;
+  MPI_Comm mpiComm = vtkmdiy::mpi::mpi_cast(comm->handle());
+
+  // The max is the min of the negated times, so one reduction finds both
+  vtkm::Float64 minMax[2] = { time, -time };
+  vtkm::Float64 globalMinMax[2] = { 0.0, 0.0 };
+  vtkm::Float64 totalTime = 0.0;
+  MPI_Reduce(minMax, globalMinMax, 2, MPI_DOUBLE, MPI_MIN, 0, mpiComm);
+  MPI_Reduce(&time, &totalTime, 1, MPI_DOUBLE, MPI_SUM, 0, mpiComm);
+
+  TimeStats stats;
+  stats.MinTime = globalMinMax[0];
+  stats.MaxTime = -globalMinMax[1];
+  stats.AvgTime = totalTime / static_cast<vtkm::Float64>(mpi->Size);
+  return stats;
+}
+
 ProfilerFrame::ProfilerFrame(const std::string& name)
   : Name(name)
   , Timer(name)
@@ -23,20 +43,10 @@ ProfilerFrame::ProfilerFrame(const std::string& name)
 
 void ProfilerFrame::Collect()
 {
-  auto mpi = pilot::mpi::Environment::Get();
-  auto comm = mpi->Comm;
-  MPI_Comm mpiComm = vtkmdiy::mpi::mpi_cast(comm->handle());
-  this->ElapsedTimes.resize(mpi->Size);
-  vtkm::Float64 rankTime = this->Timer.GetElapsedTime();
-  MPI_Gather(&rankTime, 1, MPI_DOUBLE, this->ElapsedTimes.data(), 1, MPI_DOUBLE, 0, mpiComm);
-  if (mpi->Rank == 0)
-  {
-    auto minMaxTime = std::minmax_element(this->ElapsedTimes.begin(), this->ElapsedTimes.end());
-    this->MinTime = *(minMaxTime.first);
-    this->MaxTime = *(minMaxTime.second);
-    this->AvgTime = std::accumulate(this->ElapsedTimes.begin(), this->ElapsedTimes.end(), 0.0) /
-      static_cast<vtkm::Float64>(this->ElapsedTimes.size());
-  }
+  TimeStats stats = ReduceTimeStats(this->Timer.GetElapsedTime());
+  this->MinTime = stats.MinTime;
+  this->MaxTime = stats.MaxTime;
+  this->AvgTime = stats.AvgTime;
 }
 
 void ProfilerFrame::PrintSummary(std::ostream& stream, int level) const
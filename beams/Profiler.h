@@ -10,6 +10,17 @@
 
 namespace beams
 {
+struct TimeStats
+{
+  vtkm::Float64 MinTime;
+  vtkm::Float64 MaxTime;
+  vtkm::Float64 AvgTime;
+};
+
+// The spread of a time over all ranks, only valid on rank 0. Reduced rather than gathered, so
+// rank 0 does not hold a time per rank.
+TimeStats ReduceTimeStats(vtkm::Float64 time);
+
 struct ProfilerFrame
 {
   ProfilerFrame(const std::string& name);
@@ -21,7 +32,6 @@ struct ProfilerFrame
   std::string Name;
   beams::Timer Timer;
   bool Distributed;
-  std::vector<vtkm::Float64> ElapsedTimes;
   vtkm::Float64 MinTime;
   vtkm::Float64 MaxTime;
   vtkm::Float64 AvgTime;
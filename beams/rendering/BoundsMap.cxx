@@ -92,37 +92,26 @@ void BoundsMap::Init(const std::vector<vtkm::cont::DataSet>& dataSets)
 
 void BoundsMap::Build(const std::vector<vtkm::cont::DataSet>& dataSets)
 {
-  std::vector<vtkm::Float64> vals(static_cast<std::size_t>(this->TotalNumBlocks * 6), 0);
-  std::vector<vtkm::Float64> vals2(vals.size());
-
   const vtkm::cont::DataSet& ds = dataSets[0];
   vtkm::Bounds bounds = ds.GetCoordinateSystem().GetBounds();
+  std::vector<vtkm::Float64> localVals = { bounds.X.Min, bounds.X.Max, bounds.Y.Min,
+                                           bounds.Y.Max, bounds.Z.Min, bounds.Z.Max };
 
-  std::size_t idx = static_cast<std::size_t>(this->LocalID * 6);
-  vals[idx++] = bounds.X.Min;
-  vals[idx++] = bounds.X.Max;
-  vals[idx++] = bounds.Y.Min;
-  vals[idx++] = bounds.Y.Max;
-  vals[idx++] = bounds.Z.Min;
-  vals[idx++] = bounds.Z.Max;
-
+  // Every rank owns one block and contributes only its bounds, in rank order
   vtkmdiy::mpi::communicator Comm = vtkm::cont::EnvironmentTracker::GetCommunicator();
   MPI_Comm mpiComm = vtkmdiy::mpi::mpi_cast(Comm.handle());
-  MPI_Allreduce(vals.data(), vals2.data(), vals.size(), MPI_DOUBLE, MPI_SUM, mpiComm);
+  std::vector<vtkm::Float64> vals(static_cast<std::size_t>(Comm.size()) * 6);
+  MPI_Allgather(localVals.data(), 6, MPI_DOUBLE, vals.data(), 6, MPI_DOUBLE, mpiComm);
 
   this->BlockBounds.resize(static_cast<std::size_t>(this->TotalNumBlocks));
   this->GlobalBounds = vtkm::Bounds();
-  idx = 0;
-  for (auto& block : this->BlockBounds)
+  for (vtkm::Id id = 0; id < this->TotalNumBlocks; id++)
   {
-    block = vtkm::Bounds(vals2[idx + 0],
-                         vals2[idx + 1],
-                         vals2[idx + 2],
-                         vals2[idx + 3],
-                         vals2[idx + 4],
-                         vals2[idx + 5]);
+    std::size_t idx = static_cast<std::size_t>(this->FindRank(id)) * 6;
+    vtkm::Bounds& block = this->BlockBounds[static_cast<std::size_t>(id)];
+    block = vtkm::Bounds(
+      vals[idx + 0], vals[idx + 1], vals[idx + 2], vals[idx + 3], vals[idx + 4], vals[idx + 5]);
     this->GlobalBounds.Include(block);
-    idx += 6;
   }
 }
 } // namespace rendering
@@ -0,0 +1,33 @@
+#ifndef beams_rendering_directionallight_h
+#define beams_rendering_directionallight_h
+
+#include "Light.h"
+
+#include <vtkm/Types.h>
+
+namespace beams
+{
+namespace rendering
+{
+// A light infinitely far away, like the sun. All its rays are parallel to Direction, the direction
+// the light travels in.
+template <typename Precision>
+struct DirectionalLight : public Light
+{
+  using Vec3 = vtkm::Vec<Precision, 3>;
+
+  DirectionalLight(Vec3 direction, Vec3 color, Precision intensity)
+    : Direction(direction)
+    , Color(color)
+    , Intensity(intensity)
+  {
+  }
+
+  Vec3 Direction;
+  Vec3 Color;
+  Precision Intensity;
+}; // struct DirectionalLight
+} // namespace rendering
+} // namespace beams
+
+#endif // beams_rendering_directionallight_h
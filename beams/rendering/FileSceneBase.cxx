@@ -1,6 +1,5 @@
 #include "FileSceneBase.h"
 #include "../sources/Spheres.h"
-#include "PointLight.h"
 #include <pilot/Logger.h>
 #include <pilot/mpi/Environment.h>
 
@@ -91,8 +90,10 @@ void FileSceneBase::Init(const beams::Preset& preset)
 
   this->LightPosition = preset.LightOptions.Lights[0].Position;
   this->LightColor = preset.LightOptions.Lights[0].Color;
+  this->LightType = preset.LightOptions.Lights[0].Type;
   this->ShadowMapSize = { 64, 64, 64 };
   // this->ShadowMapSize = { 32 };
+  this->SetOpacityMapOptions(preset.OpacityMapOptions);
   using FloatHandle = vtkm::cont::ArrayHandle<vtkm::FloatDefault>;
   using RectilinearPoints =
     vtkm::cont::ArrayHandleCartesianProduct<FloatHandle, FloatHandle, FloatHandle>;
@@ -133,10 +134,9 @@ beams::Result FileSceneBase::Ready()
   this->Mapper.SetBoundsMap(this->BoundsMap.get());
   this->Mapper.SetUseShadowMap(true);
   this->Mapper.SetShadowMapSize(this->ShadowMapSize);
+  this->ApplyOpacityMapOptions();
   std::cerr << "\033[1;31m" << this->LightPosition << "\033[0m\n";
-  std::shared_ptr<beams::rendering::Light> light =
-    std::make_shared<beams::rendering::PointLight<vtkm::Float32>>(
-      this->LightPosition, this->LightColor, 2.0f);
+  std::shared_ptr<beams::rendering::Light> light = this->CreateLight(2.0f);
   this->Mapper.ClearLights();
   this->Mapper.AddLight(light);
 
@@ -7,6 +7,7 @@ namespace rendering
 {
 struct Light
 {
+  virtual ~Light() = default;
 }; // struct Light
 } // namespace rendering
 } // namespace beams
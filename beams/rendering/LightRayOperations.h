@@ -4,10 +4,14 @@
 #include "LightRays.h"
 
 #include <vtkm/VectorAnalysis.h>
+#include <vtkm/cont/Algorithm.h>
 #include <vtkm/cont/ArrayHandle.h>
+#include <vtkm/cont/ArrayHandleIndex.h>
 #include <vtkm/cont/Invoker.h>
 #include <vtkm/worklet/WorkletMapField.h>
 
+#include <vector>
+
 namespace beams
 {
 namespace rendering
@@ -44,6 +48,35 @@ public:
 
   Vec3 LightPosition;
 }; // struct LightRaysGenerator
+
+// The rays of every light to every point, light by light
+template <typename Precision>
+struct MultiLightRaysGenerator : public vtkm::worklet::WorkletMapField
+{
+public:
+  using ControlSignature = void(FieldIn rayIds,
+                                WholeArrayIn points,
+                                WholeArrayIn lightPositions,
+                                FieldOut origins,
+                                FieldOut dirs,
+                                FieldOut dests);
+  using ExecutionSignature = void(_1, _2, _3, _4, _5, _6);
+  using Vec3 = vtkm::Vec<Precision, 3>;
+
+  template <typename PointsPortal, typename LightsPortal>
+  VTKM_EXEC void operator()(const vtkm::Id rayId,
+                            const PointsPortal& points,
+                            const LightsPortal& lightPositions,
+                            Vec3& origin,
+                            Vec3& dir,
+                            Vec3& dest) const
+  {
+    const vtkm::Id numPoints = points.GetNumberOfValues();
+    origin = lightPositions.Get(rayId / numPoints);
+    dest = points.Get(rayId % numPoints);
+    dir = vtkm::Normal(dest - origin);
+  }
+}; // struct MultiLightRaysGenerator
 } // namespace detail
 
 struct LightRayOperations
@@ -64,6 +97,25 @@ struct LightRayOperations
     return rays;
   }
 
+  // The rays of all the lights, the ones of each light numbered like the points
+  template <typename Precision, typename PointsArrayHandle, typename Device>
+  static LightRays<Precision, Device> CreateRays(
+    const PointsArrayHandle& points,
+    const std::vector<vtkm::Vec<Precision, 3>>& lightPositions)
+  {
+    vtkm::Id count = points.GetNumberOfValues() * static_cast<vtkm::Id>(lightPositions.size());
+    vtkm::cont::Invoker invoker;
+    LightRays<Precision, Device> rays(count);
+    vtkm::cont::Algorithm::Copy(vtkm::cont::ArrayHandleIndex(count), rays.Ids);
+    invoker(detail::MultiLightRaysGenerator<Precision>{},
+            rays.Ids,
+            points,
+            vtkm::cont::make_ArrayHandle(lightPositions, vtkm::CopyFlag::On),
+            rays.Origins,
+            rays.Dirs,
+            rays.Dests);
+    return rays;
+  }
 }; // struct LightRayOperations
 } // namespace rendering
 } // namespace beams
@@ -1,10 +1,13 @@
 #include "LightedVolumeRenderer.h"
 #include "../Math.h"
+#include "DirectionalLight.h"
 #include "PointLight.h"
 #include "TransmittanceMap.h"
 #include <pilot/Logger.h>
+#include <pilot/mpi/Environment.h>
 
 #include "RectilinearMeshOracle.h"
+#include "UniformMeshOracle.h"
 #include <vtkm/cont/ArrayHandleCartesianProduct.h>
 #include <vtkm/cont/ArrayHandleCounting.h>
 #include <vtkm/cont/ArrayHandleUniformPointCoordinates.h>
@@ -26,6 +29,7 @@
 #include <mpi.h>
 
 #include <math.h>
+#include <memory>
 #include <numeric>
 #include <stdio.h>
 
@@ -717,35 +721,22 @@ public:
   }
 }; //class CalcRayStart
 
-struct TransmissionDataRequest
+// The modes that send whole hits, and so tell the lights apart by their ray ids. The others only
+// know about a single light.
+bool CanExchangeMultipleLights(TransmittanceExchangeMode mode)
 {
-  std::vector<int> FromRanks;
-  int ToRank;
-
-  std::vector<int> BlockIds;
-  std::vector<vtkm::Vec3f_32> HitMins;
-  std::vector<vtkm::Vec3f_32> HitMaxs;
-
-  // Number of BlockIds, flat, needed for MPI
-  // int NumBlockIds;
-  // Number of Hits, flat, needed for MPI
-  int NumHits;
-};
-
-struct TransmissionDataPull
-{
-  int NumHits = 0;
-  std::vector<vtkm::Vec4f_32> HitMins;
-  std::vector<vtkm::Vec4f_32> HitMaxs;
-  std::vector<vtkm::Float32> Transmittances;
-};
-
-struct MpiTypes
-{
-  MPI_Datatype Vec3f_32;
-  MPI_Datatype Vec4f_32;
-  MPI_Datatype TransmittanceRayBlockHit;
-};
+  switch (mode)
+  {
+    case TransmittanceExchangeMode::RootRouted:
+    case TransmittanceExchangeMode::Direct:
+    case TransmittanceExchangeMode::Neighborhood:
+    case TransmittanceExchangeMode::Messages:
+    case TransmittanceExchangeMode::NodeAggregated:
+      return true;
+    default:
+      return false;
+  }
+}
 
 } //namespace
 
@@ -754,8 +745,73 @@ LightedVolumeRenderer::LightedVolumeRenderer()
   IsSceneDirty = false;
   IsUniformDataSet = true;
   SampleDistance = -1.f;
+  IsDirectionalLight = false;
+  IsMultiLightOverrideLogged = false;
   UseShadowMap = true;
   ShadowMapSize = { 16, 16, 16 };
+  UseSweptMap = false;
+  OpacityCutoff = 0.99f;
+  ExchangeMode = TransmittanceExchangeMode::Neighborhood;
+  WireFormat = TransmittanceWireFormat::Full;
+  PipelineChunks = 8;
+  ReplicationThreshold = 16 * 1024 * 1024;
+  RemoteRefreshInterval = 1;
+  RemoteRefreshAngle = 5.0f;
+  FramesSinceRemoteRefresh = 0;
+  RemoteRefreshCutoff = 0.0f;
+  LocalMapTolerance = 0.0f;
+  LocalMapSize = { 0, 0, 0 };
+  LocalMapCutoff = 0.0f;
+}
+
+bool LightedVolumeRenderer::CanReuseRemoteOpacities(vtkm::Id numRays) const
+{
+  // The global bounds, the light and the transfer function are the same on every rank, unlike
+  // the local block. The scalar range is the one the scene renders with, not the block's.
+  const std::vector<vtkm::Vec3f_32>& lightPositions = this->TheLights.Locations;
+  if (this->FramesSinceRemoteRefresh + 1 >= this->RemoteRefreshInterval ||
+      this->RemoteOpacities.GetNumberOfValues() != numRays ||
+      this->RemoteRefreshBounds != this->BoundsMap->GlobalBounds ||
+      this->RemoteRefreshLightPositions.size() != lightPositions.size() ||
+      this->RemoteRefreshScalarRange != this->ScalarRange ||
+      this->RemoteRefreshColorMap != this->ColorMap ||
+      this->RemoteRefreshCutoff != this->OpacityCutoff)
+  {
+    return false;
+  }
+
+  // Every light has to stay within the angle. A directional light already is a direction.
+  vtkm::Vec3f_64 center = this->BoundsMap->GlobalBounds.Center();
+  vtkm::Vec3f_32 center32{ static_cast<vtkm::Float32>(center[0]),
+                           static_cast<vtkm::Float32>(center[1]),
+                           static_cast<vtkm::Float32>(center[2]) };
+  if (this->IsDirectionalLight)
+  {
+    center32 = vtkm::Vec3f_32{ 0.0f, 0.0f, 0.0f };
+  }
+  for (std::size_t i = 0; i < lightPositions.size(); ++i)
+  {
+    vtkm::Vec3f_32 lastDir = vtkm::Normal(this->RemoteRefreshLightPositions[i] - center32);
+    vtkm::Vec3f_32 dir = vtkm::Normal(lightPositions[i] - center32);
+    vtkm::Float32 cosAngle = vtkm::Min(1.0f, vtkm::Max(-1.0f, vtkm::Dot(lastDir, dir)));
+    vtkm::Float32 angle = vtkm::ACos(cosAngle) / vtkm::Pi_180f();
+    if (angle > this->RemoteRefreshAngle)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool LightedVolumeRenderer::CanUpdateLocalMap(vtkm::Id numRays) const
+{
+  // The map also depends on the data, which is taken to stay the same while its bounds and
+  // scalar range do
+  return this->LocalMapTolerance > 0.0f && this->LocalOpacities.GetNumberOfValues() == numRays &&
+    this->LocalMapRayLights.GetNumberOfValues() == numRays &&
+    this->LocalMapBounds == this->SpatialExtent && this->LocalMapSize == this->ShadowMapSize &&
+    this->LocalMapScalarRange == this->ScalarRange && this->LocalMapColorMap == this->ColorMap &&
+    this->LocalMapCutoff == this->OpacityCutoff;
 }
 
 void LightedVolumeRenderer::SetColorMap(const vtkm::cont::ArrayHandle<vtkm::Vec4f_32>& colorMap)
@@ -799,7 +855,19 @@ public:
   {
     VTKM_IS_DEVICE_ADAPTER_TAG(Device);
 
-    this->Self->RenderOnDevice(this->Rays, Device());
+    // The oracle is picked here so that Phases 1 to 3 are compiled for each kind of mesh
+    if (this->Self->IsUniformDataSet)
+    {
+      UniformMeshOracle oracle = this->Self->BuildUniformOracle();
+      this->Self->RenderOnDevice(this->Rays, oracle, Device());
+    }
+    else
+    {
+      using RectilinearOracleType = vtkm::rendering::raytracing::RectilinearMeshOracle;
+      RectilinearOracleType oracle =
+        this->Self->BuildRectilinearOracle<Precision, Device, RectilinearOracleType>();
+      this->Self->RenderOnDevice(this->Rays, oracle, Device());
+    }
     return true;
   }
 };
@@ -832,27 +900,43 @@ RectilinearOracleType LightedVolumeRenderer::BuildRectilinearOracle()
   return RectilinearOracleType(this->CellSet, cartesianCoords);
 }
 
+UniformMeshOracle LightedVolumeRenderer::BuildUniformOracle()
+{
+  using UniformArrayHandle = vtkm::cont::ArrayHandleUniformPointCoordinates;
+  UniformArrayHandle uniformCoords =
+    this->CoordinateSystem.GetData().AsArrayHandle<UniformArrayHandle>();
+  return UniformMeshOracle(this->CellSet, uniformCoords);
+}
+
 void LightedVolumeRenderer::AddLight(std::shared_ptr<Light> light)
 {
   using PLight = beams::rendering::PointLight<vtkm::Float32>;
+  using DLight = beams::rendering::DirectionalLight<vtkm::Float32>;
+  DLight* dLight = dynamic_cast<DLight*>(light.get());
+  PLight* pLight = dynamic_cast<PLight*>(light.get());
+  if (dLight == nullptr && pLight == nullptr)
+  {
+    throw vtkm::cont::ErrorBadValue("Only point and directional lights are supported");
+  }
+  if (this->IsDirectionalLight || (dLight != nullptr && !TheLights.Locations.empty()))
+  {
+    throw vtkm::cont::ErrorBadValue("A directional light has to be the only light");
+  }
   this->Lights.AddLight(light);
-  PLight* pLight = reinterpret_cast<PLight*>(light.get());
+  if (dLight != nullptr)
+  {
+    // Kept as the direction towards the light
+    TheLights.AddLight(1.0f, -vtkm::Normal(dLight->Direction), dLight->Color * dLight->Intensity);
+    this->IsDirectionalLight = true;
+    return;
+  }
   TheLights.AddLight(1.0f, pLight->Position, pLight->Color * pLight->Intensity);
 }
 
 void LightedVolumeRenderer::ClearLights()
 {
   TheLights.ClearLights();
-}
-
-template <typename Portal, typename T>
-void CopyIntoStdVec(const Portal& portal, std::vector<T>& vec)
-{
-  vec.resize(portal.GetNumberOfValues());
-  for (auto i = 0; i < portal.GetNumberOfValues(); i++)
-  {
-    vec[i] = portal.Get(i);
-  }
+  IsDirectionalLight = false;
 }
 
 template <typename PortalType>
@@ -864,51 +948,9 @@ VTKM_CONT void CopyPortalToVector(const PortalType& input,
   std::copy(iterators.GetBegin(), iterators.GetEnd(), output.begin());
 }
 
-template <typename T>
-VTKM_CONT void ScanExclusiveVector(const std::vector<T>& input, std::vector<T>& output)
-{
-  vtkm::cont::ArrayHandle<T> outputAH;
-  vtkm::cont::ArrayHandle<T> inputAH = vtkm::cont::make_ArrayHandle(input, vtkm::CopyFlag::Off);
-  vtkm::cont::Algorithm::ScanExclusive(inputAH, outputAH);
-  CopyPortalToVector(outputAH.ReadPortal(), output);
-}
-
-MpiTypes ConstructMpiTypes()
-{
-  MpiTypes types;
-  MPI_Type_contiguous(3, MPI_FLOAT, &types.Vec3f_32);
-  MPI_Type_commit(&types.Vec3f_32);
-  MPI_Type_contiguous(4, MPI_FLOAT, &types.Vec4f_32);
-  MPI_Type_commit(&types.Vec4f_32);
-
-  const int hitMemberCount = 6;
-  int hitLengths[hitMemberCount] = { 1, 1, 1, 1, 1, 1 };
-  MPI_Aint hitDisplacements[hitMemberCount];
-  TransmittanceRayBlockHit dummyHit;
-  MPI_Aint hitBaseAddress;
-  int addCount = 0;
-  MPI_Get_address(&dummyHit, &hitBaseAddress);
-  MPI_Get_address(&dummyHit.RayId, &hitDisplacements[addCount++]);
-  MPI_Get_address(&dummyHit.BlockId, &hitDisplacements[addCount++]);
-  MPI_Get_address(&dummyHit.FromBlockId, &hitDisplacements[addCount++]);
-  MPI_Get_address(&dummyHit.Point, &hitDisplacements[addCount++]);
-  MPI_Get_address(&dummyHit.RayT, &hitDisplacements[addCount++]);
-  MPI_Get_address(&dummyHit.Opacity, &hitDisplacements[addCount++]);
-  for (int i = 0; i < hitMemberCount; ++i)
-  {
-    hitDisplacements[i] = MPI_Aint_diff(hitDisplacements[i], hitBaseAddress);
-  }
-  MPI_Datatype hitTypes[hitMemberCount] = { MPI_INT,        MPI_INT,   MPI_INT,
-                                            types.Vec3f_32, MPI_FLOAT, MPI_FLOAT };
-  MPI_Type_create_struct(
-    hitMemberCount, hitLengths, hitDisplacements, hitTypes, &types.TransmittanceRayBlockHit);
-  MPI_Type_commit(&types.TransmittanceRayBlockHit);
-
-  return types;
-}
-
-template <typename Precision, typename Device>
+template <typename Precision, typename Device, typename OracleType>
 void LightedVolumeRenderer::RenderOnDevice(vtkm::rendering::raytracing::Ray<Precision>& rays,
+                                           OracleType& oracle,
                                            Device)
 {
   this->Profiler->StartFrame("Phase 1");
@@ -918,9 +960,6 @@ void LightedVolumeRenderer::RenderOnDevice(vtkm::rendering::raytracing::Ray<Prec
   auto comm = mpi->Comm;
   MPI_Comm mpiComm = vtkmdiy::mpi::mpi_cast(comm->handle());
 
-  using OracleType = vtkm::rendering::raytracing::RectilinearMeshOracle;
-  OracleType oracle = this->BuildRectilinearOracle<Precision, Device, OracleType>();
-
   this->Profiler->StartFrame("CreateDataSetForOpacityMap");
   phase1ShadowMapTimer.Start();
   auto bounds = this->SpatialExtent;
@@ -935,322 +974,462 @@ void LightedVolumeRenderer::RenderOnDevice(vtkm::rendering::raytracing::Ray<Prec
   auto coordinates =
     opacityMapDataSet.GetCoordinateSystem().GetData().AsArrayHandle<CoordinatesArrayHandle>();
 
+  // Every light gets its own map over the same vertices, one after the other in opacities, and
+  // one light ray per vertex and light
+  vtkm::Id d =
+    (this->ShadowMapSize[0] + 1) * (this->ShadowMapSize[1] + 1) * (this->ShadowMapSize[2] + 1);
+  const vtkm::Id numLights = static_cast<vtkm::Id>(TheLights.Locations.size());
+  const bool isMultiLight = numLights > 1;
+  const vtkm::Id numRays = numLights * d;
+  // The homogeneous lights of the sweep, the face images and the incremental map
+  std::vector<vtkm::Vec4f_32> homogeneousLights;
+  const vtkm::Float32 w = this->IsDirectionalLight ? 0.0f : 1.0f;
+  for (const vtkm::Vec3f_32& location : TheLights.Locations)
+  {
+    homogeneousLights.push_back(vtkm::Vec4f_32{ location[0], location[1], location[2], w });
+  }
+  const vtkm::Vec4f_32 light = homogeneousLights[0];
+
+  // A directional light is swept, its parallel rays are never marched
   this->Profiler->StartFrame("CreateRays");
   vtkm::cont::Token token;
-  LightRays<vtkm::Float32, Device> lightRays =
-    LightRayOperations::CreateRays<vtkm::Float32, CoordinatesArrayHandle, Device>(
-      coordinates, TheLights.Locations[0]);
+  LightRays<vtkm::Float32, Device> lightRays;
+  if (!this->IsDirectionalLight)
+  {
+    lightRays = LightRayOperations::CreateRays<vtkm::Float32, CoordinatesArrayHandle, Device>(
+      coordinates, TheLights.Locations);
+  }
   this->Profiler->EndFrame();
 
   vtkm::cont::ArrayHandle<vtkm::Float32> opacities;
-  vtkm::Id d =
-    (this->ShadowMapSize[0] + 1) * (this->ShadowMapSize[1] + 1) * (this->ShadowMapSize[2] + 1);
-  opacities.Allocate(d);
+  opacities.Allocate(numRays);
   vtkm::cont::Algorithm::Fill(opacities, 0.0f);
   using PhotonMapEstimatorType = TransmittanceMapEstimator<Device, TransmittanceLocator<Device>>;
-  PhotonMapEstimatorType transmittanceMapEstimator =
-    GenerateEstimator<Device, OracleType, vtkm::Float32>(this->SpatialExtent,
-                                                         dims,
-                                                         opacityMapDataSet,
-                                                         lightRays,
-                                                         ScalarRange,
-                                                         ScalarField,
-                                                         TheLights,
-                                                         oracle,
-                                                         this->ColorMap,
-                                                         opacities,
-                                                         token);
-  phase1ShadowMapTimer.Stop();
-  // FMT_TMR(phase1ShadowMapTimer);
-  Phase1Time = phase1ShadowMapTimer.GetElapsedTime();
-  this->Profiler->EndFrame();
-
-  LOG::Println0("Phase 2");
-  vtkm::cont::Timer phase2MpiTimer;
-  phase2MpiTimer.Start();
-  MpiTypes MPI_TYPES = ConstructMpiTypes();
+  vtkm::Float32 numSteps = 128.0f;
+  vtkm::Float32 stepSize = vtkm::Magnitude(size) / numSteps;
 
-  vtkm::cont::Invoker invoker{ Device() };
-  const bool useGlancingHits = true;
+  // Frames within the staleness bound reuse the remote opacities of the last refresh and
+  // exchange nothing
+  const bool reuseRemote = this->CanReuseRemoteOpacities(numRays);
 
-  vtkm::cont::ArrayHandle<vtkm::Id> hitCounts;
-  vtkm::cont::ArrayHandle<vtkm::Id> hitOffsets;
-  vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> rayHits;
-  GetNonLocalHits<PhotonMapEstimatorType, Device>(transmittanceMapEstimator,
-                                                  TheLights,
-                                                  *(this->BoundsMap),
-                                                  useGlancingHits,
-                                                  hitCounts,
-                                                  hitOffsets,
-                                                  rayHits);
-
-  vtkm::cont::Algorithm::Sort(rayHits, beams::rendering::HitSort());
-
-  std::vector<TransmittanceRayBlockHit> rayHitsV;
-  CopyPortalToVector(rayHits.ReadPortal(), rayHitsV);
-  ////////////////////////////////
-  // Send the sizes of the vectors
-  ////////////////////////////////
-  std::vector<int> requestNumHits;
-  if (mpi->Rank == 0)
+  // Only the modes that route whole hits tell the lights apart, the others fall back to the
+  // neighborhood exchange. The compact format drops the ray ids that carry the light.
+  TransmittanceExchangeMode requestedMode = this->ExchangeMode;
+  const bool overridesMode = isMultiLight && !this->IsDirectionalLight &&
+    !CanExchangeMultipleLights(requestedMode);
+  if (overridesMode)
   {
-    requestNumHits.resize(mpi->Size);
-    int count = rayHitsV.size();
-    MPI_Gather(&count, 1, MPI_INT, requestNumHits.data(), 1, MPI_INT, 0, mpiComm);
+    requestedMode = TransmittanceExchangeMode::Neighborhood;
   }
-  else
+  // The sweep of a directional light only needs the boundary slices of the upstream blocks
+  if (this->IsDirectionalLight)
   {
-    int count = rayHitsV.size();
-    MPI_Gather(&count, 1, MPI_INT, nullptr, 0, MPI_INT, 0, mpiComm);
+    requestedMode = TransmittanceExchangeMode::FaceImages;
   }
-
-  ////////////////////////////////
-  // Send the vectors
-  ////////////////////////////////
-  std::vector<TransmittanceRayBlockHit> requestHits;
-  if (mpi->Rank == 0)
+  const TransmittanceWireFormat wireFormat =
+    isMultiLight ? TransmittanceWireFormat::Full : this->WireFormat;
+  const bool overridesFormat = isMultiLight && this->WireFormat != TransmittanceWireFormat::Full;
+  const bool overridesSweep = isMultiLight && this->UseSweptMap && !this->IsDirectionalLight;
+  if (!this->IsMultiLightOverrideLogged && (overridesMode || overridesFormat || overridesSweep))
   {
-    std::vector<int> requestHitsOffsets;
-    ScanExclusiveVector(requestNumHits, requestHitsOffsets);
-    int totalHitsCount = std::accumulate(requestNumHits.begin(), requestNumHits.end(), 0);
-    requestHits.resize(totalHitsCount);
-    int rayHitsVSize = rayHitsV.size();
-    MPI_Gatherv(rayHitsV.data(),
-                rayHitsVSize,
-                MPI_TYPES.TransmittanceRayBlockHit,
-                requestHits.data(),
-                requestNumHits.data(),
-                requestHitsOffsets.data(),
-                MPI_TYPES.TransmittanceRayBlockHit,
-                0,
-                mpiComm);
+    if (overridesMode)
+    {
+      LOG::Println0("Exchange mode {} cannot tell {} lights apart, using Neighborhood",
+                    static_cast<int>(this->ExchangeMode),
+                    numLights);
+    }
+    if (overridesFormat)
+    {
+      LOG::Println0("The compact wire format cannot tell {} lights apart, using Full", numLights);
+    }
+    if (overridesSweep)
+    {
+      LOG::Println0("The swept map only follows one light, marching the map for {} lights",
+                    numLights);
+    }
+    this->IsMultiLightOverrideLogged = true;
   }
-  else
+
+  // Blocks that are transparent under the current color map get no hits. Face images need no
+  // hits at all, and have to pass through transparent blocks anyway.
+  const bool useFaceImages =
+    !reuseRemote && requestedMode == TransmittanceExchangeMode::FaceImages;
+  const bool usePipeline = !reuseRemote && requestedMode == TransmittanceExchangeMode::Pipelined;
+  std::vector<vtkm::UInt8> transparentBlocksV(static_cast<std::size_t>(mpi->Size), 0);
+  if (!useFaceImages && !reuseRemote)
   {
-    int rayHitsVSize = rayHitsV.size();
-    MPI_Gatherv(rayHitsV.data(),
-                rayHitsVSize,
-                MPI_TYPES.TransmittanceRayBlockHit,
-                nullptr,
-                nullptr,
-                nullptr,
-                MPI_TYPES.TransmittanceRayBlockHit,
-                0,
-                mpiComm);
+    const vtkm::Range blockRange = this->ScalarField->GetRange().ReadPortal().Get(0);
+    const vtkm::Float32 localMaxAlpha =
+      GetMaxAlphaInRange(this->ColorMap, this->ScalarRange, blockRange);
+    transparentBlocksV = FindTransparentBlocks(GatherBlockMaxAlphas(mpiComm, localMaxAlpha));
   }
-
-  std::map<int, std::vector<TransmittanceRayBlockHit>> requestHitsTable;
-  if (mpi->Rank == 0)
+  vtkm::cont::ArrayHandle<vtkm::UInt8> transparentBlocks =
+    vtkm::cont::make_ArrayHandle(transparentBlocksV, vtkm::CopyFlag::On);
+  const TransmittanceExchangeMode exchangeMode =
+    ResolveExchangeMode(requestedMode,
+                        d,
+                        transparentBlocksV,
+                        static_cast<std::size_t>(this->ReplicationThreshold));
+
+  // The pipeline generates the map in chunks of z layers. The hits of a chunk are sent before it
+  // is marched, and the queries that only need the finished layers are answered after it.
+  std::unique_ptr<TransmittancePipeline> pipeline;
+  vtkm::cont::ArrayHandle<vtkm::Id> hitCounts;
+  vtkm::cont::ArrayHandle<vtkm::Id> hitOffsets;
+  // The marched map can start from the one of the previous frame when the lights barely moved
+  bool updatedLocalMap = false;
+  if (usePipeline)
   {
-    for (const TransmittanceRayBlockHit& hit : requestHits)
+    const vtkm::Id numLayers = dims[2] + 1;
+    const vtkm::Id layerSize = (dims[0] + 1) * (dims[1] + 1);
+    const vtkm::Id numChunks = vtkm::Max(vtkm::Id(1), vtkm::Min(this->PipelineChunks, numLayers));
+    pipeline.reset(new TransmittancePipeline(mpiComm,
+                                             this->ExchangePlan.GetTypes(),
+                                             *(this->BoundsMap),
+                                             TheLights.Locations[0],
+                                             dims,
+                                             transparentBlocksV,
+                                             wireFormat,
+                                             numChunks));
+
+    // The map is still being written, so every evaluation gets its own short-lived estimator
+    vtkm::cont::Invoker invoker{ Device() };
+    auto evaluatePartialHits = [&](std::vector<TransmittanceRayBlockHit>& pullHitsV) {
+      vtkm::cont::Token evaluateToken;
+      PhotonMapEstimatorType estimator =
+        MakeTransmittanceEstimator<Device>(coordinates, dims, TheLights, opacities, evaluateToken);
+      vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> pullHits =
+        vtkm::cont::make_ArrayHandle(pullHitsV, vtkm::CopyFlag::On);
+      invoker(TransmittanceFetcher2<PhotonMapEstimatorType>{ mpi->Rank, stepSize, estimator },
+              pullHits);
+      CopyPortalToVector(pullHits.ReadPortal(), pullHitsV);
+    };
+
+    const bool useGlancingHits = true;
+    hitCounts.Allocate(d);
+    for (vtkm::Id chunk = 0; chunk < numChunks; ++chunk)
     {
-      int toBlock = hit.BlockId;
-      auto& hitsTableEntry = requestHitsTable[toBlock];
-      hitsTableEntry.push_back(hit);
+      const vtkm::Id beginLayer = chunk * numLayers / numChunks;
+      const vtkm::Id endLayer = (chunk + 1) * numLayers / numChunks;
+      const vtkm::Id begin = beginLayer * layerSize;
+      const vtkm::Id count = (endLayer - beginLayer) * layerSize;
+      std::vector<TransmittanceRayBlockHit> chunkHitsV =
+        GetNonLocalHitsInRange<CoordinatesArrayHandle, Device>(coordinates,
+                                                               TheLights,
+                                                               *(this->BoundsMap),
+                                                               transparentBlocks,
+                                                               useGlancingHits,
+                                                               begin,
+                                                               count,
+                                                               hitCounts);
+      pipeline->PostChunk(std::move(chunkHitsV));
+      MarchTransmittanceMap<Device, OracleType, vtkm::Float32>(this->SpatialExtent,
+                                                               lightRays,
+                                                               ScalarRange,
+                                                               ScalarField,
+                                                               TheLights,
+                                                               oracle,
+                                                               this->ColorMap,
+                                                               opacities,
+                                                               this->OpacityCutoff,
+                                                               begin,
+                                                               count);
+      pipeline->Progress(endLayer, evaluatePartialHits);
     }
+    vtkm::cont::Algorithm::ScanExclusive(hitCounts, hitOffsets);
   }
-
-  ////////////////////////////////
-  // Send the sizes of the vectors
-  ////////////////////////////////
-  std::vector<int> pullsNumHits;
-  int pullNumHits;
-  if (mpi->Rank == 0)
+  else if ((this->UseSweptMap && !isMultiLight) || this->IsDirectionalLight)
   {
-    pullsNumHits.resize(mpi->Size);
-    for (int i = 0; i < mpi->Size; ++i)
-    {
-      pullsNumHits[i] = requestHitsTable[i].size();
-    }
-    MPI_Scatter(pullsNumHits.data(), 1, MPI_INT, &pullNumHits, 1, MPI_INT, 0, mpiComm);
+    SweepTransmittanceMap<Device, OracleType>(this->SpatialExtent,
+                                              dims,
+                                              ScalarRange,
+                                              ScalarField,
+                                              light,
+                                              oracle,
+                                              this->ColorMap,
+                                              opacities,
+                                              this->OpacityCutoff);
   }
-  else
+  else if (this->CanUpdateLocalMap(numRays))
   {
-    MPI_Scatter(nullptr, 1, MPI_INT, &pullNumHits, 1, MPI_INT, 0, mpiComm);
+    updatedLocalMap = true;
+    const vtkm::Id numMarched =
+      UpdateTransmittanceMap<Device, OracleType, vtkm::Float32>(this->SpatialExtent,
+                                                                dims,
+                                                                lightRays,
+                                                                ScalarRange,
+                                                                ScalarField,
+                                                                TheLights,
+                                                                homogeneousLights,
+                                                                oracle,
+                                                                this->ColorMap,
+                                                                this->LocalOpacities,
+                                                                this->LocalMapRayLights,
+                                                                opacities,
+                                                                this->OpacityCutoff,
+                                                                this->LocalMapTolerance);
+    LOG::Println0("Marched {} of {} light rays", numMarched, numRays);
   }
-
-  ////////////////////////////////
-  // Send the vectors
-  ////////////////////////////////
-  std::vector<MPI_Request> pullHitsMPIRequests;
-  std::vector<MPI_Status> pullHitsMPIStatuses;
-
-  int pullHitsNumMPIRequests = 1;
-  if (mpi->Rank == 0)
+  else
   {
-    pullHitsNumMPIRequests += 1 * mpi->Size;
+    MarchTransmittanceMap<Device, OracleType, vtkm::Float32>(this->SpatialExtent,
+                                                             lightRays,
+                                                             ScalarRange,
+                                                             ScalarField,
+                                                             TheLights,
+                                                             oracle,
+                                                             this->ColorMap,
+                                                             opacities,
+                                                             this->OpacityCutoff,
+                                                             0,
+                                                             numRays);
   }
-  pullHitsMPIRequests.resize(pullHitsNumMPIRequests);
-  pullHitsMPIStatuses.resize(pullHitsNumMPIRequests);
-
-  if (mpi->Rank == 0)
+  // The next frame starts from this map
+  if (this->LocalMapTolerance > 0.0f)
   {
-    int mpiRequestsOffset = 1;
-    for (int block = 0; block < mpi->Size; block++)
+    if (!updatedLocalMap)
     {
-      int requestIdx = mpiRequestsOffset + block;
-      MPI_Isend(requestHitsTable[block].data(),
-                requestHitsTable[block].size(),
-                MPI_TYPES.TransmittanceRayBlockHit,
-                block,
-                100,
-                mpiComm,
-                &pullHitsMPIRequests[requestIdx + 0]);
+      // Every ray is new, and made for the current lights
+      this->LocalMapRayLights.Allocate(numRays);
+      for (vtkm::Id l = 0; l < numLights; ++l)
+      {
+        vtkm::cont::Algorithm::CopySubRange(
+          vtkm::cont::make_ArrayHandleConstant(homogeneousLights[static_cast<std::size_t>(l)], d),
+          0,
+          d,
+          this->LocalMapRayLights,
+          l * d);
+      }
     }
+    vtkm::cont::Algorithm::Copy(opacities, this->LocalOpacities);
+    this->LocalMapBounds = this->SpatialExtent;
+    this->LocalMapSize = dims;
+    this->LocalMapScalarRange = this->ScalarRange;
+    this->LocalMapColorMap = this->ColorMap;
+    this->LocalMapCutoff = this->OpacityCutoff;
   }
-  std::vector<TransmittanceRayBlockHit> pullHitsV;
-  pullHitsV.resize(pullNumHits);
-  MPI_Irecv(pullHitsV.data(),
-            pullNumHits,
-            MPI_TYPES.TransmittanceRayBlockHit,
-            0,
-            100,
-            mpiComm,
-            &pullHitsMPIRequests[0]);
-  MPI_Waitall(pullHitsNumMPIRequests, pullHitsMPIRequests.data(), pullHitsMPIStatuses.data());
-
-  vtkm::Float32 numSteps = 128.0f;
-  vtkm::Float32 stepSize = vtkm::Magnitude(size) / numSteps;
+  AddTransmittanceFields(opacityMapDataSet, opacities);
+  PhotonMapEstimatorType transmittanceMapEstimator =
+    MakeTransmittanceEstimator<Device>(coordinates, dims, TheLights, opacities, token);
+  phase1ShadowMapTimer.Stop();
+  // FMT_TMR(phase1ShadowMapTimer);
+  Phase1Time = phase1ShadowMapTimer.GetElapsedTime();
+  this->Profiler->EndFrame();
 
-  vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> pullHits =
-    vtkm::cont::make_ArrayHandle(pullHitsV, vtkm::CopyFlag::On);
-  invoker(
-    TransmittanceFetcher2<PhotonMapEstimatorType>{ mpi->Rank, stepSize, transmittanceMapEstimator },
-    pullHits);
-  CopyPortalToVector(pullHits.ReadPortal(), pullHitsV);
+  LOG::Println0("Phase 2");
+  vtkm::cont::Timer phase2MpiTimer;
+  phase2MpiTimer.Start();
+  vtkm::cont::Invoker invoker{ Device() };
 
-  pullHitsNumMPIRequests = 1;
-  if (mpi->Rank == 0)
-  {
-    pullHitsNumMPIRequests += mpi->Size;
-  }
-  pullHitsMPIRequests.resize(pullHitsNumMPIRequests);
-  pullHitsMPIStatuses.resize(pullHitsNumMPIRequests);
-  if (mpi->Rank == 0)
+  // The hits only depend on the light, the map dims, the block layout and the transparent
+  // blocks, so they are reused for as long as none of these change
+  TransmittanceExchangeKey exchangeKey = MakeTransmittanceExchangeKey(
+    TheLights.Locations, dims, *(this->BoundsMap), transparentBlocksV);
+  // Vertices that are saturated, or never shaded, list no hits. The upstream ranks of the Push
+  // mode list the hits of every vertex for us, so it keeps them all. So do refreshes that later
+  // frames may reuse, as those can shade or saturate other vertices than this frame does.
+  vtkm::cont::ArrayHandle<vtkm::UInt8> needsRemote;
+  bool remoteVerticesChanged = false;
+  if (!useFaceImages && !usePipeline && !reuseRemote)
   {
-    int mpiRequestsOffset = 1;
-    for (int block = 0; block < mpi->Size; block++)
+    if (exchangeMode == TransmittanceExchangeMode::Push || this->RemoteRefreshInterval > 1)
     {
-      int requestIdx = mpiRequestsOffset + block;
-      MPI_Irecv(requestHitsTable[block].data(),
-                requestHitsTable[block].size(),
-                MPI_TYPES.TransmittanceRayBlockHit,
-                block,
-                101,
-                mpiComm,
-                &pullHitsMPIRequests[requestIdx + 0]);
+      vtkm::cont::Algorithm::Copy(vtkm::cont::make_ArrayHandleConstant(vtkm::UInt8(1), numRays),
+                                  needsRemote);
     }
-  }
-  MPI_Isend(pullHitsV.data(),
-            pullNumHits,
-            MPI_TYPES.TransmittanceRayBlockHit,
-            0,
-            101,
-            mpiComm,
-            &pullHitsMPIRequests[0]);
-  MPI_Waitall(pullHitsNumMPIRequests, pullHitsMPIRequests.data(), pullHitsMPIStatuses.data());
-
-  std::map<int, std::vector<TransmittanceRayBlockHit>> responseHitsTable;
-  if (mpi->Rank == 0)
-  {
-    for (auto i : requestHitsTable)
+    else
     {
-      auto& hitsV = i.second;
-      for (auto& hit : hitsV)
-      {
-        int fromRank = hit.FromBlockId;
-        auto& reponseHitsV = responseHitsTable[fromRank];
-        reponseHitsV.push_back(hit);
-      }
+      FindRemoteVertices<Device, OracleType>(this->SpatialExtent,
+                                             dims,
+                                             ScalarRange,
+                                             ScalarField,
+                                             this->CellSet.GetNumberOfCells(),
+                                             oracle,
+                                             this->ColorMap,
+                                             opacities,
+                                             this->OpacityCutoff,
+                                             needsRemote);
     }
+    std::vector<vtkm::UInt8> remoteVertexMask;
+    CopyPortalToVector(needsRemote.ReadPortal(), remoteVertexMask);
+    int changed = remoteVertexMask != this->RemoteVertexMask ? 1 : 0;
+    MPI_Allreduce(MPI_IN_PLACE, &changed, 1, MPI_INT, MPI_LOR, mpiComm);
+    remoteVerticesChanged = changed != 0;
+    this->RemoteVertexMask = std::move(remoteVertexMask);
+  }
+  if (!useFaceImages && !usePipeline && !reuseRemote &&
+      (!this->ExchangePlan.IsBuiltFor(exchangeKey) || remoteVerticesChanged))
+  {
+    const bool useGlancingHits = true;
+    vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> rayHits;
+    GetNonLocalHits<vtkm::Float32, Device>(lightRays,
+                                           *(this->BoundsMap),
+                                           transparentBlocks,
+                                           needsRemote,
+                                           useGlancingHits,
+                                           this->HitCounts,
+                                           this->HitOffsets,
+                                           rayHits);
+
+    SortHits<Device>(rayHits);
+
+    std::vector<TransmittanceRayBlockHit> sortedHitsV;
+    CopyPortalToVector(rayHits.ReadPortal(), sortedHitsV);
+    this->ExchangePlan.Reset(exchangeKey, std::move(sortedHitsV));
   }
-  std::vector<MPI_Request> responseMPIRequests;
-  std::vector<MPI_Status> responseMPIStatuses;
-  int numResponses = 1;
-  if (mpi->Rank == 0)
+  // The pipeline hits are only known once it finishes, and are not cached
+  std::vector<TransmittanceRayBlockHit> pipelineHitsV;
+  std::vector<TransmittanceRayBlockHit>& rayHitsV =
+    usePipeline ? pipelineHitsV : this->ExchangePlan.GetHits();
+  if (!usePipeline)
   {
-    numResponses += mpi->Size;
+    hitCounts = this->HitCounts;
+    hitOffsets = this->HitOffsets;
   }
-  responseMPIRequests.resize(numResponses);
-  responseMPIStatuses.resize(numResponses);
-  if (mpi->Rank == 0)
+
+  auto evaluateHits = [&](std::vector<TransmittanceRayBlockHit>& pullHitsV) {
+    vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> pullHits =
+      vtkm::cont::make_ArrayHandle(pullHitsV, vtkm::CopyFlag::On);
+    invoker(TransmittanceFetcher2<PhotonMapEstimatorType>{
+              mpi->Rank, stepSize, transmittanceMapEstimator },
+            pullHits);
+    CopyPortalToVector(pullHits.ReadPortal(), pullHitsV);
+  };
+
+  std::vector<vtkm::Float32> remoteOpacitiesV;
+  // Frames that reuse the remote opacities skip the exchange altogether
+  if (!reuseRemote)
   {
-    int mpiRequestsOffset = 1;
-    for (int block = 0; block < mpi->Size; ++block)
+    switch (exchangeMode)
     {
-      int requestIdx = mpiRequestsOffset + block;
-      auto& hits = responseHitsTable[block];
-      MPI_Isend(hits.data(),
-                hits.size(),
-                MPI_TYPES.TransmittanceRayBlockHit,
-                block,
-                102,
-                mpiComm,
-                &responseMPIRequests[requestIdx + 0]);
+      case TransmittanceExchangeMode::RootRouted:
+        ExchangeHitsThroughRoot(mpiComm, this->ExchangePlan.GetTypes(), rayHitsV, evaluateHits);
+        break;
+      case TransmittanceExchangeMode::Direct:
+        ExchangeHitsDirect(mpiComm,
+                           this->ExchangePlan.GetTypes(),
+                           *(this->BoundsMap),
+                           wireFormat,
+                           rayHitsV,
+                           evaluateHits);
+        break;
+      case TransmittanceExchangeMode::Neighborhood:
+        this->ExchangePlan.ExchangeNeighborhood(
+          mpiComm, *(this->BoundsMap), wireFormat, evaluateHits);
+        break;
+      case TransmittanceExchangeMode::Push:
+      {
+        auto generateHits = [&](vtkm::Id remoteBlockId) {
+          const bool useGlancingHits = true;
+          return GetRemoteMapHits<Device>(
+            *(this->BoundsMap), remoteBlockId, dims, TheLights, useGlancingHits);
+        };
+        this->ExchangePlan.PushNeighborhood(
+          mpiComm, *(this->BoundsMap), wireFormat, generateHits, evaluateHits);
+        break;
+      }
+      case TransmittanceExchangeMode::FaceImages:
+        remoteOpacitiesV =
+          ReceiveFaceImages(mpiComm, *(this->BoundsMap), light, dims);
+        break;
+      case TransmittanceExchangeMode::Pipelined:
+        pipelineHitsV = pipeline->Finish(evaluateHits);
+        break;
+      case TransmittanceExchangeMode::Messages:
+        if (!this->HitMessenger)
+        {
+          this->HitMessenger.reset(new TransmittanceMessenger(mpiComm));
+        }
+        this->HitMessenger->Exchange(*(this->BoundsMap), wireFormat, rayHitsV, evaluateHits);
+        break;
+      case TransmittanceExchangeMode::NodeAggregated:
+        ExchangeHitsNodeAggregated(
+          *mpi, *(this->BoundsMap), wireFormat, rayHitsV, evaluateHits);
+        break;
+      case TransmittanceExchangeMode::OneSided:
+      {
+        if (!this->OpacityWindow || this->OpacityWindow->GetMapSize() != dims)
+        {
+          // Both are collective, so every rank frees the old window before allocating the new one
+          this->OpacityWindow.reset();
+          this->OpacityWindow.reset(new TransmittanceWindow(mpiComm, dims));
+        }
+        std::vector<vtkm::Float32> opacitiesV;
+        CopyPortalToVector(opacities.ReadPortal(), opacitiesV);
+        this->OpacityWindow->Expose(opacitiesV);
+        this->OpacityWindow->Fetch(*(this->BoundsMap), rayHitsV);
+        break;
+      }
+      case TransmittanceExchangeMode::Replicated:
+      {
+        std::vector<vtkm::Float32> opacitiesV;
+        CopyPortalToVector(opacities.ReadPortal(), opacitiesV);
+        std::vector<vtkm::Float32> opacityMapsV =
+          GatherOpacityMaps(mpiComm, opacitiesV, transparentBlocksV);
+        EvaluateReplicatedHits<Device>(*(this->BoundsMap), dims, TheLights, opacityMapsV, rayHitsV);
+        break;
+      }
+      case TransmittanceExchangeMode::Auto:
+        // Already resolved to one of the modes above
+        break;
     }
   }
-
-  std::vector<TransmittanceRayBlockHit> rayHits2V;
-  rayHits2V.resize(rayHitsV.size());
-  MPI_Irecv(rayHits2V.data(),
-            rayHits2V.size(),
-            MPI_TYPES.TransmittanceRayBlockHit,
-            0,
-            102,
-            mpiComm,
-            &responseMPIRequests[0]);
-  MPI_Waitall(numResponses, responseMPIRequests.data(), responseMPIStatuses.data());
   phase2MpiTimer.Stop();
   // FMT_TMR(phase2MpiTimer);
   Phase2Time = phase2MpiTimer.GetElapsedTime();
 
-  vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> rayHits2 =
-    vtkm::cont::make_ArrayHandle(rayHits2V, vtkm::CopyFlag::On);
-
   LOG::Println0("Phase 3");
   vtkm::cont::Timer phase3ShadowMapUpdateTimer;
   phase3ShadowMapUpdateTimer.Start();
 
-  vtkm::cont::Algorithm::Sort(rayHits2, beams::rendering::HitSort());
   vtkm::cont::ArrayHandle<vtkm::Float32> newOpacities;
-  newOpacities.Allocate(opacities.GetNumberOfValues());
+  if (reuseRemote)
   {
-    auto transmittanceP = newOpacities.WritePortal();
-    auto offsetP = hitOffsets.ReadPortal();
-    auto countsP = hitCounts.ReadPortal();
-    auto hitsP = rayHits2.ReadPortal();
-    for (int i = 0; i < transmittanceP.GetNumberOfValues(); ++i)
-    {
-      auto hitCount = countsP.Get(i);
-      auto offset = offsetP.Get(i);
-      auto opacity = 0.0f;
-      for (int j = 0; j < hitCount; ++j)
-      {
-        auto hit = hitsP.Get(offset + j);
-        vtkm::Float32 localOpacity = hit.Opacity;
-        opacity = opacity + (1.0f - opacity) * localOpacity;
-      }
-      transmittanceP.Set(i, opacity);
-    }
+    vtkm::cont::Algorithm::Copy(this->RemoteOpacities, newOpacities);
+  }
+  else if (useFaceImages)
+  {
+    newOpacities = vtkm::cont::make_ArrayHandle(remoteOpacitiesV, vtkm::CopyFlag::On);
+  }
+  else
+  {
+    // The exchange keeps the hits in their sorted order, so the counts and offsets still apply
+    vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> rayHits2 =
+      vtkm::cont::make_ArrayHandle(rayHitsV, vtkm::CopyFlag::On);
+
+    vtkm::cont::Invoker invoker{ Device() };
+    invoker(RemoteOpacityAccumulator{}, hitCounts, hitOffsets, rayHits2, newOpacities);
   }
 
-  vtkm::cont::ArrayHandle<vtkm::Float32> old;
-  old.Allocate(opacities.GetNumberOfValues());
-  vtkm::cont::Algorithm::Copy(opacities, old);
+  // The remote opacities are copied, the local map is composed onto newOpacities below
+  if (reuseRemote)
+  {
+    this->FramesSinceRemoteRefresh++;
+  }
+  else
+  {
+    vtkm::cont::Algorithm::Copy(newOpacities, this->RemoteOpacities);
+    this->FramesSinceRemoteRefresh = 0;
+    this->RemoteRefreshLightPositions = TheLights.Locations;
+    this->RemoteRefreshBounds = this->BoundsMap->GlobalBounds;
+    this->RemoteRefreshScalarRange = this->ScalarRange;
+    this->RemoteRefreshColorMap = this->ColorMap;
+    this->RemoteRefreshCutoff = this->OpacityCutoff;
+  }
 
+  // The local map does not depend on the remote opacities, so the one from Phase 1 is composed
+  // onto them instead of being marched again
+  ComposeTransmittanceMaps<Device>(opacities, newOpacities);
+  AddTransmittanceFields(opacityMapDataSet, newOpacities);
   transmittanceMapEstimator =
-    GenerateEstimator<Device, OracleType, vtkm::Float32>(this->SpatialExtent,
-                                                         dims,
-                                                         opacityMapDataSet,
-                                                         lightRays,
-                                                         ScalarRange,
-                                                         ScalarField,
-                                                         TheLights,
-                                                         oracle,
-                                                         this->ColorMap,
-                                                         newOpacities,
-                                                         token);
+    MakeTransmittanceEstimator<Device>(coordinates, dims, TheLights, newOpacities, token);
   auto final = newOpacities;
+  if (useFaceImages)
+  {
+    std::vector<vtkm::Float32> finalV;
+    CopyPortalToVector(final.ReadPortal(), finalV);
+    SendFaceImages(mpiComm, *(this->BoundsMap), light, dims, finalV);
+  }
   phase3ShadowMapUpdateTimer.Stop();
   // FMT_TMR(phase3ShadowMapUpdateTimer);
   Phase3Time = phase3ShadowMapUpdateTimer.GetElapsedTime();
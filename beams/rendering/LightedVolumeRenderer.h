@@ -4,6 +4,9 @@
 #include "../Profiler.h"
 #include "BoundsMap.h"
 #include "LightCollection.h"
+#include "TransmittanceExchange.h"
+#include "TransmittanceMessenger.h"
+#include "UniformMeshOracle.h"
 
 #include "Lights.h"
 #include <vtkm/cont/DataSet.h>
@@ -49,6 +52,9 @@ public:
   VTKM_CONT
   void SetSampleDistance(const vtkm::Float32& distance);
 
+  // Every light gets its own opacity map. With several lights the maps are always marched, and
+  // the exchange modes that cannot tell the lights apart fall back to Neighborhood. A directional
+  // light has to be the only one, its map is always swept and exchanged as face images.
   VTKM_CONT
   void AddLight(std::shared_ptr<Light> light);
 
@@ -61,9 +67,48 @@ public:
   VTKM_CONT
   void SetShadowMapSize(vtkm::Id3 size) { this->ShadowMapSize = size; }
 
+  // Generates the opacity map slice by slice away from the light instead of marching a ray to
+  // every vertex. The pipelined exchange generates it in z chunks and always marches.
+  VTKM_CONT
+  void SetUseSweptMap(bool useSweptMap) { this->UseSweptMap = useSweptMap; }
+
+  // Light rays stop marching once their opacity reaches cutoff, and vertices the local map
+  // already saturates ask the other blocks for nothing
+  VTKM_CONT
+  void SetOpacityCutoff(vtkm::Float32 cutoff) { this->OpacityCutoff = cutoff; }
+
   VTKM_CONT
   void SetBoundsMap(beams::rendering::BoundsMap* boundsMap) { this->BoundsMap = boundsMap; }
 
+  VTKM_CONT
+  void SetExchangeMode(TransmittanceExchangeMode mode) { this->ExchangeMode = mode; }
+
+  VTKM_CONT
+  void SetWireFormat(TransmittanceWireFormat format) { this->WireFormat = format; }
+
+  VTKM_CONT
+  void SetPipelineChunks(vtkm::Id numChunks) { this->PipelineChunks = numChunks; }
+
+  // The most bytes of opacity maps the Auto exchange mode replicates on every rank
+  VTKM_CONT
+  void SetReplicationThreshold(vtkm::Id bytes) { this->ReplicationThreshold = bytes; }
+
+  // The remote opacities are only exchanged every numFrames frames, or as soon as a light has
+  // moved more than degrees around the center of the data. The frames in between reuse the
+  // last ones and only regenerate the local map. One frame, the default, refreshes every frame.
+  VTKM_CONT
+  void SetRemoteRefreshInterval(vtkm::Id numFrames) { this->RemoteRefreshInterval = numFrames; }
+
+  VTKM_CONT
+  void SetRemoteRefreshAngle(vtkm::Float32 degrees) { this->RemoteRefreshAngle = degrees; }
+
+  // Starts the marched local map from the one of the previous frame, and only marches the light
+  // rays whose path through the block moved by more than a map cell, or by enough to change their
+  // opacity by more than tolerance along the shadow edges of the previous map. 0, the default,
+  // marches every ray every frame.
+  VTKM_CONT
+  void SetLocalMapTolerance(vtkm::Float32 tolerance) { this->LocalMapTolerance = tolerance; }
+
   VTKM_CONT
   void SetProfiler(std::shared_ptr<beams::Profiler> profiler) { this->Profiler = profiler; }
 
@@ -73,15 +118,25 @@ public:
   std::shared_ptr<beams::Profiler> Profiler;
 
 protected:
-  template <typename Precision, typename Device>
-  VTKM_CONT void RenderOnDevice(vtkm::rendering::raytracing::Ray<Precision>& rays, Device);
+  template <typename Precision, typename Device, typename OracleType>
+  VTKM_CONT void RenderOnDevice(vtkm::rendering::raytracing::Ray<Precision>& rays,
+                                OracleType& oracle,
+                                Device);
 
   template <typename Precision, typename Device, typename RectilinearOracleType>
   VTKM_CONT RectilinearOracleType BuildRectilinearOracle();
 
+  VTKM_CONT UniformMeshOracle BuildUniformOracle();
+
   template <typename Precision>
   struct RenderFunctor;
 
+  // Decides the same on every rank, so the ranks that skip Phase 2 all skip it together
+  VTKM_CONT bool CanReuseRemoteOpacities(vtkm::Id numRays) const;
+
+  // Whether the local map of the previous frame was made for the same map, data and color map
+  VTKM_CONT bool CanUpdateLocalMap(vtkm::Id numRays) const;
+
   LightCollection Lights;
   bool IsSceneDirty;
   bool IsUniformDataSet;
@@ -96,8 +151,40 @@ public:
   vtkm::Float32 SampleDistance;
   vtkm::Range ScalarRange;
   vtkm::rendering::raytracing::Lights TheLights;
+  bool IsDirectionalLight;
+  // The settings that multiple lights override are only reported on the first such frame
+  bool IsMultiLightOverrideLogged;
   bool UseShadowMap;
   vtkm::Id3 ShadowMapSize;
+  bool UseSweptMap;
+  vtkm::Float32 OpacityCutoff;
+  TransmittanceExchangeMode ExchangeMode;
+  TransmittanceWireFormat WireFormat;
+  vtkm::Id PipelineChunks;
+  vtkm::Id ReplicationThreshold;
+  TransmittanceExchangePlan ExchangePlan;
+  std::unique_ptr<TransmittanceMessenger> HitMessenger;
+  std::unique_ptr<TransmittanceWindow> OpacityWindow;
+  vtkm::cont::ArrayHandle<vtkm::Id> HitCounts;
+  vtkm::cont::ArrayHandle<vtkm::Id> HitOffsets;
+  std::vector<vtkm::UInt8> RemoteVertexMask;
+  vtkm::Id RemoteRefreshInterval;
+  vtkm::Float32 RemoteRefreshAngle;
+  vtkm::Id FramesSinceRemoteRefresh;
+  std::vector<vtkm::Vec3f_32> RemoteRefreshLightPositions;
+  vtkm::Bounds RemoteRefreshBounds;
+  vtkm::Range RemoteRefreshScalarRange;
+  vtkm::cont::ArrayHandle<vtkm::Vec4f_32> RemoteRefreshColorMap;
+  vtkm::Float32 RemoteRefreshCutoff;
+  vtkm::cont::ArrayHandle<vtkm::Float32> RemoteOpacities;
+  vtkm::Float32 LocalMapTolerance;
+  vtkm::Bounds LocalMapBounds;
+  vtkm::Id3 LocalMapSize;
+  vtkm::Range LocalMapScalarRange;
+  vtkm::cont::ArrayHandle<vtkm::Vec4f_32> LocalMapColorMap;
+  vtkm::Float32 LocalMapCutoff;
+  vtkm::cont::ArrayHandle<vtkm::Vec4f_32> LocalMapRayLights;
+  vtkm::cont::ArrayHandle<vtkm::Float32> LocalOpacities;
 };
 } // namespace rendering
 } // namespace beams
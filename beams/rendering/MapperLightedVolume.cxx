@@ -13,6 +13,7 @@
 #include <vtkm/thirdparty/diy/diy.h>
 #include <vtkm/thirdparty/diy/mpi-cast.h>
 
+#include <algorithm>
 #include <mpi.h>
 #include <sstream>
 
@@ -98,11 +99,56 @@ void MapperLightedVolume::SetUseShadowMap(bool useShadowMap)
   this->Internals->Tracer.SetUseShadowMap(useShadowMap);
 }
 
+void MapperLightedVolume::SetUseSweptMap(bool useSweptMap)
+{
+  this->Internals->Tracer.SetUseSweptMap(useSweptMap);
+}
+
+void MapperLightedVolume::SetOpacityCutoff(vtkm::Float32 cutoff)
+{
+  this->Internals->Tracer.SetOpacityCutoff(cutoff);
+}
+
 void MapperLightedVolume::SetShadowMapSize(vtkm::Id3 size)
 {
   this->Internals->Tracer.SetShadowMapSize(size);
 }
 
+void MapperLightedVolume::SetExchangeMode(beams::rendering::TransmittanceExchangeMode mode)
+{
+  this->Internals->Tracer.SetExchangeMode(mode);
+}
+
+void MapperLightedVolume::SetWireFormat(beams::rendering::TransmittanceWireFormat format)
+{
+  this->Internals->Tracer.SetWireFormat(format);
+}
+
+void MapperLightedVolume::SetPipelineChunks(vtkm::Id numChunks)
+{
+  this->Internals->Tracer.SetPipelineChunks(numChunks);
+}
+
+void MapperLightedVolume::SetReplicationThreshold(vtkm::Id bytes)
+{
+  this->Internals->Tracer.SetReplicationThreshold(bytes);
+}
+
+void MapperLightedVolume::SetRemoteRefreshInterval(vtkm::Id numFrames)
+{
+  this->Internals->Tracer.SetRemoteRefreshInterval(numFrames);
+}
+
+void MapperLightedVolume::SetRemoteRefreshAngle(vtkm::Float32 degrees)
+{
+  this->Internals->Tracer.SetRemoteRefreshAngle(degrees);
+}
+
+void MapperLightedVolume::SetLocalMapTolerance(vtkm::Float32 tolerance)
+{
+  this->Internals->Tracer.SetLocalMapTolerance(tolerance);
+}
+
 void WriteCanvas(vtkm::rendering::CanvasRayTracer* canvas)
 {
   auto mpi = pilot::mpi::Environment::Get();
@@ -242,9 +288,6 @@ void MapperLightedVolume::GlobalComposite(const vtkm::rendering::Camera& camera)
 
   auto colorBuffer = this->Internals->Canvas->GetColorBuffer();
   int numPixels = colorBuffer.GetNumberOfValues();
-  int totalNumPixels = mpi->Size * numPixels;
-
-  std::vector<vtkm::Vec4f_32> gatheredColors;
 
   MPI_Datatype MPI_VEC4F32;
   MPI_Type_contiguous(4, MPI_FLOAT, &MPI_VEC4F32);
@@ -252,53 +295,77 @@ void MapperLightedVolume::GlobalComposite(const vtkm::rendering::Camera& camera)
 
   std::vector<vtkm::Vec4f_32> colorVals;
   CopyIntoVec(colorBuffer.ReadPortal(), colorVals);
-  if (mpi->Rank == 0)
+
+  // The images are composited front to back along a binary tree over the depth order. At every
+  // level the rank holding the image of depth positions [p, p + step) receives the one of
+  // [p + step, p + 2 * step) and puts it behind its own, so no rank holds more than two images
+  // and the front-most rank has the final one after log2(P) levels.
+  const int compositeTag = 200;
+  const int position = static_cast<int>(
+    std::find(depthRanks.begin(), depthRanks.end(), mpi->Rank) - depthRanks.begin());
+  std::vector<vtkm::Vec4f_32> backVals(numPixels);
+  for (int step = 1; step < mpi->Size; step *= 2)
   {
-    gatheredColors.resize(totalNumPixels);
-    MPI_Gather(colorVals.data(),
-               numPixels,
-               MPI_VEC4F32,
-               gatheredColors.data(),
+    if (position % (2 * step) != 0)
+    {
+      MPI_Send(colorVals.data(),
                numPixels,
                MPI_VEC4F32,
-               0,
+               depthRanks[position - step],
+               compositeTag,
                mpiComm);
-  }
-  else
-  {
-    MPI_Gather(colorVals.data(), numPixels, MPI_VEC4F32, nullptr, 0, MPI_VEC4F32, 0, mpiComm);
-  }
-
-  if (mpi->Rank != 0)
-    return;
-
-  std::vector<vtkm::Vec4f_32> finalBuffer;
-  finalBuffer.resize(numPixels);
-  int offsetStart = depthRanks[0] * numPixels;
-  int offsetEnd = offsetStart + numPixels;
-  for (int i = offsetStart; i < offsetEnd; ++i)
-  {
-    finalBuffer[i - offsetStart] = gatheredColors[i];
-  }
+      break;
+    }
+    if (position + step >= mpi->Size)
+    {
+      continue;
+    }
 
-  for (std::size_t i = 1; i < depthRanks.size(); ++i)
-  {
-    int offset = depthRanks[i] * numPixels;
+    MPI_Recv(backVals.data(),
+             numPixels,
+             MPI_VEC4F32,
+             depthRanks[position + step],
+             compositeTag,
+             mpiComm,
+             MPI_STATUS_IGNORE);
     for (int j = 0; j < numPixels; ++j)
     {
-      auto a = finalBuffer[j];
-      auto b = gatheredColors[j + offset];
+      auto a = colorVals[j];
+      auto b = backVals[j];
 
       a[0] = a[0] + b[0] * (1.0f - a[3]);
       a[1] = a[1] + b[1] * (1.0f - a[3]);
       a[2] = a[2] + b[2] * (1.0f - a[3]);
       a[3] = a[3] + b[3] * (1.0f - a[3]);
 
-      finalBuffer[j] = a;
+      colorVals[j] = a;
+    }
+  }
+
+  // The final image belongs on rank 0
+  if (depthRanks[0] != 0)
+  {
+    if (position == 0)
+    {
+      MPI_Send(colorVals.data(), numPixels, MPI_VEC4F32, 0, compositeTag, mpiComm);
+    }
+    else if (mpi->Rank == 0)
+    {
+      MPI_Recv(colorVals.data(),
+               numPixels,
+               MPI_VEC4F32,
+               depthRanks[0],
+               compositeTag,
+               mpiComm,
+               MPI_STATUS_IGNORE);
     }
   }
+  MPI_Type_free(&MPI_VEC4F32);
+
+  if (mpi->Rank != 0)
+    return;
 
-  vtkm::cont::Algorithm::Copy(vtkm::cont::make_ArrayHandle(finalBuffer, vtkm::CopyFlag::Off),
+  vtkm::cont::Algorithm::Copy(vtkm::cont::make_ArrayHandle(colorVals, vtkm::CopyFlag::Off),
                               colorBuffer);
 }
 
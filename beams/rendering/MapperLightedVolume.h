@@ -4,6 +4,7 @@
 #include "../Profiler.h"
 #include "BoundsMap.h"
 #include "Light.h"
+#include "TransmittanceExchange.h"
 
 #include <vtkm/rendering/Mapper.h>
 
@@ -30,6 +31,33 @@ public:
 
   void SetUseShadowMap(bool useShadowMap);
 
+  VTKM_CONT
+  void SetUseSweptMap(bool useSweptMap);
+
+  VTKM_CONT
+  void SetOpacityCutoff(vtkm::Float32 cutoff);
+
+  VTKM_CONT
+  void SetExchangeMode(beams::rendering::TransmittanceExchangeMode mode);
+
+  VTKM_CONT
+  void SetWireFormat(beams::rendering::TransmittanceWireFormat format);
+
+  VTKM_CONT
+  void SetPipelineChunks(vtkm::Id numChunks);
+
+  VTKM_CONT
+  void SetReplicationThreshold(vtkm::Id bytes);
+
+  VTKM_CONT
+  void SetRemoteRefreshInterval(vtkm::Id numFrames);
+
+  VTKM_CONT
+  void SetRemoteRefreshAngle(vtkm::Float32 degrees);
+
+  VTKM_CONT
+  void SetLocalMapTolerance(vtkm::Float32 tolerance);
+
   virtual void RenderCells(const vtkm::cont::UnknownCellSet& cellset,
                            const vtkm::cont::CoordinateSystem& coords,
                            const vtkm::cont::Field& scalarField,
@@ -136,21 +136,20 @@ public:
     return vtkm::UInt8(CELL_SHAPE_HEXAHEDRON);
   }
 
-  template <typename T>
-  VTKM_EXEC_CONT void FindCellImpl(const vtkm::Vec<T, 3>& point,
-                                   vtkm::Id& cellId,
-                                   vtkm::Vec<T, 3>& pcoords) const
-  {
-    // check is in -> search assumes this
-    vtkm::Vec<vtkm::Id, 3> cell;
-    cellId = -1;
-    bool inside = IsInside(point);
+  VTKM_EXEC_CONT
+  vtkm::Id3 GetCellDims() const { return CellDims; }
 
-    if (!inside)
-    {
-      return;
-    }
+  // The coordinate of the index-th grid plane across dim
+  VTKM_EXEC_CONT
+  vtkm::Float32 GetPlane(vtkm::Int32 dim, vtkm::Id index) const
+  {
+    return static_cast<vtkm::Float32>(CoordPortals[dim].Get(index));
+  }
 
+  // The cell containing point, or the closest one on the boundary when point is outside
+  template <typename T>
+  VTKM_EXEC_CONT void LocateCell(const vtkm::Vec<T, 3>& point, vtkm::Vec<vtkm::Id, 3>& cell) const
+  {
     for (vtkm::Int32 dim = 0; dim < 3; ++dim)
     {
       vtkm::Id low = 0;
@@ -172,9 +171,26 @@ public:
         }
       }
 
-      cell[dim] = low;
+      cell[dim] = low < CellDims[dim] ? low : CellDims[dim] - 1;
+    }
+  }
+
+  template <typename T>
+  VTKM_EXEC_CONT void FindCellImpl(const vtkm::Vec<T, 3>& point,
+                                   vtkm::Id& cellId,
+                                   vtkm::Vec<T, 3>& pcoords) const
+  {
+    // check is in -> search assumes this
+    vtkm::Vec<vtkm::Id, 3> cell;
+    cellId = -1;
+    bool inside = IsInside(point);
+
+    if (!inside)
+    {
+      return;
     }
 
+    LocateCell(point, cell);
 
     vtkm::Vec<T, 3> minPoint;
     vtkm::Vec<T, 3> maxPoint;
@@ -1 +1,45 @@
-#include "Scene.h"
\ No newline at end of file
+#include "Scene.h"
+#include "../Config.h"
+#include "DirectionalLight.h"
+#include "PointLight.h"
+
+namespace beams
+{
+namespace rendering
+{
+void Scene::SetOpacityMapOptions(const beams::OpacityMapOptions& options)
+{
+  this->ExchangeMode = options.ExchangeMode;
+  this->WireFormat = options.WireFormat;
+  this->PipelineChunks = options.PipelineChunks;
+  this->ReplicationThreshold = options.ReplicationThreshold;
+  this->RemoteRefreshInterval = options.RemoteRefreshInterval;
+  this->RemoteRefreshAngle = options.RemoteRefreshAngle;
+  this->UseSweptMap = options.UseSweptMap;
+  this->LocalMapTolerance = options.LocalMapTolerance;
+}
+
+void Scene::ApplyOpacityMapOptions()
+{
+  this->Mapper.SetExchangeMode(this->ExchangeMode);
+  this->Mapper.SetWireFormat(this->WireFormat);
+  this->Mapper.SetPipelineChunks(this->PipelineChunks);
+  this->Mapper.SetReplicationThreshold(this->ReplicationThreshold);
+  this->Mapper.SetRemoteRefreshInterval(this->RemoteRefreshInterval);
+  this->Mapper.SetRemoteRefreshAngle(this->RemoteRefreshAngle);
+  this->Mapper.SetUseSweptMap(this->UseSweptMap);
+  this->Mapper.SetLocalMapTolerance(this->LocalMapTolerance);
+}
+
+std::shared_ptr<beams::rendering::Light> Scene::CreateLight(vtkm::Float32 intensity) const
+{
+  if (this->LightType == "directional")
+  {
+    return std::make_shared<beams::rendering::DirectionalLight<vtkm::Float32>>(
+      -this->LightPosition, this->LightColor, intensity);
+  }
+  return std::make_shared<beams::rendering::PointLight<vtkm::Float32>>(
+    this->LightPosition, this->LightColor, intensity);
+}
+}
+} // namespace beams::rendering
@@ -20,6 +20,8 @@ class CanvasRayTracer;
 
 namespace beams
 {
+struct OpacityMapOptions;
+
 namespace rendering
 {
 struct Scene
@@ -29,6 +31,17 @@ struct Scene
 
   virtual beams::Result Ready() = 0;
 
+  // Takes the settings of the preset's opacity map options other than the map size, which
+  // each scene picks on its own
+  void SetOpacityMapOptions(const beams::OpacityMapOptions& options);
+
+  // Passes the settings taken by SetOpacityMapOptions on to the mapper
+  void ApplyOpacityMapOptions();
+
+  // A point light at LightPosition, or for the "directional" type a light shining from
+  // LightPosition towards the origin
+  std::shared_ptr<beams::rendering::Light> CreateLight(vtkm::Float32 intensity) const;
+
   std::string Id;
   std::string FieldName;
   vtkm::Range Range;
@@ -39,7 +52,18 @@ struct Scene
   vtkm::rendering::CanvasRayTracer* Canvas;
   vtkm::Vec3f LightPosition;
   vtkm::Vec3f LightColor;
+  std::string LightType = "point";
   vtkm::Id3 ShadowMapSize;
+  beams::rendering::TransmittanceExchangeMode ExchangeMode =
+    beams::rendering::TransmittanceExchangeMode::Neighborhood;
+  beams::rendering::TransmittanceWireFormat WireFormat =
+    beams::rendering::TransmittanceWireFormat::Full;
+  vtkm::Id PipelineChunks = 8;
+  vtkm::Id ReplicationThreshold = 16 * 1024 * 1024;
+  vtkm::Id RemoteRefreshInterval = 1;
+  vtkm::Float32 RemoteRefreshAngle = 5.0f;
+  bool UseSweptMap = false;
+  vtkm::Float32 LocalMapTolerance = 0.0f;
   vtkm::Float32 Azimuth;
   vtkm::Float32 Elevation;
   std::shared_ptr<beams::rendering::BoundsMap> BoundsMap;
@@ -1,6 +1,5 @@
 #include "SpheresScene.h"
 #include "../sources/Spheres.h"
-#include "PointLight.h"
 #include <pilot/Logger.h>
 #include <pilot/mpi/Environment.h>
 
@@ -114,7 +113,9 @@ scene->Azimuth = preset.CameraOptions.Azimuth;
 scene->Elevation = preset.CameraOptions.Elevation;
 
 scene->LightColor = preset.LightOptions.Lights[0].Color;
+scene->LightType = preset.LightOptions.Lights[0].Type;
 scene->ShadowMapSize = preset.OpacityMapOptions.Size;
+scene->SetOpacityMapOptions(preset.OpacityMapOptions);
 
 totalTimer.Stop();
 
@@ -150,10 +151,9 @@ beams::Result SpheresScene::Ready()
   this->Mapper.SetBoundsMap(this->BoundsMap.get());
   this->Mapper.SetUseShadowMap(true);
   this->Mapper.SetShadowMapSize(this->ShadowMapSize);
+  this->ApplyOpacityMapOptions();
   this->LightPosition = vtkm::Vec3f_32{ 3.1f, 3.55f, 0.5f };
-  std::shared_ptr<beams::rendering::Light> light =
-    std::make_shared<beams::rendering::PointLight<vtkm::Float32>>(
-      this->LightPosition, this->LightColor, 2.0f);
+  std::shared_ptr<beams::rendering::Light> light = this->CreateLight(2.0f);
   this->Mapper.ClearLights();
   this->Mapper.AddLight(light);
 
@@ -1,6 +1,5 @@
 #include "SubdividedSpheresScene.h"
 #include "../sources/Spheres.h"
-#include "PointLight.h"
 #include <pilot/Logger.h>
 #include <pilot/mpi/Environment.h>
 
@@ -86,7 +85,9 @@ std::shared_ptr<beams::rendering::Scene> SubdividedSpheresScene::CreateFromPrese
   scene->Elevation = preset.CameraOptions.Elevation;
 
   scene->LightColor = preset.LightOptions.Lights[0].Color;
+  scene->LightType = preset.LightOptions.Lights[0].Type;
   scene->ShadowMapSize = preset.OpacityMapOptions.CalculateSize(dims);
+  scene->SetOpacityMapOptions(preset.OpacityMapOptions);
   LOG::Println0("Opacity map size = {}", scene->ShadowMapSize);
 
   totalTimer.Stop();
@@ -122,10 +123,9 @@ beams::Result SubdividedSpheresScene::Ready()
   this->Mapper.SetBoundsMap(this->BoundsMap.get());
   this->Mapper.SetUseShadowMap(true);
   this->Mapper.SetShadowMapSize(this->ShadowMapSize);
+  this->ApplyOpacityMapOptions();
   this->LightPosition = vtkm::Vec3f_32{ 0.5f, 5.0f, 0.5f };
-  std::shared_ptr<beams::rendering::Light> light =
-    std::make_shared<beams::rendering::PointLight<vtkm::Float32>>(
-      this->LightPosition, this->LightColor, 2.0f);
+  std::shared_ptr<beams::rendering::Light> light = this->CreateLight(2.0f);
   this->Mapper.ClearLights();
   this->Mapper.AddLight(light);
 
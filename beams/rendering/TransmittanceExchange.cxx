@@ -0,0 +1,2156 @@
+#include "TransmittanceExchange.h"
+#include "../Math.h"
+#include "BoundsMap.h"
+
+#include <pilot/mpi/Environment.h>
+
+#include <vtkm/cont/ErrorBadValue.h>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <numeric>
+#include <string>
+#include <tuple>
+
+namespace beams
+{
+namespace rendering
+{
+namespace
+{
+const int FaceImageTag = 104;
+const int PipelineQueryTag = 105;
+const int PipelineReplyTag = 106;
+
+std::vector<int> ScanExclusive(const std::vector<int>& counts)
+{
+  std::vector<int> offsets(counts.size(), 0);
+  if (!counts.empty())
+  {
+    std::partial_sum(counts.begin(), counts.end() - 1, offsets.begin() + 1);
+  }
+  return offsets;
+}
+
+bool Overlaps(const vtkm::Bounds& a, const vtkm::Bounds& b, vtkm::Float64 pad)
+{
+  return a.X.Min <= b.X.Max + pad && b.X.Min <= a.X.Max + pad && a.Y.Min <= b.Y.Max + pad &&
+    b.Y.Min <= a.Y.Max + pad && a.Z.Min <= b.Z.Max + pad && b.Z.Min <= a.Z.Max + pad;
+}
+
+void SortUnique(std::vector<int>& values)
+{
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+}
+
+vtkm::Float64 BoundsPad(const beams::rendering::BoundsMap& boundsMap)
+{
+  return 1e-4 * beams::Math::BoundsMagnitude<vtkm::Float64>(boundsMap.GlobalBounds);
+}
+
+const vtkm::Range& AxisRange(const vtkm::Bounds& bounds, int axis)
+{
+  return axis == 0 ? bounds.X : (axis == 1 ? bounds.Y : bounds.Z);
+}
+
+// The two axes spanning a face normal to axis, in increasing order
+void FaceAxes(int axis, int& u, int& w)
+{
+  u = axis == 0 ? 1 : 0;
+  w = axis == 2 ? 1 : 2;
+}
+
+int NeighborIndex(const std::vector<int>& neighbors, int rank)
+{
+  auto it = std::lower_bound(neighbors.begin(), neighbors.end(), rank);
+  if (it == neighbors.end() || *it != rank)
+  {
+    return -1;
+  }
+  return static_cast<int>(it - neighbors.begin());
+}
+
+// Both directions of the light-visibility graph of the blocks of rank, over all the lights.
+// Every rank knows all the block bounds, so they are found locally.
+void FindNeighborRanks(int rank,
+                       const beams::rendering::BoundsMap& boundsMap,
+                       const std::vector<vtkm::Vec3f_32>& lightPositions,
+                       const std::vector<vtkm::UInt8>& transparentBlocks,
+                       TransmittanceNeighborhood& neighborhood)
+{
+  for (const vtkm::Vec3f_32& lightPosition : lightPositions)
+  {
+    for (vtkm::Id block = 0; block < boundsMap.TotalNumBlocks; ++block)
+    {
+      int owner = boundsMap.FindRank(block);
+      bool isLocal = owner == rank;
+      std::vector<vtkm::Id> upstreamBlocks =
+        FindUpstreamBlocks(boundsMap, block, lightPosition, transparentBlocks);
+      for (vtkm::Id upstreamBlock : upstreamBlocks)
+      {
+        int upstreamOwner = boundsMap.FindRank(upstreamBlock);
+        if (isLocal && upstreamOwner != rank)
+        {
+          neighborhood.UpstreamRanks.push_back(upstreamOwner);
+        }
+        else if (!isLocal && upstreamOwner == rank)
+        {
+          neighborhood.DownstreamRanks.push_back(owner);
+        }
+      }
+    }
+  }
+  SortUnique(neighborhood.UpstreamRanks);
+  SortUnique(neighborhood.DownstreamRanks);
+}
+
+std::vector<QuantizedPoint> EncodeQueries(const std::vector<TransmittanceRayBlockHit>& hits,
+                                          const beams::rendering::BoundsMap& boundsMap)
+{
+  std::vector<QuantizedPoint> points(hits.size());
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    const vtkm::Bounds& bounds = boundsMap.BlockBounds[static_cast<std::size_t>(hits[i].BlockId)];
+    points[i] = QuantizePoint(hits[i].Point, bounds);
+  }
+  return points;
+}
+
+// The points from each source rank become queries against the local block, numbered by their
+// position in that source's list
+std::vector<TransmittanceRayBlockHit> DecodeQueries(const std::vector<QuantizedPoint>& points,
+                                                    const std::vector<int>& counts,
+                                                    const std::vector<int>& offsets,
+                                                    const std::vector<int>& sourceRanks,
+                                                    const beams::rendering::BoundsMap& boundsMap)
+{
+  const vtkm::Id localBlock = boundsMap.GetLocalBlockId();
+  const vtkm::Bounds& bounds = boundsMap.BlockBounds[static_cast<std::size_t>(localBlock)];
+  std::vector<TransmittanceRayBlockHit> queries(points.size());
+  for (std::size_t source = 0; source < sourceRanks.size(); ++source)
+  {
+    for (int i = 0; i < counts[source]; ++i)
+    {
+      std::size_t pos = static_cast<std::size_t>(offsets[source] + i);
+      TransmittanceRayBlockHit& query = queries[pos];
+      query.RayId = i;
+      query.BlockId = static_cast<int>(localBlock);
+      query.FromBlockId = sourceRanks[source];
+      query.Point = DequantizePoint(points[pos], bounds);
+      query.RayT = 0.0f;
+      query.Opacity = 0.0f;
+    }
+  }
+  return queries;
+}
+
+std::vector<vtkm::UInt16> EncodeReplies(const std::vector<TransmittanceRayBlockHit>& queries)
+{
+  std::vector<vtkm::UInt16> replies(queries.size());
+  for (std::size_t i = 0; i < queries.size(); ++i)
+  {
+    replies[i] = QuantizeOpacity(queries[i].Opacity);
+  }
+  return replies;
+}
+
+// Neighboring downstream blocks share the vertices of their common face, so the rays from those
+// vertices hit the local block at the same points and the same query arrives from each of them.
+// Returns every distinct query once, and where each of the given ones ended up. The points are
+// computed independently by each sender and can differ in the last bits, so they are compared
+// quantized to the block like the Compact format sends them. Queries of different lights are
+// answered from different maps, so they are never merged.
+std::vector<TransmittanceRayBlockHit> FindUniqueQueries(
+  const beams::rendering::BoundsMap& boundsMap,
+  const std::vector<TransmittanceRayBlockHit>& queries,
+  vtkm::Id numVertices,
+  std::vector<std::size_t>& uniqueIds)
+{
+  using PointKey = std::tuple<vtkm::Id, int, vtkm::UInt16, vtkm::UInt16, vtkm::UInt16>;
+  std::map<PointKey, std::size_t> seen;
+  std::vector<TransmittanceRayBlockHit> unique;
+  uniqueIds.resize(queries.size());
+  for (std::size_t i = 0; i < queries.size(); ++i)
+  {
+    const TransmittanceRayBlockHit& query = queries[i];
+    const vtkm::Bounds& bounds = boundsMap.BlockBounds[static_cast<std::size_t>(query.BlockId)];
+    QuantizedPoint point = QuantizePoint(query.Point, bounds);
+    PointKey key(static_cast<vtkm::Id>(query.RayId) / numVertices,
+                 query.BlockId,
+                 point[0],
+                 point[1],
+                 point[2]);
+    auto inserted = seen.emplace(key, unique.size());
+    if (inserted.second)
+    {
+      unique.push_back(query);
+    }
+    uniqueIds[i] = inserted.first->second;
+  }
+  return unique;
+}
+
+// The hits bucketed by upstream neighbor and the queries received from the downstream ones
+struct NeighborhoodRoute
+{
+  std::vector<int> SendCounts;
+  std::vector<int> SendOffsets;
+  std::vector<TransmittanceRayBlockHit> SendHits;
+  std::vector<std::size_t> SendOrder;
+  std::vector<int> RecvCounts;
+  std::vector<int> RecvOffsets;
+  std::vector<TransmittanceRayBlockHit> Queries;
+};
+
+NeighborhoodRoute BucketHits(const beams::rendering::BoundsMap& boundsMap,
+                             const TransmittanceNeighborhood& neighborhood,
+                             std::vector<TransmittanceRayBlockHit>& hits)
+{
+  const std::vector<int>& upstream = neighborhood.UpstreamRanks;
+  NeighborhoodRoute route;
+
+  // Bucket the hits by the upstream neighbor owning the block they hit
+  std::vector<int> hitNeighbors(hits.size());
+  route.SendCounts.resize(upstream.size(), 0);
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    int neighbor = NeighborIndex(upstream, boundsMap.FindRank(hits[i].BlockId));
+    hitNeighbors[i] = neighbor;
+    if (neighbor < 0)
+    {
+      hits[i].Opacity = 0.0f;
+      continue;
+    }
+    route.SendCounts[static_cast<std::size_t>(neighbor)]++;
+  }
+  route.SendOffsets = ScanExclusive(route.SendCounts);
+  int numSent = std::accumulate(route.SendCounts.begin(), route.SendCounts.end(), 0);
+
+  // SendOrder remembers where each bucketed hit came from, so answers can be put back in place
+  route.SendHits.resize(static_cast<std::size_t>(numSent));
+  route.SendOrder.resize(route.SendHits.size());
+  std::vector<int> cursors = route.SendOffsets;
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    if (hitNeighbors[i] < 0)
+    {
+      continue;
+    }
+    int pos = cursors[static_cast<std::size_t>(hitNeighbors[i])]++;
+    route.SendHits[pos] = hits[i];
+    route.SendOrder[pos] = i;
+  }
+  return route;
+}
+
+NeighborhoodRoute RouteQueries(const MpiTypes& types,
+                               const beams::rendering::BoundsMap& boundsMap,
+                               const TransmittanceNeighborhood& neighborhood,
+                               TransmittanceWireFormat format,
+                               std::vector<TransmittanceRayBlockHit>& hits)
+{
+  NeighborhoodRoute route = BucketHits(boundsMap, neighborhood, hits);
+
+  route.RecvCounts.resize(neighborhood.DownstreamRanks.size(), 0);
+  MPI_Neighbor_alltoall(route.SendCounts.data(),
+                        1,
+                        MPI_INT,
+                        route.RecvCounts.data(),
+                        1,
+                        MPI_INT,
+                        neighborhood.QueryComm);
+  route.RecvOffsets = ScanExclusive(route.RecvCounts);
+  int numQueries = std::accumulate(route.RecvCounts.begin(), route.RecvCounts.end(), 0);
+
+  // Request round, from each rank to its upstream neighbors
+  if (format == TransmittanceWireFormat::Compact)
+  {
+    std::vector<QuantizedPoint> sendPoints = EncodeQueries(route.SendHits, boundsMap);
+    std::vector<QuantizedPoint> recvPoints(static_cast<std::size_t>(numQueries));
+    MPI_Neighbor_alltoallv(sendPoints.data(),
+                           route.SendCounts.data(),
+                           route.SendOffsets.data(),
+                           types.QuantizedPoint,
+                           recvPoints.data(),
+                           route.RecvCounts.data(),
+                           route.RecvOffsets.data(),
+                           types.QuantizedPoint,
+                           neighborhood.QueryComm);
+    route.Queries = DecodeQueries(
+      recvPoints, route.RecvCounts, route.RecvOffsets, neighborhood.DownstreamRanks, boundsMap);
+    return route;
+  }
+
+  route.Queries.resize(static_cast<std::size_t>(numQueries));
+  MPI_Neighbor_alltoallv(route.SendHits.data(),
+                         route.SendCounts.data(),
+                         route.SendOffsets.data(),
+                         types.TransmittanceRayBlockHit,
+                         route.Queries.data(),
+                         route.RecvCounts.data(),
+                         route.RecvOffsets.data(),
+                         types.TransmittanceRayBlockHit,
+                         neighborhood.QueryComm);
+  return route;
+}
+
+// A record on its way to the rank owning its block
+template <typename T>
+struct RoutedRecord
+{
+  int Rank;
+  T Value;
+};
+
+// The collectives below move trivially copyable records as bytes, so one set of them serves
+// every record type the node aggregation routes
+template <typename T>
+std::vector<int> ToByteCounts(const std::vector<int>& counts)
+{
+  std::vector<int> bytes(counts.size());
+  for (std::size_t i = 0; i < counts.size(); ++i)
+  {
+    bytes[i] = counts[i] * static_cast<int>(sizeof(T));
+  }
+  return bytes;
+}
+
+// Gathers the records of every rank of comm on rank 0, which also gets the count of each rank
+template <typename T>
+std::vector<T> GatherRecords(MPI_Comm comm, const std::vector<T>& records, std::vector<int>& counts)
+{
+  int rank, size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+  int count = static_cast<int>(records.size());
+  counts.assign(rank == 0 ? size : 0, 0);
+  MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
+
+  std::vector<int> byteCounts = ToByteCounts<T>(counts);
+  std::vector<int> byteOffsets = ScanExclusive(byteCounts);
+  std::vector<T> gathered(std::accumulate(counts.begin(), counts.end(), std::size_t(0)));
+  MPI_Gatherv(records.data(),
+              count * static_cast<int>(sizeof(T)),
+              MPI_BYTE,
+              gathered.data(),
+              byteCounts.data(),
+              byteOffsets.data(),
+              MPI_BYTE,
+              0,
+              comm);
+  return gathered;
+}
+
+// The reverse of GatherRecords, rank 0 hands counts[i] records to rank i
+template <typename T>
+std::vector<T> ScatterRecords(MPI_Comm comm,
+                              const std::vector<T>& records,
+                              const std::vector<int>& counts)
+{
+  int count = 0;
+  MPI_Scatter(counts.data(), 1, MPI_INT, &count, 1, MPI_INT, 0, comm);
+
+  std::vector<int> byteCounts = ToByteCounts<T>(counts);
+  std::vector<int> byteOffsets = ScanExclusive(byteCounts);
+  std::vector<T> scattered(static_cast<std::size_t>(count));
+  MPI_Scatterv(records.data(),
+               byteCounts.data(),
+               byteOffsets.data(),
+               MPI_BYTE,
+               scattered.data(),
+               count * static_cast<int>(sizeof(T)),
+               MPI_BYTE,
+               0,
+               comm);
+  return scattered;
+}
+
+template <typename T>
+std::vector<T> AlltoallRecords(MPI_Comm comm,
+                               const std::vector<T>& records,
+                               const std::vector<int>& sendCounts,
+                               const std::vector<int>& recvCounts)
+{
+  std::vector<int> sendBytes = ToByteCounts<T>(sendCounts);
+  std::vector<int> sendOffsets = ScanExclusive(sendBytes);
+  std::vector<int> recvBytes = ToByteCounts<T>(recvCounts);
+  std::vector<int> recvOffsets = ScanExclusive(recvBytes);
+  std::vector<T> received(std::accumulate(recvCounts.begin(), recvCounts.end(), std::size_t(0)));
+  MPI_Alltoallv(records.data(),
+                sendBytes.data(),
+                sendOffsets.data(),
+                MPI_BYTE,
+                received.data(),
+                recvBytes.data(),
+                recvOffsets.data(),
+                MPI_BYTE,
+                comm);
+  return received;
+}
+
+// Stable order of the records by bucket, with the size of every bucket
+template <typename T, typename BucketOf>
+std::vector<std::size_t> BucketRecords(const std::vector<T>& records,
+                                       int numBuckets,
+                                       BucketOf bucketOf,
+                                       std::vector<int>& counts)
+{
+  counts.assign(static_cast<std::size_t>(numBuckets), 0);
+  for (const T& record : records)
+  {
+    counts[static_cast<std::size_t>(bucketOf(record))]++;
+  }
+  std::vector<int> cursors = ScanExclusive(counts);
+  std::vector<std::size_t> order(records.size());
+  for (std::size_t i = 0; i < records.size(); ++i)
+  {
+    int& cursor = cursors[static_cast<std::size_t>(bucketOf(records[i]))];
+    order[static_cast<std::size_t>(cursor++)] = i;
+  }
+  return order;
+}
+
+template <typename T>
+std::vector<T> Permute(const std::vector<T>& values, const std::vector<std::size_t>& order)
+{
+  std::vector<T> permuted(order.size());
+  for (std::size_t pos = 0; pos < order.size(); ++pos)
+  {
+    permuted[pos] = values[order[pos]];
+  }
+  return permuted;
+}
+
+template <typename T>
+std::vector<T> Unpermute(const std::vector<T>& values, const std::vector<std::size_t>& order)
+{
+  std::vector<T> unpermuted(order.size());
+  for (std::size_t pos = 0; pos < order.size(); ++pos)
+  {
+    unpermuted[order[pos]] = values[pos];
+  }
+  return unpermuted;
+}
+
+//
+// Routes each query to queryRanks[i] through the node leaders, lets answer turn the queries a
+// rank receives into one reply each and returns the replies in the order of the queries.
+// Every step keeps the order of the records it moves, so the replies only need the permutations
+// the leaders applied on the way out to find their way back.
+//
+template <typename Query, typename Reply, typename Answer>
+std::vector<Reply> RouteThroughNodes(const pilot::mpi::Environment& env,
+                                     const std::vector<Query>& queries,
+                                     const std::vector<int>& queryRanks,
+                                     Answer answer)
+{
+  using Routed = RoutedRecord<Query>;
+  std::vector<Routed> outgoing(queries.size());
+  for (std::size_t i = 0; i < queries.size(); ++i)
+  {
+    outgoing[i].Rank = queryRanks[i];
+    outgoing[i].Value = queries[i];
+  }
+
+  // Up to the leader of this node
+  std::vector<int> gatherCounts;
+  std::vector<Routed> nodeQueries = GatherRecords(env.NodeComm, outgoing, gatherCounts);
+
+  // Across nodes, between the leaders
+  const bool isLeader = env.NodeRank == 0;
+  std::vector<std::size_t> nodeOrder, localOrder;
+  std::vector<int> nodeSendCounts, nodeRecvCounts, scatterCounts;
+  std::vector<Routed> localQueries;
+  if (isLeader)
+  {
+    auto nodeOf = [&](const Routed& query) { return env.RankNodeIds[query.Rank]; };
+    auto nodeRankOf = [&](const Routed& query) { return env.RankNodeRanks[query.Rank]; };
+
+    nodeOrder = BucketRecords(nodeQueries, env.NumNodes, nodeOf, nodeSendCounts);
+    nodeRecvCounts.resize(static_cast<std::size_t>(env.NumNodes));
+    MPI_Alltoall(
+      nodeSendCounts.data(), 1, MPI_INT, nodeRecvCounts.data(), 1, MPI_INT, env.NodeLeaderComm);
+    std::vector<Routed> remoteQueries = AlltoallRecords(
+      env.NodeLeaderComm, Permute(nodeQueries, nodeOrder), nodeSendCounts, nodeRecvCounts);
+
+    localOrder = BucketRecords(remoteQueries, env.NodeSize, nodeRankOf, scatterCounts);
+    localQueries = Permute(remoteQueries, localOrder);
+  }
+
+  // Down to the owning ranks
+  std::vector<Routed> received = ScatterRecords(env.NodeComm, localQueries, scatterCounts);
+  std::vector<Query> incoming(received.size());
+  for (std::size_t i = 0; i < received.size(); ++i)
+  {
+    incoming[i] = received[i].Value;
+  }
+  std::vector<Reply> replies = answer(incoming);
+
+  // And back along the same route
+  std::vector<int> replyCounts;
+  std::vector<Reply> nodeReplies = GatherRecords(env.NodeComm, replies, replyCounts);
+  std::vector<Reply> leaderReplies;
+  if (isLeader)
+  {
+    std::vector<Reply> remoteReplies = AlltoallRecords(env.NodeLeaderComm,
+                                                       Unpermute(nodeReplies, localOrder),
+                                                       nodeRecvCounts,
+                                                       nodeSendCounts);
+    leaderReplies = Unpermute(remoteReplies, nodeOrder);
+  }
+  return ScatterRecords(env.NodeComm, leaderReplies, gatherCounts);
+}
+
+// The cell of the map of a block that point falls in and its parametric coordinates in that
+// cell, computed in the same precision as TransmittanceLocator and the uniform point coordinates
+// the estimator reads its cell corners from
+void LocateMapCell(const vtkm::Bounds& bounds,
+                   const vtkm::Id3& mapSize,
+                   const vtkm::Vec3f_32& point,
+                   vtkm::Id3& cell,
+                   vtkm::Vec3f_32& pcoords)
+{
+  const vtkm::Vec3f_32 origin{ static_cast<vtkm::Float32>(bounds.X.Min),
+                               static_cast<vtkm::Float32>(bounds.Y.Min),
+                               static_cast<vtkm::Float32>(bounds.Z.Min) };
+  const vtkm::Vec3f_32 size{ static_cast<vtkm::Float32>(bounds.X.Max - bounds.X.Min),
+                             static_cast<vtkm::Float32>(bounds.Y.Max - bounds.Y.Min),
+                             static_cast<vtkm::Float32>(bounds.Z.Max - bounds.Z.Min) };
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    const vtkm::Float32 spacing = size[axis] / static_cast<vtkm::Float32>(mapSize[axis]);
+    vtkm::Float32 t = (point[axis] - origin[axis]) * (1.f / spacing);
+    // Points on the edges sample the closest cell, as in TransmittanceLocator::LocateCell
+    t = std::max(t, 0.0f);
+    if (t >= static_cast<vtkm::Float32>(mapSize[axis]))
+    {
+      t = static_cast<vtkm::Float32>(mapSize[axis] - 1);
+    }
+    cell[axis] = static_cast<vtkm::Id>(t);
+
+    const vtkm::Float32 minPoint = origin[axis] + spacing * static_cast<vtkm::Float32>(cell[axis]);
+    const vtkm::Float32 maxPoint =
+      origin[axis] + spacing * static_cast<vtkm::Float32>(cell[axis] + 1);
+    pcoords[axis] = (point[axis] - minPoint) / (maxPoint - minPoint);
+  }
+}
+
+// The map vertices of a cell, in the order of TransmittanceLocator::GetCellIndices
+vtkm::Vec<vtkm::Id, 8> GetMapCellIndices(const vtkm::Id3& mapSize, const vtkm::Id3& cell)
+{
+  const vtkm::Id3 pdims = mapSize + vtkm::Id3{ 1, 1, 1 };
+  vtkm::Vec<vtkm::Id, 8> indices;
+  indices[0] = (cell[2] * pdims[1] + cell[1]) * pdims[0] + cell[0];
+  indices[1] = indices[0] + 1;
+  indices[2] = indices[1] + pdims[0];
+  indices[3] = indices[2] - 1;
+  indices[4] = indices[0] + pdims[0] * pdims[1];
+  indices[5] = indices[4] + 1;
+  indices[6] = indices[5] + pdims[0];
+  indices[7] = indices[6] - 1;
+  return indices;
+}
+
+// Trilinear interpolation over the corners of a hexahedron, as vtkm::exec::CellInterpolate does
+vtkm::Float32 InterpolateHexahedron(const vtkm::Vec<vtkm::Float32, 8>& values,
+                                    const vtkm::Vec3f_32& pcoords)
+{
+  auto lerp = [](vtkm::Float32 a, vtkm::Float32 b, vtkm::Float32 t) { return a + t * (b - a); };
+  const vtkm::Float32 bottomFront = lerp(values[0], values[1], pcoords[0]);
+  const vtkm::Float32 bottomBack = lerp(values[3], values[2], pcoords[0]);
+  const vtkm::Float32 topFront = lerp(values[4], values[5], pcoords[0]);
+  const vtkm::Float32 topBack = lerp(values[7], values[6], pcoords[0]);
+  const vtkm::Float32 bottom = lerp(bottomFront, bottomBack, pcoords[1]);
+  const vtkm::Float32 top = lerp(topFront, topBack, pcoords[1]);
+  return lerp(bottom, top, pcoords[2]);
+}
+} // namespace
+
+MpiTypes ConstructMpiTypes()
+{
+  MpiTypes types;
+  MPI_Type_contiguous(3, MPI_FLOAT, &types.Vec3f_32);
+  MPI_Type_commit(&types.Vec3f_32);
+  MPI_Type_contiguous(4, MPI_FLOAT, &types.Vec4f_32);
+  MPI_Type_commit(&types.Vec4f_32);
+
+  const int hitMemberCount = 6;
+  int hitLengths[hitMemberCount] = { 1, 1, 1, 1, 1, 1 };
+  MPI_Aint hitDisplacements[hitMemberCount];
+  TransmittanceRayBlockHit dummyHit;
+  MPI_Aint hitBaseAddress;
+  int addCount = 0;
+  MPI_Get_address(&dummyHit, &hitBaseAddress);
+  MPI_Get_address(&dummyHit.RayId, &hitDisplacements[addCount++]);
+  MPI_Get_address(&dummyHit.BlockId, &hitDisplacements[addCount++]);
+  MPI_Get_address(&dummyHit.FromBlockId, &hitDisplacements[addCount++]);
+  MPI_Get_address(&dummyHit.Point, &hitDisplacements[addCount++]);
+  MPI_Get_address(&dummyHit.RayT, &hitDisplacements[addCount++]);
+  MPI_Get_address(&dummyHit.Opacity, &hitDisplacements[addCount++]);
+  for (int i = 0; i < hitMemberCount; ++i)
+  {
+    hitDisplacements[i] = MPI_Aint_diff(hitDisplacements[i], hitBaseAddress);
+  }
+  MPI_Datatype hitTypes[hitMemberCount] = { MPI_INT,        MPI_INT,   MPI_INT,
+                                            types.Vec3f_32, MPI_FLOAT, MPI_FLOAT };
+  MPI_Type_create_struct(
+    hitMemberCount, hitLengths, hitDisplacements, hitTypes, &types.TransmittanceRayBlockHit);
+  MPI_Type_commit(&types.TransmittanceRayBlockHit);
+
+  MPI_Type_contiguous(3, MPI_UINT16_T, &types.QuantizedPoint);
+  MPI_Type_commit(&types.QuantizedPoint);
+
+  return types;
+}
+
+void FreeMpiTypes(MpiTypes& types)
+{
+  MPI_Type_free(&types.QuantizedPoint);
+  MPI_Type_free(&types.TransmittanceRayBlockHit);
+  MPI_Type_free(&types.Vec4f_32);
+  MPI_Type_free(&types.Vec3f_32);
+}
+
+QuantizedPoint QuantizePoint(const vtkm::Vec3f_32& point, const vtkm::Bounds& bounds)
+{
+  const vtkm::Range* ranges[3] = { &bounds.X, &bounds.Y, &bounds.Z };
+  QuantizedPoint quantized;
+  for (int i = 0; i < 3; ++i)
+  {
+    vtkm::Float64 length = ranges[i]->Length();
+    vtkm::Float64 t = length > 0.0 ? (point[i] - ranges[i]->Min) / length : 0.0;
+    t = std::min(std::max(t, 0.0), 1.0);
+    quantized[i] = static_cast<vtkm::UInt16>(t * 65535.0 + 0.5);
+  }
+  return quantized;
+}
+
+vtkm::Vec3f_32 DequantizePoint(const QuantizedPoint& point, const vtkm::Bounds& bounds)
+{
+  const vtkm::Range* ranges[3] = { &bounds.X, &bounds.Y, &bounds.Z };
+  vtkm::Vec3f_32 dequantized;
+  for (int i = 0; i < 3; ++i)
+  {
+    vtkm::Float64 t = point[i] / 65535.0;
+    dequantized[i] = static_cast<vtkm::Float32>(ranges[i]->Min + t * ranges[i]->Length());
+  }
+  return dequantized;
+}
+
+vtkm::UInt16 QuantizeOpacity(vtkm::Float32 opacity)
+{
+  vtkm::Float32 clamped = std::min(std::max(opacity, 0.0f), 1.0f);
+  return static_cast<vtkm::UInt16>(clamped * 65535.0f + 0.5f);
+}
+
+vtkm::Float32 DequantizeOpacity(vtkm::UInt16 opacity)
+{
+  return static_cast<vtkm::Float32>(opacity) / 65535.0f;
+}
+
+std::vector<vtkm::Float32> GatherBlockMaxAlphas(MPI_Comm comm, vtkm::Float32 localMaxAlpha)
+{
+  int size;
+  MPI_Comm_size(comm, &size);
+  std::vector<vtkm::Float32> blockMaxAlphas(static_cast<std::size_t>(size));
+  MPI_Allgather(&localMaxAlpha, 1, MPI_FLOAT, blockMaxAlphas.data(), 1, MPI_FLOAT, comm);
+  return blockMaxAlphas;
+}
+
+std::vector<vtkm::UInt8> FindTransparentBlocks(const std::vector<vtkm::Float32>& blockMaxAlphas)
+{
+  std::vector<vtkm::UInt8> transparentBlocks(blockMaxAlphas.size());
+  for (std::size_t block = 0; block < blockMaxAlphas.size(); ++block)
+  {
+    transparentBlocks[block] = blockMaxAlphas[block] <= 0.0f ? 1 : 0;
+  }
+  return transparentBlocks;
+}
+
+std::vector<vtkm::Id> FindUpstreamBlocks(const beams::rendering::BoundsMap& boundsMap,
+                                         vtkm::Id blockId,
+                                         const vtkm::Vec3f_32& lightPosition,
+                                         const std::vector<vtkm::UInt8>& transparentBlocks)
+{
+  // Padded a little so that glancing hits, which the hit search keeps, are never missed
+  const vtkm::Float64 pad = BoundsPad(boundsMap);
+  vtkm::Bounds lightBox = boundsMap.BlockBounds[static_cast<std::size_t>(blockId)];
+  lightBox.Include(lightPosition);
+
+  std::vector<vtkm::Id> upstream;
+  for (vtkm::Id block = 0; block < boundsMap.TotalNumBlocks; ++block)
+  {
+    if (block != blockId && !transparentBlocks[static_cast<std::size_t>(block)] &&
+        Overlaps(lightBox, boundsMap.BlockBounds[static_cast<std::size_t>(block)], pad))
+    {
+      upstream.push_back(block);
+    }
+  }
+  return upstream;
+}
+
+TransmittanceNeighborhood BuildTransmittanceNeighborhood(
+  MPI_Comm comm,
+  const beams::rendering::BoundsMap& boundsMap,
+  const std::vector<vtkm::Vec3f_32>& lightPositions,
+  const std::vector<vtkm::UInt8>& transparentBlocks)
+{
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  TransmittanceNeighborhood neighborhood;
+  FindNeighborRanks(rank, boundsMap, lightPositions, transparentBlocks, neighborhood);
+
+  const int numUpstream = static_cast<int>(neighborhood.UpstreamRanks.size());
+  const int numDownstream = static_cast<int>(neighborhood.DownstreamRanks.size());
+  MPI_Dist_graph_create_adjacent(comm,
+                                 numDownstream,
+                                 neighborhood.DownstreamRanks.data(),
+                                 MPI_UNWEIGHTED,
+                                 numUpstream,
+                                 neighborhood.UpstreamRanks.data(),
+                                 MPI_UNWEIGHTED,
+                                 MPI_INFO_NULL,
+                                 0,
+                                 &neighborhood.QueryComm);
+  MPI_Dist_graph_create_adjacent(comm,
+                                 numUpstream,
+                                 neighborhood.UpstreamRanks.data(),
+                                 MPI_UNWEIGHTED,
+                                 numDownstream,
+                                 neighborhood.DownstreamRanks.data(),
+                                 MPI_UNWEIGHTED,
+                                 MPI_INFO_NULL,
+                                 0,
+                                 &neighborhood.ReplyComm);
+  return neighborhood;
+}
+
+void FreeTransmittanceNeighborhood(TransmittanceNeighborhood& neighborhood)
+{
+  if (neighborhood.QueryComm != MPI_COMM_NULL)
+  {
+    MPI_Comm_free(&neighborhood.QueryComm);
+  }
+  if (neighborhood.ReplyComm != MPI_COMM_NULL)
+  {
+    MPI_Comm_free(&neighborhood.ReplyComm);
+  }
+  neighborhood.UpstreamRanks.clear();
+  neighborhood.DownstreamRanks.clear();
+}
+
+void ExchangeHitsThroughRoot(MPI_Comm comm,
+                             const MpiTypes& types,
+                             std::vector<TransmittanceRayBlockHit>& rayHitsV,
+                             const TransmittanceHitEvaluator& evaluate)
+{
+  int rank;
+  int size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+
+  ////////////////////////////////
+  // Send the sizes of the vectors
+  ////////////////////////////////
+  std::vector<int> requestNumHits;
+  int count = static_cast<int>(rayHitsV.size());
+  if (rank == 0)
+  {
+    requestNumHits.resize(size);
+    MPI_Gather(&count, 1, MPI_INT, requestNumHits.data(), 1, MPI_INT, 0, comm);
+  }
+  else
+  {
+    MPI_Gather(&count, 1, MPI_INT, nullptr, 0, MPI_INT, 0, comm);
+  }
+
+  ////////////////////////////////
+  // Send the vectors
+  ////////////////////////////////
+  std::vector<TransmittanceRayBlockHit> requestHits;
+  if (rank == 0)
+  {
+    std::vector<int> requestHitsOffsets = ScanExclusive(requestNumHits);
+    int totalHitsCount = std::accumulate(requestNumHits.begin(), requestNumHits.end(), 0);
+    requestHits.resize(totalHitsCount);
+    MPI_Gatherv(rayHitsV.data(),
+                count,
+                types.TransmittanceRayBlockHit,
+                requestHits.data(),
+                requestNumHits.data(),
+                requestHitsOffsets.data(),
+                types.TransmittanceRayBlockHit,
+                0,
+                comm);
+  }
+  else
+  {
+    MPI_Gatherv(rayHitsV.data(),
+                count,
+                types.TransmittanceRayBlockHit,
+                nullptr,
+                nullptr,
+                nullptr,
+                types.TransmittanceRayBlockHit,
+                0,
+                comm);
+  }
+
+  std::map<int, std::vector<TransmittanceRayBlockHit>> requestHitsTable;
+  if (rank == 0)
+  {
+    for (const TransmittanceRayBlockHit& hit : requestHits)
+    {
+      int toBlock = hit.BlockId;
+      auto& hitsTableEntry = requestHitsTable[toBlock];
+      hitsTableEntry.push_back(hit);
+    }
+  }
+
+  ////////////////////////////////
+  // Send the sizes of the vectors
+  ////////////////////////////////
+  std::vector<int> pullsNumHits;
+  int pullNumHits;
+  if (rank == 0)
+  {
+    // Ranks missing from the sparse table are not hit at all
+    pullsNumHits.resize(size, 0);
+    for (const auto& entry : requestHitsTable)
+    {
+      pullsNumHits[entry.first] = static_cast<int>(entry.second.size());
+    }
+    MPI_Scatter(pullsNumHits.data(), 1, MPI_INT, &pullNumHits, 1, MPI_INT, 0, comm);
+  }
+  else
+  {
+    MPI_Scatter(nullptr, 1, MPI_INT, &pullNumHits, 1, MPI_INT, 0, comm);
+  }
+
+  ////////////////////////////////
+  // Send the vectors
+  ////////////////////////////////
+  // Only the blocks that are hit get a message, so rank 0 keeps requests for its actual peers
+  // rather than for every rank. The counts above still take one entry per rank on rank 0, as
+  // MPI_Gatherv and MPI_Scatter need them, so this mode is only meant for small runs.
+  std::vector<MPI_Request> pullHitsMPIRequests;
+  if (rank == 0)
+  {
+    for (auto& entry : requestHitsTable)
+    {
+      auto& hits = entry.second;
+      if (hits.empty())
+      {
+        continue;
+      }
+      pullHitsMPIRequests.emplace_back();
+      MPI_Isend(hits.data(),
+                hits.size(),
+                types.TransmittanceRayBlockHit,
+                entry.first,
+                100,
+                comm,
+                &pullHitsMPIRequests.back());
+    }
+  }
+  std::vector<TransmittanceRayBlockHit> pullHitsV;
+  pullHitsV.resize(pullNumHits);
+  if (pullNumHits > 0)
+  {
+    pullHitsMPIRequests.emplace_back();
+    MPI_Irecv(pullHitsV.data(),
+              pullNumHits,
+              types.TransmittanceRayBlockHit,
+              0,
+              100,
+              comm,
+              &pullHitsMPIRequests.back());
+  }
+  MPI_Waitall(static_cast<int>(pullHitsMPIRequests.size()),
+              pullHitsMPIRequests.data(),
+              MPI_STATUSES_IGNORE);
+
+  evaluate(pullHitsV);
+
+  pullHitsMPIRequests.clear();
+  if (rank == 0)
+  {
+    for (auto& entry : requestHitsTable)
+    {
+      auto& hits = entry.second;
+      if (hits.empty())
+      {
+        continue;
+      }
+      pullHitsMPIRequests.emplace_back();
+      MPI_Irecv(hits.data(),
+                hits.size(),
+                types.TransmittanceRayBlockHit,
+                entry.first,
+                101,
+                comm,
+                &pullHitsMPIRequests.back());
+    }
+  }
+  if (pullNumHits > 0)
+  {
+    pullHitsMPIRequests.emplace_back();
+    MPI_Isend(pullHitsV.data(),
+              pullNumHits,
+              types.TransmittanceRayBlockHit,
+              0,
+              101,
+              comm,
+              &pullHitsMPIRequests.back());
+  }
+  MPI_Waitall(static_cast<int>(pullHitsMPIRequests.size()),
+              pullHitsMPIRequests.data(),
+              MPI_STATUSES_IGNORE);
+
+  std::map<int, std::vector<TransmittanceRayBlockHit>> responseHitsTable;
+  if (rank == 0)
+  {
+    for (auto i : requestHitsTable)
+    {
+      auto& hitsV = i.second;
+      for (auto& hit : hitsV)
+      {
+        int fromRank = hit.FromBlockId;
+        auto& reponseHitsV = responseHitsTable[fromRank];
+        reponseHitsV.push_back(hit);
+      }
+    }
+  }
+  // The table only has the ranks that sent hits, and those are the only ones that wait for a
+  // response
+  std::vector<MPI_Request> responseMPIRequests;
+  if (rank == 0)
+  {
+    for (auto& entry : responseHitsTable)
+    {
+      auto& hits = entry.second;
+      responseMPIRequests.emplace_back();
+      MPI_Isend(hits.data(),
+                hits.size(),
+                types.TransmittanceRayBlockHit,
+                entry.first,
+                102,
+                comm,
+                &responseMPIRequests.back());
+    }
+  }
+
+  std::vector<TransmittanceRayBlockHit> rayHits2V;
+  rayHits2V.resize(rayHitsV.size());
+  if (!rayHits2V.empty())
+  {
+    responseMPIRequests.emplace_back();
+    MPI_Irecv(rayHits2V.data(),
+              rayHits2V.size(),
+              types.TransmittanceRayBlockHit,
+              0,
+              102,
+              comm,
+              &responseMPIRequests.back());
+  }
+  MPI_Waitall(static_cast<int>(responseMPIRequests.size()),
+              responseMPIRequests.data(),
+              MPI_STATUSES_IGNORE);
+
+  // Rank 0 returns the answers grouped by block, each group in the order the hits were sent
+  std::map<int, int> blockOffsets;
+  for (const auto& hit : rayHits2V)
+  {
+    blockOffsets[hit.BlockId]++;
+  }
+  int offset = 0;
+  for (auto& entry : blockOffsets)
+  {
+    int count = entry.second;
+    entry.second = offset;
+    offset += count;
+  }
+  for (auto& hit : rayHitsV)
+  {
+    hit.Opacity = rayHits2V[blockOffsets[hit.BlockId]++].Opacity;
+  }
+}
+
+void ExchangeHitsDirect(MPI_Comm comm,
+                        const MpiTypes& types,
+                        const beams::rendering::BoundsMap& boundsMap,
+                        TransmittanceWireFormat format,
+                        std::vector<TransmittanceRayBlockHit>& hits,
+                        const TransmittanceHitEvaluator& evaluate)
+{
+  int size;
+  MPI_Comm_size(comm, &size);
+
+  // Bucket the hits by the rank owning the block they hit
+  std::vector<int> hitRanks(hits.size());
+  std::vector<int> sendCounts(size, 0);
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    int owner = boundsMap.FindRank(hits[i].BlockId);
+    if (owner < 0 || owner >= size)
+    {
+      throw vtkm::cont::ErrorBadValue("No rank owns block " + std::to_string(hits[i].BlockId));
+    }
+    hitRanks[i] = owner;
+    sendCounts[owner]++;
+  }
+  std::vector<int> sendOffsets = ScanExclusive(sendCounts);
+
+  // sendOrder remembers where each bucketed hit came from, so answers can be put back in place
+  std::vector<TransmittanceRayBlockHit> sendHits(hits.size());
+  std::vector<std::size_t> sendOrder(hits.size());
+  std::vector<int> cursors = sendOffsets;
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    int pos = cursors[hitRanks[i]]++;
+    sendHits[pos] = hits[i];
+    sendOrder[pos] = i;
+  }
+
+  std::vector<int> recvCounts(size, 0);
+  MPI_Alltoall(sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, comm);
+  std::vector<int> recvOffsets = ScanExclusive(recvCounts);
+  int numQueries = std::accumulate(recvCounts.begin(), recvCounts.end(), 0);
+
+  std::vector<TransmittanceRayBlockHit> queries(numQueries);
+  if (format == TransmittanceWireFormat::Compact)
+  {
+    // Request round
+    std::vector<QuantizedPoint> sendPoints = EncodeQueries(sendHits, boundsMap);
+    std::vector<QuantizedPoint> recvPoints(numQueries);
+    MPI_Alltoallv(sendPoints.data(),
+                  sendCounts.data(),
+                  sendOffsets.data(),
+                  types.QuantizedPoint,
+                  recvPoints.data(),
+                  recvCounts.data(),
+                  recvOffsets.data(),
+                  types.QuantizedPoint,
+                  comm);
+    std::vector<int> sourceRanks(size);
+    std::iota(sourceRanks.begin(), sourceRanks.end(), 0);
+    queries = DecodeQueries(recvPoints, recvCounts, recvOffsets, sourceRanks, boundsMap);
+
+    evaluate(queries);
+
+    // Reply round, the answers come back in the order the queries were sent
+    std::vector<vtkm::UInt16> replies = EncodeReplies(queries);
+    std::vector<vtkm::UInt16> answers(sendHits.size());
+    MPI_Alltoallv(replies.data(),
+                  recvCounts.data(),
+                  recvOffsets.data(),
+                  MPI_UINT16_T,
+                  answers.data(),
+                  sendCounts.data(),
+                  sendOffsets.data(),
+                  MPI_UINT16_T,
+                  comm);
+
+    for (std::size_t pos = 0; pos < answers.size(); ++pos)
+    {
+      hits[sendOrder[pos]].Opacity = DequantizeOpacity(answers[pos]);
+    }
+    return;
+  }
+
+  // Request round
+  MPI_Alltoallv(sendHits.data(),
+                sendCounts.data(),
+                sendOffsets.data(),
+                types.TransmittanceRayBlockHit,
+                queries.data(),
+                recvCounts.data(),
+                recvOffsets.data(),
+                types.TransmittanceRayBlockHit,
+                comm);
+
+  evaluate(queries);
+
+  // Reply round, the answers come back in the order the queries were sent
+  MPI_Alltoallv(queries.data(),
+                recvCounts.data(),
+                recvOffsets.data(),
+                types.TransmittanceRayBlockHit,
+                sendHits.data(),
+                sendCounts.data(),
+                sendOffsets.data(),
+                types.TransmittanceRayBlockHit,
+                comm);
+
+  for (std::size_t pos = 0; pos < sendHits.size(); ++pos)
+  {
+    hits[sendOrder[pos]].Opacity = sendHits[pos].Opacity;
+  }
+}
+
+void ExchangeHitsNodeAggregated(const pilot::mpi::Environment& env,
+                                const beams::rendering::BoundsMap& boundsMap,
+                                TransmittanceWireFormat format,
+                                std::vector<TransmittanceRayBlockHit>& hits,
+                                const TransmittanceHitEvaluator& evaluate)
+{
+  std::vector<int> hitRanks(hits.size());
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    int owner = boundsMap.FindRank(hits[i].BlockId);
+    if (owner < 0 || owner >= env.Size)
+    {
+      throw vtkm::cont::ErrorBadValue("No rank owns block " + std::to_string(hits[i].BlockId));
+    }
+    hitRanks[i] = owner;
+  }
+
+  if (format == TransmittanceWireFormat::Compact)
+  {
+    // The source of a query is lost on the way, so the queries are numbered as if they all came
+    // from one unknown rank
+    auto answer = [&](const std::vector<QuantizedPoint>& points) {
+      std::vector<int> counts = { static_cast<int>(points.size()) };
+      std::vector<TransmittanceRayBlockHit> queries =
+        DecodeQueries(points, counts, { 0 }, { -1 }, boundsMap);
+      evaluate(queries);
+      return EncodeReplies(queries);
+    };
+    std::vector<vtkm::UInt16> replies = RouteThroughNodes<QuantizedPoint, vtkm::UInt16>(
+      env, EncodeQueries(hits, boundsMap), hitRanks, answer);
+    for (std::size_t i = 0; i < hits.size(); ++i)
+    {
+      hits[i].Opacity = DequantizeOpacity(replies[i]);
+    }
+    return;
+  }
+
+  auto answer = [&](const std::vector<TransmittanceRayBlockHit>& received) {
+    std::vector<TransmittanceRayBlockHit> queries = received;
+    evaluate(queries);
+    std::vector<vtkm::Float32> opacities(queries.size());
+    for (std::size_t i = 0; i < queries.size(); ++i)
+    {
+      opacities[i] = queries[i].Opacity;
+    }
+    return opacities;
+  };
+  std::vector<vtkm::Float32> replies =
+    RouteThroughNodes<TransmittanceRayBlockHit, vtkm::Float32>(env, hits, hitRanks, answer);
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    hits[i].Opacity = replies[i];
+  }
+}
+
+void ExchangeHitsNeighborhood(const MpiTypes& types,
+                              const beams::rendering::BoundsMap& boundsMap,
+                              const TransmittanceNeighborhood& neighborhood,
+                              TransmittanceWireFormat format,
+                              std::vector<TransmittanceRayBlockHit>& hits,
+                              const TransmittanceHitEvaluator& evaluate)
+{
+  NeighborhoodRoute route = RouteQueries(types, boundsMap, neighborhood, format, hits);
+
+  evaluate(route.Queries);
+
+  // Reply round, back along the reversed edges
+  if (format == TransmittanceWireFormat::Compact)
+  {
+    std::vector<vtkm::UInt16> replies = EncodeReplies(route.Queries);
+    std::vector<vtkm::UInt16> answers(route.SendHits.size());
+    MPI_Neighbor_alltoallv(replies.data(),
+                           route.RecvCounts.data(),
+                           route.RecvOffsets.data(),
+                           MPI_UINT16_T,
+                           answers.data(),
+                           route.SendCounts.data(),
+                           route.SendOffsets.data(),
+                           MPI_UINT16_T,
+                           neighborhood.ReplyComm);
+    for (std::size_t pos = 0; pos < answers.size(); ++pos)
+    {
+      hits[route.SendOrder[pos]].Opacity = DequantizeOpacity(answers[pos]);
+    }
+    return;
+  }
+
+  MPI_Neighbor_alltoallv(route.Queries.data(),
+                         route.RecvCounts.data(),
+                         route.RecvOffsets.data(),
+                         types.TransmittanceRayBlockHit,
+                         route.SendHits.data(),
+                         route.SendCounts.data(),
+                         route.SendOffsets.data(),
+                         types.TransmittanceRayBlockHit,
+                         neighborhood.ReplyComm);
+
+  for (std::size_t pos = 0; pos < route.SendHits.size(); ++pos)
+  {
+    hits[route.SendOrder[pos]].Opacity = route.SendHits[pos].Opacity;
+  }
+}
+
+std::vector<vtkm::Float32> GatherOpacityMaps(MPI_Comm comm,
+                                             const std::vector<vtkm::Float32>& opacities,
+                                             const std::vector<vtkm::UInt8>& transparentBlocks)
+{
+  int rank, size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+  const int numVertices = static_cast<int>(opacities.size());
+
+  std::vector<int> counts(size);
+  std::vector<int> offsets(size);
+  for (int block = 0; block < size; ++block)
+  {
+    counts[block] = transparentBlocks[static_cast<std::size_t>(block)] ? 0 : numVertices;
+    offsets[block] = block * numVertices;
+  }
+
+  std::vector<vtkm::Float32> maps(static_cast<std::size_t>(size) * opacities.size(), 0.0f);
+  MPI_Allgatherv(opacities.data(),
+                 counts[rank],
+                 MPI_FLOAT,
+                 maps.data(),
+                 counts.data(),
+                 offsets.data(),
+                 MPI_FLOAT,
+                 comm);
+  return maps;
+}
+
+std::size_t GetReplicatedMapsSize(vtkm::Id numVertices,
+                                  const std::vector<vtkm::UInt8>& transparentBlocks)
+{
+  const std::size_t numTransparent =
+    static_cast<std::size_t>(std::count(transparentBlocks.begin(), transparentBlocks.end(), 1));
+  const std::size_t numOpaque = transparentBlocks.size() - numTransparent;
+  return numOpaque * static_cast<std::size_t>(numVertices) * sizeof(vtkm::Float32);
+}
+
+TransmittanceExchangeMode ResolveExchangeMode(TransmittanceExchangeMode mode,
+                                              vtkm::Id numVertices,
+                                              const std::vector<vtkm::UInt8>& transparentBlocks,
+                                              std::size_t replicationThreshold)
+{
+  if (mode != TransmittanceExchangeMode::Auto)
+  {
+    return mode;
+  }
+  // Every rank has the same transparent blocks and map dims, so they all agree
+  if (GetReplicatedMapsSize(numVertices, transparentBlocks) <= replicationThreshold)
+  {
+    return TransmittanceExchangeMode::Replicated;
+  }
+  return TransmittanceExchangeMode::Neighborhood;
+}
+
+std::vector<TransmittanceFaceLink> FindFaceLinks(const beams::rendering::BoundsMap& boundsMap,
+                                                 const vtkm::Vec4f_32& light)
+{
+  const vtkm::Float64 pad = BoundsPad(boundsMap);
+  std::vector<TransmittanceFaceLink> links;
+  for (vtkm::Id from = 0; from < boundsMap.TotalNumBlocks; ++from)
+  {
+    const vtkm::Bounds& fromBounds = boundsMap.BlockBounds[static_cast<std::size_t>(from)];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      int u, w;
+      FaceAxes(axis, u, w);
+      const vtkm::Range& fromRange = AxisRange(fromBounds, axis);
+      for (bool isMaxFace : { false, true })
+      {
+        // Light leaves through a face when it travels towards the outer side of the face's plane
+        const vtkm::Float64 plane = isMaxFace ? fromRange.Max : fromRange.Min;
+        const vtkm::Float64 towardsPlane = plane * light[3] - light[axis];
+        const bool isExitFace = isMaxFace ? towardsPlane > 0.0 : towardsPlane < 0.0;
+        if (!isExitFace)
+        {
+          continue;
+        }
+        for (vtkm::Id to = 0; to < boundsMap.TotalNumBlocks; ++to)
+        {
+          const vtkm::Bounds& toBounds = boundsMap.BlockBounds[static_cast<std::size_t>(to)];
+          const vtkm::Range& toRange = AxisRange(toBounds, axis);
+          const vtkm::Float64 toPlane = isMaxFace ? toRange.Min : toRange.Max;
+          if (to == from || std::abs(toPlane - plane) > pad)
+          {
+            continue;
+          }
+          const vtkm::Range& fromU = AxisRange(fromBounds, u);
+          const vtkm::Range& fromW = AxisRange(fromBounds, w);
+          const vtkm::Range& toU = AxisRange(toBounds, u);
+          const vtkm::Range& toW = AxisRange(toBounds, w);
+          const vtkm::Float64 overlapU =
+            std::min(fromU.Max, toU.Max) - std::max(fromU.Min, toU.Min);
+          const vtkm::Float64 overlapW =
+            std::min(fromW.Max, toW.Max) - std::max(fromW.Min, toW.Min);
+          if (overlapU > pad && overlapW > pad)
+          {
+            links.push_back(TransmittanceFaceLink{ from, to, axis, isMaxFace });
+          }
+        }
+      }
+    }
+  }
+  return links;
+}
+
+std::vector<vtkm::Float32> ReceiveFaceImages(MPI_Comm comm,
+                                             const beams::rendering::BoundsMap& boundsMap,
+                                             const vtkm::Vec4f_32& light,
+                                             const vtkm::Id3& mapSize)
+{
+  const vtkm::Id localBlock = boundsMap.GetLocalBlockId();
+  const vtkm::Vec3f_32 lightXYZ{ light[0], light[1], light[2] };
+  std::vector<TransmittanceFaceLink> links;
+  for (const TransmittanceFaceLink& link : FindFaceLinks(boundsMap, light))
+  {
+    if (link.ToBlockId == localBlock)
+    {
+      links.push_back(link);
+    }
+  }
+
+  std::vector<std::vector<vtkm::Float32>> images(links.size());
+  std::vector<MPI_Request> requests(links.size());
+  for (std::size_t i = 0; i < links.size(); ++i)
+  {
+    int u, w;
+    FaceAxes(links[i].Axis, u, w);
+    images[i].resize(static_cast<std::size_t>((mapSize[u] + 1) * (mapSize[w] + 1)));
+    MPI_Irecv(images[i].data(),
+              static_cast<int>(images[i].size()),
+              MPI_FLOAT,
+              boundsMap.FindRank(links[i].FromBlockId),
+              FaceImageTag,
+              comm,
+              &requests[i]);
+  }
+  MPI_Waitall(static_cast<int>(requests.size()), requests.data(), MPI_STATUSES_IGNORE);
+
+  // The same vertices as CreateDataSetForOpacityMap builds for the local block
+  const vtkm::Bounds& bounds = boundsMap.BlockBounds[static_cast<std::size_t>(localBlock)];
+  const vtkm::Float64 pad = BoundsPad(boundsMap);
+  vtkm::Vec3f_32 origin{ static_cast<vtkm::Float32>(bounds.X.Min),
+                         static_cast<vtkm::Float32>(bounds.Y.Min),
+                         static_cast<vtkm::Float32>(bounds.Z.Min) };
+  vtkm::Vec3f_32 spacing;
+  for (int a = 0; a < 3; ++a)
+  {
+    spacing[a] = static_cast<vtkm::Float32>(AxisRange(bounds, a).Length()) /
+      static_cast<vtkm::Float32>(mapSize[a]);
+  }
+
+  const vtkm::Id3 pdims{ mapSize[0] + 1, mapSize[1] + 1, mapSize[2] + 1 };
+  std::vector<vtkm::Float32> remoteOpacities(
+    static_cast<std::size_t>(pdims[0] * pdims[1] * pdims[2]), 0.0f);
+  std::size_t index = 0;
+  for (vtkm::Id k = 0; k < pdims[2]; ++k)
+  {
+    for (vtkm::Id j = 0; j < pdims[1]; ++j)
+    {
+      for (vtkm::Id i = 0; i < pdims[0]; ++i, ++index)
+      {
+        vtkm::Vec3f_32 vertex{ origin[0] + spacing[0] * static_cast<vtkm::Float32>(i),
+                               origin[1] + spacing[1] * static_cast<vtkm::Float32>(j),
+                               origin[2] + spacing[2] * static_cast<vtkm::Float32>(k) };
+        // Travels from the light to the vertex, its whole way for a point light
+        vtkm::Vec3f_32 dir = vertex * light[3] - lightXYZ;
+
+        // The ray enters the block through the face whose plane is the first behind the vertex
+        int entryAxis = -1;
+        vtkm::Float32 entryS = 0.0f;
+        for (int a = 0; a < 3; ++a)
+        {
+          if (dir[a] == 0.0f)
+          {
+            continue;
+          }
+          const vtkm::Range& range = AxisRange(bounds, a);
+          vtkm::Float32 plane = static_cast<vtkm::Float32>(dir[a] > 0.0f ? range.Min : range.Max);
+          vtkm::Float32 s = (vertex[a] - plane) / dir[a];
+          if (entryAxis < 0 || s < entryS)
+          {
+            entryAxis = a;
+            entryS = s;
+          }
+        }
+        // Light inside the block, nothing upstream. A directional light is always outside.
+        if (entryAxis < 0 || (light[3] != 0.0f && entryS >= 1.0f))
+        {
+          continue;
+        }
+
+        vtkm::Vec3f_32 entry = vertex - dir * entryS;
+        const bool entersFromMaxFace = dir[entryAxis] > 0.0f;
+        int u, w;
+        FaceAxes(entryAxis, u, w);
+        for (std::size_t l = 0; l < links.size(); ++l)
+        {
+          const TransmittanceFaceLink& link = links[l];
+          if (link.Axis != entryAxis || link.IsMaxFace != entersFromMaxFace)
+          {
+            continue;
+          }
+          const vtkm::Bounds& fromBounds =
+            boundsMap.BlockBounds[static_cast<std::size_t>(link.FromBlockId)];
+          const vtkm::Range& fromU = AxisRange(fromBounds, u);
+          const vtkm::Range& fromW = AxisRange(fromBounds, w);
+          if (entry[u] < fromU.Min - pad || entry[u] > fromU.Max + pad ||
+              entry[w] < fromW.Min - pad || entry[w] > fromW.Max + pad)
+          {
+            continue;
+          }
+
+          // Bilinear lookup on the face grid of the upstream map
+          vtkm::Float32 fu = static_cast<vtkm::Float32>((entry[u] - fromU.Min) / fromU.Length()) *
+            static_cast<vtkm::Float32>(mapSize[u]);
+          vtkm::Float32 fw = static_cast<vtkm::Float32>((entry[w] - fromW.Min) / fromW.Length()) *
+            static_cast<vtkm::Float32>(mapSize[w]);
+          fu = std::min(std::max(fu, 0.0f), static_cast<vtkm::Float32>(mapSize[u]));
+          fw = std::min(std::max(fw, 0.0f), static_cast<vtkm::Float32>(mapSize[w]));
+          vtkm::Id iu = std::min(static_cast<vtkm::Id>(fu), mapSize[u] - 1);
+          vtkm::Id iw = std::min(static_cast<vtkm::Id>(fw), mapSize[w] - 1);
+          fu -= static_cast<vtkm::Float32>(iu);
+          fw -= static_cast<vtkm::Float32>(iw);
+          const std::vector<vtkm::Float32>& image = images[l];
+          const vtkm::Id rowSize = mapSize[u] + 1;
+          auto pixel = [&](vtkm::Id du, vtkm::Id dw) {
+            return image[static_cast<std::size_t>((iw + dw) * rowSize + iu + du)];
+          };
+          remoteOpacities[index] = (1.0f - fw) * ((1.0f - fu) * pixel(0, 0) + fu * pixel(1, 0)) +
+            fw * ((1.0f - fu) * pixel(0, 1) + fu * pixel(1, 1));
+          break;
+        }
+      }
+    }
+  }
+  return remoteOpacities;
+}
+
+void SendFaceImages(MPI_Comm comm,
+                    const beams::rendering::BoundsMap& boundsMap,
+                    const vtkm::Vec4f_32& light,
+                    const vtkm::Id3& mapSize,
+                    const std::vector<vtkm::Float32>& opacities)
+{
+  const vtkm::Id localBlock = boundsMap.GetLocalBlockId();
+  const vtkm::Id3 pdims{ mapSize[0] + 1, mapSize[1] + 1, mapSize[2] + 1 };
+  std::vector<std::vector<vtkm::Float32>> images;
+  std::vector<int> destinations;
+  for (const TransmittanceFaceLink& link : FindFaceLinks(boundsMap, light))
+  {
+    if (link.FromBlockId != localBlock)
+    {
+      continue;
+    }
+    int u, w;
+    FaceAxes(link.Axis, u, w);
+    std::vector<vtkm::Float32> image;
+    image.reserve(static_cast<std::size_t>(pdims[u] * pdims[w]));
+    vtkm::Id3 ijk;
+    ijk[link.Axis] = link.IsMaxFace ? mapSize[link.Axis] : 0;
+    for (ijk[w] = 0; ijk[w] < pdims[w]; ++ijk[w])
+    {
+      for (ijk[u] = 0; ijk[u] < pdims[u]; ++ijk[u])
+      {
+        vtkm::Id index = ijk[0] + pdims[0] * (ijk[1] + pdims[1] * ijk[2]);
+        image.push_back(opacities[static_cast<std::size_t>(index)]);
+      }
+    }
+    images.push_back(std::move(image));
+    destinations.push_back(boundsMap.FindRank(link.ToBlockId));
+  }
+
+  std::vector<MPI_Request> requests(images.size());
+  for (std::size_t i = 0; i < images.size(); ++i)
+  {
+    MPI_Isend(images[i].data(),
+              static_cast<int>(images[i].size()),
+              MPI_FLOAT,
+              destinations[i],
+              FaceImageTag,
+              comm,
+              &requests[i]);
+  }
+  MPI_Waitall(static_cast<int>(requests.size()), requests.data(), MPI_STATUSES_IGNORE);
+}
+
+bool TransmittanceExchangeKey::operator==(const TransmittanceExchangeKey& other) const
+{
+  return this->LightPositions == other.LightPositions && this->MapSize == other.MapSize &&
+    this->BlockBounds == other.BlockBounds && this->BlockRanks == other.BlockRanks &&
+    this->TransparentBlocks == other.TransparentBlocks;
+}
+
+TransmittanceExchangeKey MakeTransmittanceExchangeKey(
+  const std::vector<vtkm::Vec3f_32>& lightPositions,
+  const vtkm::Id3& mapSize,
+  const beams::rendering::BoundsMap& boundsMap,
+  const std::vector<vtkm::UInt8>& transparentBlocks)
+{
+  TransmittanceExchangeKey key;
+  key.LightPositions = lightPositions;
+  key.MapSize = mapSize;
+  key.BlockBounds = boundsMap.BlockBounds;
+  for (vtkm::Id block = 0; block < boundsMap.TotalNumBlocks; ++block)
+  {
+    key.BlockRanks.push_back(boundsMap.FindRank(block));
+  }
+  key.TransparentBlocks = transparentBlocks;
+  return key;
+}
+
+TransmittanceExchangePlan::~TransmittanceExchangePlan()
+{
+  // Nothing can be released once MPI is gone
+  int finalized;
+  MPI_Finalized(&finalized);
+  if (finalized)
+  {
+    return;
+  }
+  this->FreeNeighborhood();
+  if (this->HasTypes)
+  {
+    FreeMpiTypes(this->Types);
+  }
+}
+
+const MpiTypes& TransmittanceExchangePlan::GetTypes()
+{
+  if (!this->HasTypes)
+  {
+    this->Types = ConstructMpiTypes();
+    this->HasTypes = true;
+  }
+  return this->Types;
+}
+
+bool TransmittanceExchangePlan::IsBuiltFor(const TransmittanceExchangeKey& key) const
+{
+  return this->HasKey && this->Key == key;
+}
+
+void TransmittanceExchangePlan::Reset(const TransmittanceExchangeKey& key,
+                                      std::vector<TransmittanceRayBlockHit>&& hits)
+{
+  this->FreeNeighborhood();
+  this->Key = key;
+  this->HasKey = true;
+  this->Hits = std::move(hits);
+}
+
+void TransmittanceExchangePlan::ExchangeNeighborhood(MPI_Comm comm,
+                                                     const beams::rendering::BoundsMap& boundsMap,
+                                                     TransmittanceWireFormat format,
+                                                     const TransmittanceHitEvaluator& evaluate)
+{
+  if (this->HasNeighborhood && (this->Format != format || this->IsPushed))
+  {
+    this->FreeNeighborhood();
+  }
+  if (!this->HasNeighborhood)
+  {
+    this->BuildNeighborhood(comm, boundsMap, format, nullptr);
+  }
+  this->SendReplies(evaluate);
+}
+
+void TransmittanceExchangePlan::PushNeighborhood(MPI_Comm comm,
+                                                 const beams::rendering::BoundsMap& boundsMap,
+                                                 TransmittanceWireFormat format,
+                                                 const TransmittanceHitGenerator& generate,
+                                                 const TransmittanceHitEvaluator& evaluate)
+{
+  if (this->HasNeighborhood && (this->Format != format || !this->IsPushed))
+  {
+    this->FreeNeighborhood();
+  }
+  if (!this->HasNeighborhood)
+  {
+    this->BuildNeighborhood(comm, boundsMap, format, &generate);
+  }
+  this->SendReplies(evaluate);
+}
+
+void TransmittanceExchangePlan::SendReplies(const TransmittanceHitEvaluator& evaluate)
+{
+  const bool isCompact = this->Format == TransmittanceWireFormat::Compact;
+  evaluate(this->UniqueQueries);
+  for (std::size_t i = 0; i < this->QueryUniqueIds.size(); ++i)
+  {
+    const vtkm::Float32 opacity = this->UniqueQueries[this->QueryUniqueIds[i]].Opacity;
+    if (isCompact)
+    {
+      this->CompactRepliesOut[i] = QuantizeOpacity(opacity);
+    }
+    else
+    {
+      this->RepliesOut[i] = opacity;
+    }
+  }
+
+  MPI_Startall(static_cast<int>(this->ReplyRequests.size()), this->ReplyRequests.data());
+  MPI_Waitall(
+    static_cast<int>(this->ReplyRequests.size()), this->ReplyRequests.data(), MPI_STATUSES_IGNORE);
+
+  for (std::size_t pos = 0; pos < this->SendOrder.size(); ++pos)
+  {
+    this->Hits[this->SendOrder[pos]].Opacity =
+      isCompact ? DequantizeOpacity(this->CompactRepliesIn[pos]) : this->RepliesIn[pos];
+  }
+}
+
+void TransmittanceExchangePlan::BuildNeighborhood(MPI_Comm comm,
+                                                  const beams::rendering::BoundsMap& boundsMap,
+                                                  TransmittanceWireFormat format,
+                                                  const TransmittanceHitGenerator* generate)
+{
+  const MpiTypes& types = this->GetTypes();
+  this->Format = format;
+  this->IsPushed = generate != nullptr;
+  this->Neighborhood = BuildTransmittanceNeighborhood(
+    comm, boundsMap, this->Key.LightPositions, this->Key.TransparentBlocks);
+  NeighborhoodRoute route;
+  if (this->IsPushed)
+  {
+    // The queries of each downstream rank are the hits its map makes on the local block, listed
+    // in the order that rank buckets them in
+    route = BucketHits(boundsMap, this->Neighborhood, this->Hits);
+    const std::vector<int>& downstream = this->Neighborhood.DownstreamRanks;
+    route.RecvCounts.resize(downstream.size(), 0);
+    for (std::size_t i = 0; i < downstream.size(); ++i)
+    {
+      for (vtkm::Id block = 0; block < boundsMap.TotalNumBlocks; ++block)
+      {
+        if (boundsMap.FindRank(block) != downstream[i])
+        {
+          continue;
+        }
+        std::vector<TransmittanceRayBlockHit> blockQueries = (*generate)(block);
+        route.RecvCounts[i] += static_cast<int>(blockQueries.size());
+        route.Queries.insert(route.Queries.end(), blockQueries.begin(), blockQueries.end());
+      }
+    }
+    route.RecvOffsets = ScanExclusive(route.RecvCounts);
+  }
+  else
+  {
+    route = RouteQueries(types, boundsMap, this->Neighborhood, format, this->Hits);
+  }
+  this->SendOrder = std::move(route.SendOrder);
+  // Every downstream rank still gets a reply per query, but coincident ones are evaluated once
+  const vtkm::Id3& mapSize = this->Key.MapSize;
+  const vtkm::Id numVertices = (mapSize[0] + 1) * (mapSize[1] + 1) * (mapSize[2] + 1);
+  this->UniqueQueries =
+    FindUniqueQueries(boundsMap, route.Queries, numVertices, this->QueryUniqueIds);
+
+  // The reply buffers are bound to the persistent requests, so only the format's pair is sized
+  const bool isCompact = format == TransmittanceWireFormat::Compact;
+  void* repliesIn;
+  void* repliesOut;
+  int replySize;
+  MPI_Datatype replyType;
+  if (isCompact)
+  {
+    this->CompactRepliesOut.resize(this->QueryUniqueIds.size());
+    this->CompactRepliesIn.resize(this->SendOrder.size());
+    repliesOut = this->CompactRepliesOut.data();
+    repliesIn = this->CompactRepliesIn.data();
+    replySize = static_cast<int>(sizeof(vtkm::UInt16));
+    replyType = MPI_UINT16_T;
+  }
+  else
+  {
+    this->RepliesOut.resize(this->QueryUniqueIds.size());
+    this->RepliesIn.resize(this->SendOrder.size());
+    repliesOut = this->RepliesOut.data();
+    repliesIn = this->RepliesIn.data();
+    replySize = static_cast<int>(sizeof(vtkm::Float32));
+    replyType = MPI_FLOAT;
+  }
+
+  // The graph communicators keep the ranks of comm, so they double as the replies' channel
+  const int replyTag = 103;
+  MPI_Comm replyComm = this->Neighborhood.ReplyComm;
+  const std::vector<int>& upstream = this->Neighborhood.UpstreamRanks;
+  const std::vector<int>& downstream = this->Neighborhood.DownstreamRanks;
+  for (std::size_t i = 0; i < upstream.size(); ++i)
+  {
+    if (route.SendCounts[i] == 0)
+    {
+      continue;
+    }
+    MPI_Request request;
+    MPI_Recv_init(static_cast<char*>(repliesIn) + route.SendOffsets[i] * replySize,
+                  route.SendCounts[i],
+                  replyType,
+                  upstream[i],
+                  replyTag,
+                  replyComm,
+                  &request);
+    this->ReplyRequests.push_back(request);
+  }
+  for (std::size_t i = 0; i < downstream.size(); ++i)
+  {
+    if (route.RecvCounts[i] == 0)
+    {
+      continue;
+    }
+    MPI_Request request;
+    MPI_Send_init(static_cast<char*>(repliesOut) + route.RecvOffsets[i] * replySize,
+                  route.RecvCounts[i],
+                  replyType,
+                  downstream[i],
+                  replyTag,
+                  replyComm,
+                  &request);
+    this->ReplyRequests.push_back(request);
+  }
+  this->HasNeighborhood = true;
+}
+
+void TransmittanceExchangePlan::FreeNeighborhood()
+{
+  if (!this->HasNeighborhood)
+  {
+    return;
+  }
+  for (MPI_Request& request : this->ReplyRequests)
+  {
+    MPI_Request_free(&request);
+  }
+  this->ReplyRequests.clear();
+  FreeTransmittanceNeighborhood(this->Neighborhood);
+  this->SendOrder.clear();
+  this->UniqueQueries.clear();
+  this->QueryUniqueIds.clear();
+  this->RepliesOut.clear();
+  this->RepliesIn.clear();
+  this->CompactRepliesOut.clear();
+  this->CompactRepliesIn.clear();
+  this->HasNeighborhood = false;
+}
+
+TransmittancePipeline::TransmittancePipeline(MPI_Comm comm,
+                                             const MpiTypes& types,
+                                             const beams::rendering::BoundsMap& boundsMap,
+                                             const vtkm::Vec3f_32& lightPosition,
+                                             const vtkm::Id3& mapSize,
+                                             const std::vector<vtkm::UInt8>& transparentBlocks,
+                                             TransmittanceWireFormat format,
+                                             vtkm::Id numChunks)
+  : Comm(comm)
+  , Types(types)
+  , BoundsMap(boundsMap)
+  , MapSize(mapSize)
+  , Format(format)
+  , NumChunks(numChunks)
+{
+  // Only the neighbor lists are needed, the messages go over comm
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  FindNeighborRanks(rank, boundsMap, { lightPosition }, transparentBlocks, this->Neighborhood);
+  this->PendingQueries.resize(this->Neighborhood.DownstreamRanks.size());
+  this->Chunks.reserve(static_cast<std::size_t>(numChunks));
+}
+
+void TransmittancePipeline::PostChunk(std::vector<TransmittanceRayBlockHit>&& hits)
+{
+  if (static_cast<vtkm::Id>(this->Chunks.size()) == this->NumChunks)
+  {
+    throw vtkm::cont::ErrorBadValue("All " + std::to_string(this->NumChunks) +
+                                    " chunks of the transmittance pipeline are already posted");
+  }
+  this->Chunks.emplace_back();
+  Chunk& chunk = this->Chunks.back();
+  chunk.Hits = std::move(hits);
+  NeighborhoodRoute route = BucketHits(this->BoundsMap, this->Neighborhood, chunk.Hits);
+  chunk.SendCounts = std::move(route.SendCounts);
+  chunk.SendOffsets = std::move(route.SendOffsets);
+  chunk.SendOrder = std::move(route.SendOrder);
+  chunk.SendHits = std::move(route.SendHits);
+
+  const bool isCompact = this->Format == TransmittanceWireFormat::Compact;
+  if (isCompact)
+  {
+    chunk.SendPoints = EncodeQueries(chunk.SendHits, this->BoundsMap);
+    chunk.CompactRepliesIn.resize(chunk.SendHits.size());
+  }
+  else
+  {
+    chunk.RepliesIn.resize(chunk.SendHits.size());
+  }
+
+  // Empty messages are sent too, every upstream rank expects one message per chunk. Only
+  // non-empty ones are answered.
+  const std::vector<int>& upstream = this->Neighborhood.UpstreamRanks;
+  for (std::size_t i = 0; i < upstream.size(); ++i)
+  {
+    const int count = chunk.SendCounts[i];
+    const std::size_t offset = static_cast<std::size_t>(chunk.SendOffsets[i]);
+    MPI_Request request;
+    if (isCompact)
+    {
+      MPI_Isend(chunk.SendPoints.data() + offset,
+                count,
+                this->Types.QuantizedPoint,
+                upstream[i],
+                PipelineQueryTag,
+                this->Comm,
+                &request);
+    }
+    else
+    {
+      MPI_Isend(chunk.SendHits.data() + offset,
+                count,
+                this->Types.TransmittanceRayBlockHit,
+                upstream[i],
+                PipelineQueryTag,
+                this->Comm,
+                &request);
+    }
+    this->Requests.push_back(request);
+
+    if (count == 0)
+    {
+      continue;
+    }
+    if (isCompact)
+    {
+      MPI_Irecv(chunk.CompactRepliesIn.data() + offset,
+                count,
+                MPI_UINT16_T,
+                upstream[i],
+                PipelineReplyTag,
+                this->Comm,
+                &request);
+    }
+    else
+    {
+      MPI_Irecv(chunk.RepliesIn.data() + offset,
+                count,
+                MPI_FLOAT,
+                upstream[i],
+                PipelineReplyTag,
+                this->Comm,
+                &request);
+    }
+    this->Requests.push_back(request);
+  }
+}
+
+void TransmittancePipeline::Progress(vtkm::Id numReadyLayers,
+                                     const TransmittanceHitEvaluator& evaluate)
+{
+  this->ReceiveQueries(false);
+  this->AnswerQueries(numReadyLayers, evaluate);
+}
+
+std::vector<TransmittanceRayBlockHit> TransmittancePipeline::Finish(
+  const TransmittanceHitEvaluator& evaluate)
+{
+  if (static_cast<vtkm::Id>(this->Chunks.size()) != this->NumChunks)
+  {
+    throw vtkm::cont::ErrorBadValue("Only " + std::to_string(this->Chunks.size()) + " of " +
+                                    std::to_string(this->NumChunks) +
+                                    " chunks of the transmittance pipeline were posted");
+  }
+
+  // Answer what is already here before blocking on the rest
+  const vtkm::Id numLayers = this->MapSize[2] + 1;
+  this->AnswerQueries(numLayers, evaluate);
+  this->ReceiveQueries(true);
+  this->AnswerQueries(numLayers, evaluate);
+  MPI_Waitall(static_cast<int>(this->Requests.size()), this->Requests.data(), MPI_STATUSES_IGNORE);
+  this->Requests.clear();
+
+  const bool isCompact = this->Format == TransmittanceWireFormat::Compact;
+  std::vector<TransmittanceRayBlockHit> hits;
+  for (Chunk& chunk : this->Chunks)
+  {
+    for (std::size_t pos = 0; pos < chunk.SendOrder.size(); ++pos)
+    {
+      chunk.Hits[chunk.SendOrder[pos]].Opacity =
+        isCompact ? DequantizeOpacity(chunk.CompactRepliesIn[pos]) : chunk.RepliesIn[pos];
+    }
+    hits.insert(hits.end(), chunk.Hits.begin(), chunk.Hits.end());
+  }
+  return hits;
+}
+
+void TransmittancePipeline::ReceiveQueries(bool wait)
+{
+  const std::vector<int>& downstream = this->Neighborhood.DownstreamRanks;
+  const vtkm::Id numExpected = this->NumChunks * static_cast<vtkm::Id>(downstream.size());
+  while (this->NumQueriesReceived < numExpected)
+  {
+    MPI_Status status;
+    if (wait)
+    {
+      MPI_Probe(MPI_ANY_SOURCE, PipelineQueryTag, this->Comm, &status);
+    }
+    else
+    {
+      int isReady;
+      MPI_Iprobe(MPI_ANY_SOURCE, PipelineQueryTag, this->Comm, &isReady, &status);
+      if (!isReady)
+      {
+        return;
+      }
+    }
+
+    const int source = status.MPI_SOURCE;
+    int neighbor = NeighborIndex(downstream, source);
+    if (neighbor < 0)
+    {
+      throw vtkm::cont::ErrorBadValue("Pipelined transmittance queries from rank " +
+                                      std::to_string(source) + " outside the neighborhood");
+    }
+
+    QueryMessage message;
+    int count;
+    if (this->Format == TransmittanceWireFormat::Compact)
+    {
+      MPI_Get_count(&status, this->Types.QuantizedPoint, &count);
+      std::vector<QuantizedPoint> points(static_cast<std::size_t>(count));
+      MPI_Recv(points.data(),
+               count,
+               this->Types.QuantizedPoint,
+               source,
+               PipelineQueryTag,
+               this->Comm,
+               MPI_STATUS_IGNORE);
+      message.Queries = DecodeQueries(points, { count }, { 0 }, { source }, this->BoundsMap);
+    }
+    else
+    {
+      MPI_Get_count(&status, this->Types.TransmittanceRayBlockHit, &count);
+      message.Queries.resize(static_cast<std::size_t>(count));
+      MPI_Recv(message.Queries.data(),
+               count,
+               this->Types.TransmittanceRayBlockHit,
+               source,
+               PipelineQueryTag,
+               this->Comm,
+               MPI_STATUS_IGNORE);
+    }
+    message.NumLayers = this->FindNumLayers(message.Queries);
+    this->PendingQueries[static_cast<std::size_t>(neighbor)].push_back(std::move(message));
+    this->NumQueriesReceived++;
+  }
+}
+
+void TransmittancePipeline::AnswerQueries(vtkm::Id numReadyLayers,
+                                          const TransmittanceHitEvaluator& evaluate)
+{
+  // The messages of each downstream rank are answered in the order they came in, so that its
+  // receives match them. The ready ones of all ranks are evaluated together.
+  std::vector<TransmittanceRayBlockHit> queries;
+  std::vector<std::pair<int, std::size_t>> answered;
+  const std::vector<int>& downstream = this->Neighborhood.DownstreamRanks;
+  for (std::size_t i = 0; i < downstream.size(); ++i)
+  {
+    std::deque<QueryMessage>& pending = this->PendingQueries[i];
+    while (!pending.empty() && pending.front().NumLayers <= numReadyLayers)
+    {
+      std::vector<TransmittanceRayBlockHit>& messageQueries = pending.front().Queries;
+      if (!messageQueries.empty())
+      {
+        queries.insert(queries.end(), messageQueries.begin(), messageQueries.end());
+        answered.emplace_back(downstream[i], messageQueries.size());
+      }
+      pending.pop_front();
+    }
+  }
+  if (queries.empty())
+  {
+    return;
+  }
+  evaluate(queries);
+
+  std::size_t begin = 0;
+  for (const auto& message : answered)
+  {
+    MPI_Request request;
+    const int count = static_cast<int>(message.second);
+    if (this->Format == TransmittanceWireFormat::Compact)
+    {
+      std::vector<vtkm::UInt16> replies(message.second);
+      for (std::size_t i = 0; i < message.second; ++i)
+      {
+        replies[i] = QuantizeOpacity(queries[begin + i].Opacity);
+      }
+      this->CompactRepliesOut.push_back(std::move(replies));
+      MPI_Isend(this->CompactRepliesOut.back().data(),
+                count,
+                MPI_UINT16_T,
+                message.first,
+                PipelineReplyTag,
+                this->Comm,
+                &request);
+    }
+    else
+    {
+      std::vector<vtkm::Float32> replies(message.second);
+      for (std::size_t i = 0; i < message.second; ++i)
+      {
+        replies[i] = queries[begin + i].Opacity;
+      }
+      this->RepliesOut.push_back(std::move(replies));
+      MPI_Isend(this->RepliesOut.back().data(),
+                count,
+                MPI_FLOAT,
+                message.first,
+                PipelineReplyTag,
+                this->Comm,
+                &request);
+    }
+    this->Requests.push_back(request);
+    begin += message.second;
+  }
+}
+
+vtkm::Id TransmittancePipeline::FindNumLayers(
+  const std::vector<TransmittanceRayBlockHit>& queries) const
+{
+  const vtkm::Id numLayers = this->MapSize[2] + 1;
+  const vtkm::Id localBlock = this->BoundsMap.GetLocalBlockId();
+  const vtkm::Range& z = this->BoundsMap.BlockBounds[static_cast<std::size_t>(localBlock)].Z;
+  if (queries.empty())
+  {
+    return 0;
+  }
+  if (z.Length() <= 0.0)
+  {
+    return numLayers;
+  }
+
+  vtkm::Id maxCell = 0;
+  for (const TransmittanceRayBlockHit& query : queries)
+  {
+    vtkm::Float64 t = (vtkm::Float64(query.Point[2]) - z.Min) / z.Length();
+    maxCell = std::max(maxCell, static_cast<vtkm::Id>(std::floor(t * this->MapSize[2])));
+  }
+  // A cell needs the layers on both its sides, plus one for points the locator rounds into the
+  // next cell
+  return std::min(maxCell + 3, numLayers);
+}
+
+TransmittanceWindow::TransmittanceWindow(MPI_Comm comm, const vtkm::Id3& mapSize)
+  : Comm(comm)
+  , MapSize(mapSize)
+  , NumVertices((mapSize[0] + 1) * (mapSize[1] + 1) * (mapSize[2] + 1))
+{
+  MPI_Comm_rank(comm, &this->Rank);
+  const MPI_Aint windowSize = static_cast<MPI_Aint>(this->NumVertices * sizeof(vtkm::Float32));
+  MPI_Win_allocate(windowSize,
+                   static_cast<int>(sizeof(vtkm::Float32)),
+                   MPI_INFO_NULL,
+                   comm,
+                   &this->Opacities,
+                   &this->Window);
+}
+
+TransmittanceWindow::~TransmittanceWindow()
+{
+  if (this->Window != MPI_WIN_NULL)
+  {
+    MPI_Win_free(&this->Window);
+  }
+}
+
+void TransmittanceWindow::Expose(const std::vector<vtkm::Float32>& opacities)
+{
+  if (static_cast<vtkm::Id>(opacities.size()) != this->NumVertices)
+  {
+    throw vtkm::cont::ErrorBadValue("The opacity map does not match the size of the window");
+  }
+
+  // Nobody may still be reading the previous map, and nobody may read this one before it is in
+  MPI_Barrier(this->Comm);
+  MPI_Win_lock(MPI_LOCK_EXCLUSIVE, this->Rank, 0, this->Window);
+  std::copy(opacities.begin(), opacities.end(), this->Opacities);
+  MPI_Win_unlock(this->Rank, this->Window);
+  MPI_Barrier(this->Comm);
+}
+
+void TransmittanceWindow::Fetch(const beams::rendering::BoundsMap& boundsMap,
+                                std::vector<TransmittanceRayBlockHit>& hits)
+{
+  // The cell of every hit, and the vertices needed from each owner
+  std::vector<int> hitRanks(hits.size());
+  std::vector<vtkm::Id3> hitCells(hits.size());
+  std::vector<vtkm::Vec3f_32> hitCoords(hits.size());
+  std::map<int, std::vector<vtkm::Id>> vertices;
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    int owner = boundsMap.FindRank(hits[i].BlockId);
+    if (owner < 0)
+    {
+      throw vtkm::cont::ErrorBadValue("No rank owns block " + std::to_string(hits[i].BlockId));
+    }
+    const vtkm::Bounds& bounds = boundsMap.BlockBounds[static_cast<std::size_t>(hits[i].BlockId)];
+    LocateMapCell(bounds, this->MapSize, hits[i].Point, hitCells[i], hitCoords[i]);
+    hitRanks[i] = owner;
+    vtkm::Vec<vtkm::Id, 8> indices = GetMapCellIndices(this->MapSize, hitCells[i]);
+    std::vector<vtkm::Id>& ownerVertices = vertices[owner];
+    ownerVertices.insert(ownerVertices.end(), &indices[0], &indices[0] + 8);
+  }
+
+  // Neighboring hits share most of their corners, and the corners along x are contiguous, so
+  // each owner is read in as few runs of consecutive vertices as possible
+  std::map<int, std::vector<vtkm::Float32>> values;
+  MPI_Win_lock_all(0, this->Window);
+  for (auto& entry : vertices)
+  {
+    std::vector<vtkm::Id>& ownerVertices = entry.second;
+    std::sort(ownerVertices.begin(), ownerVertices.end());
+    ownerVertices.erase(std::unique(ownerVertices.begin(), ownerVertices.end()),
+                        ownerVertices.end());
+    std::vector<vtkm::Float32>& ownerValues = values[entry.first];
+    ownerValues.resize(ownerVertices.size());
+    std::size_t begin = 0;
+    while (begin < ownerVertices.size())
+    {
+      std::size_t end = begin + 1;
+      while (end < ownerVertices.size() && ownerVertices[end] == ownerVertices[end - 1] + 1)
+      {
+        ++end;
+      }
+      const int count = static_cast<int>(end - begin);
+      MPI_Get(&ownerValues[begin],
+              count,
+              MPI_FLOAT,
+              entry.first,
+              static_cast<MPI_Aint>(ownerVertices[begin]),
+              count,
+              MPI_FLOAT,
+              this->Window);
+      begin = end;
+    }
+  }
+  MPI_Win_unlock_all(this->Window);
+
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    const std::vector<vtkm::Id>& ownerVertices = vertices[hitRanks[i]];
+    const std::vector<vtkm::Float32>& ownerValues = values[hitRanks[i]];
+    vtkm::Vec<vtkm::Id, 8> indices = GetMapCellIndices(this->MapSize, hitCells[i]);
+    vtkm::Vec<vtkm::Float32, 8> corners;
+    for (vtkm::IdComponent c = 0; c < 8; ++c)
+    {
+      auto pos = std::lower_bound(ownerVertices.begin(), ownerVertices.end(), indices[c]);
+      corners[c] = ownerValues[static_cast<std::size_t>(pos - ownerVertices.begin())];
+    }
+    hits[i].Opacity = InterpolateHexahedron(corners, hitCoords[i]);
+  }
+}
+} // namespace rendering
+} // namespace beams
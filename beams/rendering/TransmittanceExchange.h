@@ -0,0 +1,443 @@
+#ifndef beams_rendering_transmittance_exchange_h
+#define beams_rendering_transmittance_exchange_h
+
+#include <vtkm/Bounds.h>
+#include <vtkm/Types.h>
+
+#include <mpi.h>
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace pilot
+{
+namespace mpi
+{
+struct Environment;
+}
+}
+
+namespace beams
+{
+namespace rendering
+{
+struct BoundsMap;
+
+// RayId numbers the light rays of the source map light by light, light * numVertices + vertex
+struct TransmittanceRayBlockHit
+{
+  int RayId;
+  int BlockId;
+  int FromBlockId;
+  vtkm::Vec3f_32 Point;
+  vtkm::Float32 RayT;
+  vtkm::Float32 Opacity;
+};
+
+enum class TransmittanceExchangeMode
+{
+  // Rank 0 gathers every hit, routes it to its owner and routes the answer back
+  RootRouted,
+  // Every rank sends its hits straight to the owning ranks with MPI_Alltoallv
+  Direct,
+  // Like Direct, but over a graph communicator that only connects blocks that can shadow each other
+  Neighborhood,
+  // No queries, every rank works out the hits other ranks make on its block and pushes the answers
+  Push,
+  // No hits, the opacity map faces facing away from the light are passed down to the next blocks
+  FaceImages,
+  // Like Neighborhood, but the hits are sent chunk by chunk while the local map is generated
+  Pipelined,
+  // Like Direct, but as asynchronous messages through TransmittanceMessenger
+  Messages,
+  // Like Direct, but the queries of a node are combined per destination node and only the node
+  // leaders talk across nodes
+  NodeAggregated,
+  // No queries, every rank reads the map vertices around its hits out of the owners' maps with
+  // one-sided MPI_Get through TransmittanceWindow
+  OneSided,
+  // No queries, the maps of all the blocks are gathered on every rank and the hits are evaluated
+  // locally
+  Replicated,
+  // Replicated while the gathered maps fit in the replication threshold, Neighborhood otherwise
+  Auto,
+};
+
+enum class TransmittanceWireFormat
+{
+  // Whole TransmittanceRayBlockHit records both ways
+  Full,
+  // Query points quantized to 16 bits per axis within the target block, 16 bit unorm opacities
+  // back. The ray is implied by the position of the query in the list sent to each peer. Lossy,
+  // so it has to be asked for.
+  Compact,
+};
+
+// A point quantized to 16 bits per axis relative to the bounds of the block it lies in
+using QuantizedPoint = vtkm::Vec<vtkm::UInt16, 3>;
+
+struct MpiTypes
+{
+  MPI_Datatype Vec3f_32;
+  MPI_Datatype Vec4f_32;
+  MPI_Datatype TransmittanceRayBlockHit;
+  MPI_Datatype QuantizedPoint;
+};
+
+MpiTypes ConstructMpiTypes();
+
+void FreeMpiTypes(MpiTypes& types);
+
+// Fills in the Opacity of every hit it is given, using the local opacity map
+using TransmittanceHitEvaluator = std::function<void(std::vector<TransmittanceRayBlockHit>&)>;
+
+// Lists the hits the opacity map vertices of a remote block make on the local block, in the order
+// of the vertices
+using TransmittanceHitGenerator = std::function<std::vector<TransmittanceRayBlockHit>(vtkm::Id)>;
+
+QuantizedPoint QuantizePoint(const vtkm::Vec3f_32& point, const vtkm::Bounds& bounds);
+
+vtkm::Vec3f_32 DequantizePoint(const QuantizedPoint& point, const vtkm::Bounds& bounds);
+
+vtkm::UInt16 QuantizeOpacity(vtkm::Float32 opacity);
+
+vtkm::Float32 DequantizeOpacity(vtkm::UInt16 opacity);
+
+//
+// Per-block opacity summaries. Each rank contributes the largest alpha the color map reaches over
+// the scalar range of its block. A block whose summary is 0 cannot attenuate light, so no hits
+// are made on it and it is left out of the light-visibility graph. The summaries depend on the
+// color map, so they are gathered every frame.
+//
+std::vector<vtkm::Float32> GatherBlockMaxAlphas(MPI_Comm comm, vtkm::Float32 localMaxAlpha);
+
+// 1 for every block that is fully transparent, indexed by block id
+std::vector<vtkm::UInt8> FindTransparentBlocks(const std::vector<vtkm::Float32>& blockMaxAlphas);
+
+//
+// The light-visibility graph of the local blocks. A light ray reaching a local block can only
+// pass through the blocks overlapping the box around the light and that block, so those are the
+// only blocks a local map vertex ever queries. With several lights the blocks upstream of any of
+// them are. QueryComm has edges from this rank to the owners of its upstream blocks, ReplyComm
+// has the same edges reversed. Transparent blocks are never upstream of anything.
+//
+struct TransmittanceNeighborhood
+{
+  MPI_Comm QueryComm = MPI_COMM_NULL;
+  MPI_Comm ReplyComm = MPI_COMM_NULL;
+  std::vector<int> UpstreamRanks;
+  std::vector<int> DownstreamRanks;
+};
+
+std::vector<vtkm::Id> FindUpstreamBlocks(const beams::rendering::BoundsMap& boundsMap,
+                                         vtkm::Id blockId,
+                                         const vtkm::Vec3f_32& lightPosition,
+                                         const std::vector<vtkm::UInt8>& transparentBlocks);
+
+TransmittanceNeighborhood BuildTransmittanceNeighborhood(
+  MPI_Comm comm,
+  const beams::rendering::BoundsMap& boundsMap,
+  const std::vector<vtkm::Vec3f_32>& lightPositions,
+  const std::vector<vtkm::UInt8>& transparentBlocks);
+
+void FreeTransmittanceNeighborhood(TransmittanceNeighborhood& neighborhood);
+
+//
+// Each of the exchanges below sends the hits to the ranks owning hit.BlockId, lets the owners
+// evaluate them and writes the answers back into hits[i].Opacity. The order of the hits is
+// preserved, so the hit counts and offsets computed for them stay valid. The Compact
+// format assumes one block per rank, as the rest of the renderer does.
+//
+void ExchangeHitsThroughRoot(MPI_Comm comm,
+                             const MpiTypes& types,
+                             std::vector<TransmittanceRayBlockHit>& hits,
+                             const TransmittanceHitEvaluator& evaluate);
+
+void ExchangeHitsDirect(MPI_Comm comm,
+                        const MpiTypes& types,
+                        const beams::rendering::BoundsMap& boundsMap,
+                        TransmittanceWireFormat format,
+                        std::vector<TransmittanceRayBlockHit>& hits,
+                        const TransmittanceHitEvaluator& evaluate);
+
+//
+// Two-level exchange over the node split of env. The queries of a node are gathered on its
+// leader, sent in one message per destination node between the leaders and scattered to the
+// owning ranks there. The replies retrace the same route. With many ranks per node this turns
+// the P^2 small messages of Direct into N^2 larger ones between the N nodes.
+//
+void ExchangeHitsNodeAggregated(const pilot::mpi::Environment& env,
+                                const beams::rendering::BoundsMap& boundsMap,
+                                TransmittanceWireFormat format,
+                                std::vector<TransmittanceRayBlockHit>& hits,
+                                const TransmittanceHitEvaluator& evaluate);
+
+// Hits on blocks outside the neighborhood cannot attenuate the ray and get an opacity of 0
+void ExchangeHitsNeighborhood(const MpiTypes& types,
+                              const beams::rendering::BoundsMap& boundsMap,
+                              const TransmittanceNeighborhood& neighborhood,
+                              TransmittanceWireFormat format,
+                              std::vector<TransmittanceRayBlockHit>& hits,
+                              const TransmittanceHitEvaluator& evaluate);
+
+//
+// Replication. Every rank gets a copy of the opacity map of every block, one after the other in
+// block order. Transparent blocks are never hit, so their maps are not sent and are left at 0.
+// For small maps this costs less than the queries of Direct, and no rank waits on another to
+// answer.
+//
+std::vector<vtkm::Float32> GatherOpacityMaps(MPI_Comm comm,
+                                             const std::vector<vtkm::Float32>& opacities,
+                                             const std::vector<vtkm::UInt8>& transparentBlocks);
+
+// The bytes GatherOpacityMaps receives on every rank for maps of numVertices vertices
+std::size_t GetReplicatedMapsSize(vtkm::Id numVertices,
+                                  const std::vector<vtkm::UInt8>& transparentBlocks);
+
+// Picks the mode an Auto exchange runs as. The result is the same on all ranks.
+TransmittanceExchangeMode ResolveExchangeMode(TransmittanceExchangeMode mode,
+                                              vtkm::Id numVertices,
+                                              const std::vector<vtkm::UInt8>& transparentBlocks,
+                                              std::size_t replicationThreshold);
+
+//
+// Face images. Every block hands the opacities on the faces of its opacity map that face away
+// from the light to the blocks on the other side. Those already include everything upstream, so
+// a block only needs the images of the faces its light rays enter through, and the blocks along
+// the light direction are finished one after the other instead of through an all-to-all.
+//
+// The light is homogeneous: (position, 1) for a point light and (direction towards the light, 0)
+// for a directional one, which only ever hands one boundary slice per axis downstream.
+//
+struct TransmittanceFaceLink
+{
+  vtkm::Id FromBlockId;
+  vtkm::Id ToBlockId;
+  // The axis of the shared face and whether it is the max face of FromBlockId
+  int Axis;
+  bool IsMaxFace;
+};
+
+std::vector<TransmittanceFaceLink> FindFaceLinks(const beams::rendering::BoundsMap& boundsMap,
+                                                 const vtkm::Vec4f_32& light);
+
+// Collective along the light direction, waits for the images of the upstream blocks and returns
+// the opacity gathered before the light enters the local block, for every local map vertex
+std::vector<vtkm::Float32> ReceiveFaceImages(MPI_Comm comm,
+                                             const beams::rendering::BoundsMap& boundsMap,
+                                             const vtkm::Vec4f_32& light,
+                                             const vtkm::Id3& mapSize);
+
+// Sends the exit faces of the final local map to the downstream blocks
+void SendFaceImages(MPI_Comm comm,
+                    const beams::rendering::BoundsMap& boundsMap,
+                    const vtkm::Vec4f_32& light,
+                    const vtkm::Id3& mapSize,
+                    const std::vector<vtkm::Float32>& opacities);
+
+//
+// Everything that decides which hits a rank sends and to whom. The hits only depend on the
+// lights, the opacity map dims, the block layout and which blocks are transparent, so a plan
+// built for one frame stays valid until one of these changes.
+//
+struct TransmittanceExchangeKey
+{
+  std::vector<vtkm::Vec3f_32> LightPositions;
+  vtkm::Id3 MapSize;
+  std::vector<vtkm::Bounds> BlockBounds;
+  std::vector<int> BlockRanks;
+  std::vector<vtkm::UInt8> TransparentBlocks;
+
+  bool operator==(const TransmittanceExchangeKey& other) const;
+  bool operator!=(const TransmittanceExchangeKey& other) const { return !(*this == other); }
+};
+
+TransmittanceExchangeKey MakeTransmittanceExchangeKey(
+  const std::vector<vtkm::Vec3f_32>& lightPositions,
+  const vtkm::Id3& mapSize,
+  const beams::rendering::BoundsMap& boundsMap,
+  const std::vector<vtkm::UInt8>& transparentBlocks);
+
+//
+// Phase 2 state cached across frames: the committed datatypes, the sorted hit list and, for the
+// Neighborhood mode, the graph communicators, the distinct queries received from downstream ranks
+// and persistent requests for the replies. Once built, a frame only evaluates the cached queries
+// and ships one float per hit back.
+//
+class TransmittanceExchangePlan
+{
+public:
+  TransmittanceExchangePlan() = default;
+  TransmittanceExchangePlan(const TransmittanceExchangePlan&) = delete;
+  TransmittanceExchangePlan& operator=(const TransmittanceExchangePlan&) = delete;
+  ~TransmittanceExchangePlan();
+
+  const MpiTypes& GetTypes();
+
+  bool IsBuiltFor(const TransmittanceExchangeKey& key) const;
+
+  // Collective, all ranks must reset with the same key
+  void Reset(const TransmittanceExchangeKey& key, std::vector<TransmittanceRayBlockHit>&& hits);
+
+  std::vector<TransmittanceRayBlockHit>& GetHits() { return this->Hits; }
+
+  // Collective, the first call after a reset or a change of format exchanges the queries and
+  // sets up the requests
+  void ExchangeNeighborhood(MPI_Comm comm,
+                            const beams::rendering::BoundsMap& boundsMap,
+                            TransmittanceWireFormat format,
+                            const TransmittanceHitEvaluator& evaluate);
+
+  // Same as ExchangeNeighborhood, but the queries of the downstream ranks are generated locally
+  // instead of being sent. Both sides must list the hits with the same code on the same kind of
+  // device, or the reply counts will not match.
+  void PushNeighborhood(MPI_Comm comm,
+                        const beams::rendering::BoundsMap& boundsMap,
+                        TransmittanceWireFormat format,
+                        const TransmittanceHitGenerator& generate,
+                        const TransmittanceHitEvaluator& evaluate);
+
+private:
+  void BuildNeighborhood(MPI_Comm comm,
+                         const beams::rendering::BoundsMap& boundsMap,
+                         TransmittanceWireFormat format,
+                         const TransmittanceHitGenerator* generate);
+
+  void SendReplies(const TransmittanceHitEvaluator& evaluate);
+
+  void FreeNeighborhood();
+
+  bool HasKey = false;
+  TransmittanceExchangeKey Key;
+  bool HasTypes = false;
+  MpiTypes Types;
+  std::vector<TransmittanceRayBlockHit> Hits;
+
+  bool HasNeighborhood = false;
+  TransmittanceWireFormat Format = TransmittanceWireFormat::Full;
+  bool IsPushed = false;
+  TransmittanceNeighborhood Neighborhood;
+  std::vector<std::size_t> SendOrder;
+  std::vector<TransmittanceRayBlockHit> UniqueQueries;
+  std::vector<std::size_t> QueryUniqueIds;
+  std::vector<vtkm::Float32> RepliesOut;
+  std::vector<vtkm::Float32> RepliesIn;
+  std::vector<vtkm::UInt16> CompactRepliesOut;
+  std::vector<vtkm::UInt16> CompactRepliesIn;
+  std::vector<MPI_Request> ReplyRequests;
+};
+
+//
+// The Pipelined exchange. The local opacity map is generated in chunks of z layers of vertices.
+// The hits of a chunk are sent to the upstream ranks as soon as they are known, and in between
+// chunks the queries of the downstream ranks are answered as soon as the layers they interpolate
+// from are final. The messages between two ranks are matched by the order they are posted in,
+// so every rank must post the same number of chunks.
+//
+class TransmittancePipeline
+{
+public:
+  // Collective
+  TransmittancePipeline(MPI_Comm comm,
+                        const MpiTypes& types,
+                        const beams::rendering::BoundsMap& boundsMap,
+                        const vtkm::Vec3f_32& lightPosition,
+                        const vtkm::Id3& mapSize,
+                        const std::vector<vtkm::UInt8>& transparentBlocks,
+                        TransmittanceWireFormat format,
+                        vtkm::Id numChunks);
+  TransmittancePipeline(const TransmittancePipeline&) = delete;
+  TransmittancePipeline& operator=(const TransmittancePipeline&) = delete;
+
+  // Sends the sorted hits of the next chunk of map vertices to the upstream ranks
+  void PostChunk(std::vector<TransmittanceRayBlockHit>&& hits);
+
+  // Answers the queries received so far that only need the first numReadyLayers z layers of
+  // vertices of the local map
+  void Progress(vtkm::Id numReadyLayers, const TransmittanceHitEvaluator& evaluate);
+
+  // Answers the remaining queries, which needs the whole local map to be final, waits for the
+  // replies and returns the hits of all the chunks in the order they were posted
+  std::vector<TransmittanceRayBlockHit> Finish(const TransmittanceHitEvaluator& evaluate);
+
+private:
+  struct Chunk
+  {
+    std::vector<TransmittanceRayBlockHit> Hits;
+    std::vector<int> SendCounts;
+    std::vector<int> SendOffsets;
+    std::vector<std::size_t> SendOrder;
+    std::vector<TransmittanceRayBlockHit> SendHits;
+    std::vector<QuantizedPoint> SendPoints;
+    std::vector<vtkm::Float32> RepliesIn;
+    std::vector<vtkm::UInt16> CompactRepliesIn;
+  };
+
+  struct QueryMessage
+  {
+    std::vector<TransmittanceRayBlockHit> Queries;
+    // The z layers of the local map the queries interpolate from
+    vtkm::Id NumLayers;
+  };
+
+  void ReceiveQueries(bool wait);
+
+  void AnswerQueries(vtkm::Id numReadyLayers, const TransmittanceHitEvaluator& evaluate);
+
+  vtkm::Id FindNumLayers(const std::vector<TransmittanceRayBlockHit>& queries) const;
+
+  MPI_Comm Comm;
+  const MpiTypes& Types;
+  const beams::rendering::BoundsMap& BoundsMap;
+  vtkm::Id3 MapSize;
+  TransmittanceWireFormat Format;
+  vtkm::Id NumChunks;
+  TransmittanceNeighborhood Neighborhood;
+  std::vector<Chunk> Chunks;
+  std::vector<std::deque<QueryMessage>> PendingQueries;
+  vtkm::Id NumQueriesReceived = 0;
+  std::vector<std::vector<vtkm::Float32>> RepliesOut;
+  std::vector<std::vector<vtkm::UInt16>> CompactRepliesOut;
+  std::vector<MPI_Request> Requests;
+};
+
+//
+// The OneSided exchange. Every rank exposes its local opacity map from Phase 1 in an MPI window,
+// and reads the vertices around its hits straight out of the maps of the owning ranks with
+// MPI_Get in a passive-target epoch. The opacities are then interpolated locally with the same
+// math as TransmittanceMapEstimator::GetEstimateUsingVerticesT, so the owners never answer
+// queries.
+// The map of a block is assumed to span its bounds in BoundsMap, as the renderer lays it out.
+//
+class TransmittanceWindow
+{
+public:
+  // Collective, allocates room for a map of mapSize cells on every rank
+  TransmittanceWindow(MPI_Comm comm, const vtkm::Id3& mapSize);
+  TransmittanceWindow(const TransmittanceWindow&) = delete;
+  TransmittanceWindow& operator=(const TransmittanceWindow&) = delete;
+  // Collective
+  ~TransmittanceWindow();
+
+  const vtkm::Id3& GetMapSize() const { return this->MapSize; }
+
+  // Collective, puts the local map in the window once every rank is done reading the last one
+  void Expose(const std::vector<vtkm::Float32>& opacities);
+
+  // Fills in the Opacity of every hit from the exposed map of the rank owning hit.BlockId
+  void Fetch(const beams::rendering::BoundsMap& boundsMap,
+             std::vector<TransmittanceRayBlockHit>& hits);
+
+private:
+  MPI_Comm Comm;
+  int Rank;
+  vtkm::Id3 MapSize;
+  vtkm::Id NumVertices;
+  MPI_Win Window = MPI_WIN_NULL;
+  vtkm::Float32* Opacities = nullptr;
+};
+} // namespace rendering
+} // namespace beams
+
+#endif // beams_rendering_transmittance_exchange_h
@@ -4,32 +4,32 @@
 #include "../Intersections.h"
 #include "LightRayOperations.h"
 #include "LightRays.h"
+#include "TransmittanceExchange.h"
 #include <pilot/Logger.h>
 
 #include "Lights.h"
 #include <vtkm/Swap.h>
 #include <vtkm/cont/Algorithm.h>
+#include <vtkm/cont/ArrayHandleConstant.h>
+#include <vtkm/cont/ArrayHandleCounting.h>
+#include <vtkm/cont/ArrayHandleIndex.h>
+#include <vtkm/cont/ArrayHandlePermutation.h>
+#include <vtkm/cont/ArrayHandleView.h>
 #include <vtkm/cont/DataSet.h>
 #include <vtkm/exec/CellInterpolate.h>
 #include <vtkm/exec/ParametricCoordinates.h>
 #include <vtkm/io/VTKDataSetWriter.h>
 
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace beams
 {
 namespace rendering
 {
-struct TransmittanceRayBlockHit
-{
-  int RayId;
-  int BlockId;
-  int FromBlockId;
-  vtkm::Vec3f_32 Point;
-  vtkm::Float32 RayT;
-  vtkm::Float32 Opacity;
-};
-
 template <typename Device>
 class TransmittanceLocator
 {
@@ -134,6 +134,10 @@ protected:
   vtkm::Vec3f_32 MaxPoint;
 }; // class UniformLocator
 
+//
+// Interpolates the opacity maps of the lights at a point. The maps share the grid of Locations
+// and are stored one after the other in Transmittances, light by light.
+//
 template <typename Device, typename LocatorType>
 struct TransmittanceMapEstimator
 {
@@ -141,71 +145,88 @@ struct TransmittanceMapEstimator
   using PointsReadPortal = typename PointsArrayHandle::ReadPortalType;
   using TransmittanceArrayHandle = vtkm::cont::ArrayHandle<vtkm::Float32>;
   using TransmittanceReadPortal = typename TransmittanceArrayHandle::ReadPortalType;
+  using ColorArrayHandle = vtkm::cont::ArrayHandle<vtkm::Vec3f_32>;
+  using ColorReadPortal = typename ColorArrayHandle::ReadPortalType;
 
   PointsArrayHandle LocationsHandle;
   PointsReadPortal Locations;
   TransmittanceArrayHandle TransmittancesHandle;
   TransmittanceReadPortal Transmittances;
   LocatorType Locator;
-  vtkm::Vec3f_32 LightColor;
+  ColorArrayHandle LightColorsHandle;
+  ColorReadPortal LightColors;
+  vtkm::Id NumVertices;
+  vtkm::Id NumLights;
 
   TransmittanceMapEstimator(const PointsArrayHandle& locations,
                             const TransmittanceArrayHandle& transmittances,
                             const LocatorType& locator,
-                            const vtkm::Vec3f_32 lightColor,
+                            const ColorArrayHandle& lightColors,
                             vtkm::cont::Token& token)
     : LocationsHandle(locations)
     , Locations(locations.PrepareForInput(Device(), token))
     , TransmittancesHandle(transmittances)
     , Transmittances(transmittances.PrepareForInput(Device(), token))
     , Locator(locator)
-    , LightColor(lightColor)
+    , LightColorsHandle(lightColors)
+    , LightColors(lightColors.PrepareForInput(Device(), token))
+    , NumVertices(locations.GetNumberOfValues())
   {
+    this->NumLights = this->NumVertices > 0 ? transmittances.GetNumberOfValues() / NumVertices : 0;
   }
 
+  // The light whose map answers the queries of rayId. Queries that do not number their rays by
+  // light only come with a single map.
+  VTKM_EXEC_CONT
+  inline vtkm::Id GetRayLight(vtkm::Id rayId) const
+  {
+    return this->NumLights > 1 ? rayId / this->NumVertices : 0;
+  }
+
+  // The light that reaches point from all the lights, looking the cell up once for all the maps
   VTKM_EXEC
   inline vtkm::Vec3f GetEstimateUsingVertices(const vtkm::Vec3f& point) const
   {
-    vtkm::Id3 cell;
-    this->Locator.LocateCell(cell, point);
-
-    if (!this->IsValidCell(this->Locator.GetCellIndex(cell)))
+    vtkm::Vec<vtkm::Id, 8> cellIndices;
+    vtkm::Vec3f pcoords;
+    if (!this->FindVertices(point, cellIndices, pcoords))
     {
       return { 1.0f, 1.0f, 1.0f };
     }
-    vtkm::Vec<vtkm::Id, 8> cellIndices;
-    this->Locator.GetCellIndices(cell, cellIndices);
-
-    vtkm::Vec3f minPoint = this->Locations.Get(cellIndices[0]);
-    vtkm::Vec3f maxPoint = this->Locations.Get(cellIndices[6]);
 
-    vtkm::VecAxisAlignedPointCoordinates<3> rPoints(minPoint, maxPoint - minPoint);
+    vtkm::Vec3f light{ 0.0f, 0.0f, 0.0f };
+    for (vtkm::Id l = 0; l < this->NumLights; ++l)
+    {
+      vtkm::Float32 transmittance = 1.0f - this->Interpolate(cellIndices, pcoords, l);
+      light = light + transmittance * this->LightColors.Get(l);
+    }
+    return light;
+  }
 
+  VTKM_EXEC
+  inline vtkm::Float32 GetEstimateUsingVerticesT(const vtkm::Vec3f& point,
+                                                 vtkm::Id light = 0) const
+  {
+    vtkm::Vec<vtkm::Id, 8> cellIndices;
     vtkm::Vec3f pcoords;
-    vtkm::exec::WorldCoordinatesToParametricCoordinates(
-      rPoints, point, vtkm::CellShapeTagHexahedron(), pcoords);
-
-    vtkm::Vec<vtkm::FloatDefault, 8> scalars;
-    for (vtkm::Id i = 0; i < 8; ++i)
+    if (!this->FindVertices(point, cellIndices, pcoords))
     {
-      scalars[i] = this->Transmittances.Get(cellIndices[i]);
+      return 1.0f;
     }
-    vtkm::FloatDefault opacity;
-    vtkm::exec::CellInterpolate(scalars, pcoords, vtkm::CellShapeTagHexahedron(), opacity);
-    vtkm::Float32 transmittance = 1.0f - opacity;
-    return transmittance * this->LightColor;
+    return this->Interpolate(cellIndices, pcoords, light);
   }
 
   VTKM_EXEC
-  inline vtkm::Float32 GetEstimateUsingVerticesT(const vtkm::Vec3f& point) const
+  inline bool FindVertices(const vtkm::Vec3f& point,
+                           vtkm::Vec<vtkm::Id, 8>& cellIndices,
+                           vtkm::Vec3f& pcoords) const
   {
     vtkm::Id3 cell;
     this->Locator.LocateCell(cell, point);
     if (!this->IsValidCell(this->Locator.GetCellIndex(cell)))
     {
-      return 1.0f;
+      return false;
     }
-    vtkm::Vec<vtkm::Id, 8> cellIndices;
     this->Locator.GetCellIndices(cell, cellIndices);
 
     vtkm::Vec3f minPoint = this->Locations.Get(cellIndices[0]);
@@ -213,22 +234,27 @@ struct TransmittanceMapEstimator
 
     vtkm::VecAxisAlignedPointCoordinates<3> rPoints(minPoint, maxPoint - minPoint);
 
-    vtkm::Vec3f pcoords;
     vtkm::exec::WorldCoordinatesToParametricCoordinates(
       rPoints, point, vtkm::CellShapeTagHexahedron(), pcoords);
+    return true;
+  }
 
+  VTKM_EXEC
+  inline vtkm::Float32 Interpolate(const vtkm::Vec<vtkm::Id, 8>& cellIndices,
+                                   const vtkm::Vec3f& pcoords,
+                                   vtkm::Id light) const
+  {
+    const vtkm::Id offset = light * this->NumVertices;
     vtkm::Vec<vtkm::FloatDefault, 8> scalars;
     for (vtkm::Id i = 0; i < 8; ++i)
     {
-      scalars[i] = this->Transmittances.Get(cellIndices[i]);
+      scalars[i] = this->Transmittances.Get(offset + cellIndices[i]);
     }
     vtkm::FloatDefault opacity;
     vtkm::exec::CellInterpolate(scalars, pcoords, vtkm::CellShapeTagHexahedron(), opacity);
-
     return opacity;
   }
 
-
   VTKM_EXEC
   inline bool IsValidCell(vtkm::Id cellId) const
   {
@@ -236,6 +262,128 @@ struct TransmittanceMapEstimator
   }
 };
 
+// The opacity the color map gives the scalar at pcoords in cell, relative to the densest color
+template <typename OracleType, typename ScalarPortalType, typename ColorMapType>
+VTKM_EXEC vtkm::Float32 GetCellOpacity(const OracleType& oracle,
+                                       const ScalarPortalType& scalars,
+                                       const ColorMapType& colorMap,
+                                       vtkm::Id cellId,
+                                       const vtkm::Vec3f_32& pcoords,
+                                       vtkm::Float32 minScalar,
+                                       vtkm::Float32 inverseDeltaScalar,
+                                       vtkm::Float32 maxDensity)
+{
+  vtkm::Id cellIndices[8];
+  vtkm::Vec<vtkm::Float32, 8> values;
+  const vtkm::Int32 numIndices = oracle.GetCellIndices(cellIndices, cellId);
+  for (vtkm::Int32 i = 0; i < numIndices; ++i)
+  {
+    vtkm::Id j = cellIndices[i];
+    j = (j >= scalars.GetNumberOfValues()) ? (scalars.GetNumberOfValues() - 1) : j;
+    values[i] = static_cast<vtkm::Float32>(scalars.Get(j));
+  }
+
+  vtkm::Float32 scalar = oracle.Interpolate(values, pcoords);
+  scalar = (scalar - minScalar) * inverseDeltaScalar;
+  const vtkm::Id colorMapSize = colorMap.GetNumberOfValues() - 1;
+  vtkm::Id colorIndex = static_cast<vtkm::Id>(scalar * static_cast<vtkm::Float32>(colorMapSize));
+  constexpr vtkm::Id zero = 0;
+  colorIndex = vtkm::Max(zero, vtkm::Min(colorMapSize, colorIndex));
+  vtkm::Vec<vtkm::Float32, 4> sampleColor = colorMap.Get(colorIndex);
+  return sampleColor[3] / maxDensity;
+}
+
+//
+// Composes the opacity collected from start to end onto opacity, walking the cells of the mesh
+// the segment crosses (3D DDA). Only the first cell is searched for; from then on the walk steps
+// to whichever neighbor the segment leaves through. Every crossing is sampled once at its middle,
+// and its opacity is scaled from the one of a stepSize long step to the length of the crossing.
+// The walk stops early once the opacity reaches maxOpacity.
+//
+template <typename OracleType, typename ScalarPortalType, typename ColorMapType>
+VTKM_EXEC vtkm::Float32 TraverseCells(const OracleType& oracle,
+                                      const ScalarPortalType& scalars,
+                                      const ColorMapType& colorMap,
+                                      const vtkm::Vec3f_32& start,
+                                      const vtkm::Vec3f_32& end,
+                                      vtkm::Float32 stepSize,
+                                      vtkm::Float32 minScalar,
+                                      vtkm::Float32 inverseDeltaScalar,
+                                      vtkm::Float32 maxDensity,
+                                      vtkm::Float32 opacity,
+                                      vtkm::Float32 maxOpacity)
+{
+  const vtkm::Vec3f_32 segment = end - start;
+  const vtkm::Float32 length = vtkm::Magnitude(segment);
+  if (!(length > 0.0f))
+  {
+    return opacity;
+  }
+  const vtkm::Vec3f_32 dir = (1.0f / length) * segment;
+  const vtkm::Id3 cellDims = oracle.GetCellDims();
+
+  vtkm::Id3 cell;
+  oracle.LocateCell(start, cell);
+  vtkm::Id3 step;
+  vtkm::Vec3f_32 tNext;
+  for (vtkm::Int32 d = 0; d < 3; ++d)
+  {
+    step[d] = dir[d] > 0.0f ? 1 : (dir[d] < 0.0f ? -1 : 0);
+    tNext[d] = step[d] == 0
+      ? vtkm::Infinity32()
+      : (oracle.GetPlane(d, cell[d] + (step[d] > 0 ? 1 : 0)) - start[d]) / dir[d];
+  }
+
+  vtkm::Float32 t = 0.0f;
+  while (t < length && opacity < maxOpacity)
+  {
+    vtkm::Int32 exitDim = 0;
+    if (tNext[1] < tNext[exitDim])
+    {
+      exitDim = 1;
+    }
+    if (tNext[2] < tNext[exitDim])
+    {
+      exitDim = 2;
+    }
+    const vtkm::Float32 tExit = vtkm::Min(tNext[exitDim], length);
+
+    if (tExit > t)
+    {
+      const vtkm::Vec3f_32 middle = start + (0.5f * (t + tExit)) * dir;
+      vtkm::Vec3f_32 pcoords;
+      for (vtkm::Int32 d = 0; d < 3; ++d)
+      {
+        const vtkm::Float32 low = oracle.GetPlane(d, cell[d]);
+        const vtkm::Float32 high = oracle.GetPlane(d, cell[d] + 1);
+        pcoords[d] =
+          high > low ? vtkm::Max(0.0f, vtkm::Min(1.0f, (middle[d] - low) / (high - low))) : 0.0f;
+      }
+      vtkm::Float32 localOpacity = GetCellOpacity(oracle,
+                                                  scalars,
+                                                  colorMap,
+                                                  oracle.GetCellIndex(cell),
+                                                  pcoords,
+                                                  minScalar,
+                                                  inverseDeltaScalar,
+                                                  maxDensity);
+      localOpacity = 1.0f - vtkm::Pow(1.0f - localOpacity, (tExit - t) / stepSize);
+      opacity = opacity + (1.0f - opacity) * localOpacity;
+    }
+
+    t = tExit;
+    cell[exitDim] += step[exitDim];
+    if (cell[exitDim] < 0 || cell[exitDim] >= cellDims[exitDim])
+    {
+      break;
+    }
+    tNext[exitDim] =
+      (oracle.GetPlane(exitDim, cell[exitDim] + (step[exitDim] > 0 ? 1 : 0)) - start[exitDim]) /
+      dir[exitDim];
+  }
+  return opacity;
+}
+
 struct TransmittanceMapGenerator : public vtkm::worklet::WorkletMapField
 {
   VTKM_CONT
@@ -243,13 +391,13 @@ struct TransmittanceMapGenerator : public vtkm::worklet::WorkletMapField
                             const vtkm::Float32& minScalar,
                             const vtkm::Float32& maxScalar,
                             const vtkm::Float32& maxDensity,
-                            const vtkm::Vec3f& lightLoc,
-                            const vtkm::Bounds& mapBounds)
+                            const vtkm::Bounds& mapBounds,
+                            const vtkm::Float32& maxOpacity)
     : StepSize(stepSize)
     , MinScalar(minScalar)
     , MaxDensity(maxDensity)
-    , LightLoc(lightLoc)
     , MapBounds(mapBounds)
+    , MaxOpacity(maxOpacity)
   {
     if ((maxScalar - minScalar) != 0.0f)
     {
@@ -286,161 +434,697 @@ struct TransmittanceMapGenerator : public vtkm::worklet::WorkletMapField
                             const ColorMapType& colorMap,
                             vtkm::Float32& opacity) const
   {
-    const vtkm::Id colorMapSize = colorMap.GetNumberOfValues() - 1;
-    vtkm::Id cellId = -1;
-
     vtkm::Float32 tMin, tMax;
     bool hits = beams::Intersections::SegmentAABB(rayOrigin, rayDest, this->MapBounds, tMin, tMax);
-    (void)hits;
+    if (!hits)
+    {
+      return;
+    }
 
-    auto start = rayOrigin + tMin * rayDir;
-    auto sampleLocation = start;
-    vtkm::Float32 lengthSquared = (tMax - tMin) * (tMax - tMin);
-    while (vtkm::MagnitudeSquared(sampleLocation - start) <= lengthSquared)
+    const vtkm::Vec3f_32 start = rayOrigin + tMin * rayDir;
+    const vtkm::Vec3f_32 end = rayOrigin + tMax * rayDir;
+    opacity = TraverseCells(oracle,
+                            scalars,
+                            colorMap,
+                            start,
+                            end,
+                            StepSize,
+                            MinScalar,
+                            InverseDeltaScalar,
+                            MaxDensity,
+                            opacity,
+                            MaxOpacity);
+  }
+
+  const vtkm::Float32 StepSize;
+  vtkm::Float32 MinScalar;
+  vtkm::Float32 InverseDeltaScalar;
+  vtkm::Float32 MaxDensity;
+  vtkm::Bounds MapBounds;
+  vtkm::Float32 MaxOpacity;
+};
+
+struct TransmittanceMapComposer : public vtkm::worklet::WorkletMapField
+{
+  using ControlSignature = void(FieldIn localOpacities, FieldInOut opacities);
+  using ExecutionSignature = void(_1, _2);
+
+  VTKM_EXEC void operator()(const vtkm::Float32& localOpacity, vtkm::Float32& opacity) const
+  {
+    opacity = 1.0f - (1.0f - localOpacity) * (1.0f - opacity);
+  }
+};
+
+// The index of vertex ijk of a map with pointDims vertices along each axis
+VTKM_EXEC inline vtkm::Id GetMapPointIndex(const vtkm::Id3& ijk, const vtkm::Id3& pointDims)
+{
+  return (ijk[2] * pointDims[1] + ijk[1]) * pointDims[0] + ijk[0];
+}
+
+VTKM_EXEC inline vtkm::Vec3f_32 GetMapPoint(const vtkm::Id3& ijk,
+                                            const vtkm::Vec3f_32& origin,
+                                            const vtkm::Vec3f_32& spacing)
+{
+  vtkm::Vec3f_32 point;
+  for (vtkm::IdComponent k = 0; k < 3; ++k)
+  {
+    point[k] = origin[k] + static_cast<vtkm::Float32>(ijk[k]) * spacing[k];
+  }
+  return point;
+}
+
+// From point back towards the homogeneous light, all the way to it for a point light
+VTKM_EXEC inline vtkm::Vec3f_32 GetToLight(const vtkm::Vec4f_32& light, const vtkm::Vec3f_32& point)
+{
+  return vtkm::Vec3f_32{ light[0], light[1], light[2] } - point * light[3];
+}
+
+//
+// Generates the map one slice of vertices at a time, in order of distance from the light along
+// the sweep axis. The light ray of a vertex crosses the previous slice on its way, so its opacity
+// is the one interpolated there composed with the short segment from there to the vertex. The
+// vertices whose ray enters the block before reaching the previous slice, and those of the first
+// slice, march from where their ray enters the block onto the opacity they already have.
+//
+// The light is homogeneous like for the face images. The rays of a directional light are all
+// parallel, so every vertex but those of the first slice and the side faces reads the previous
+// slice.
+//
+struct TransmittanceMapSweeper : public vtkm::worklet::WorkletMapField
+{
+  VTKM_CONT
+  TransmittanceMapSweeper(const vtkm::Float32& stepSize,
+                          const vtkm::Float32& minScalar,
+                          const vtkm::Float32& maxScalar,
+                          const vtkm::Float32& maxDensity,
+                          const vtkm::Vec4f_32& light,
+                          const vtkm::Bounds& mapBounds,
+                          const vtkm::Vec3f_32& origin,
+                          const vtkm::Vec3f_32& spacing,
+                          const vtkm::Id3& pointDims,
+                          vtkm::IdComponent axis,
+                          vtkm::Id slice,
+                          vtkm::Id previousSlice,
+                          vtkm::Float32 maxOpacity)
+    : StepSize(stepSize)
+    , MinScalar(minScalar)
+    , MaxDensity(maxDensity)
+    , Light(light)
+    , MapBounds(mapBounds)
+    , Origin(origin)
+    , Spacing(spacing)
+    , PointDims(pointDims)
+    , Axis(axis)
+    , Slice(slice)
+    , PreviousSlice(previousSlice)
+    , MaxOpacity(maxOpacity)
+  {
+    if ((maxScalar - minScalar) != 0.0f)
     {
-      sampleLocation += StepSize * rayDir;
+      InverseDeltaScalar = 1.0f / (maxScalar - minScalar);
+    }
+    else
+    {
+      InverseDeltaScalar = minScalar;
+    }
+  }
 
-      vtkm::Vec<vtkm::Float32, 3> pcoords;
-      oracle.FindCell(sampleLocation, cellId, pcoords);
-      if (cellId == -1)
+  using ControlSignature = void(FieldIn sliceIds,
+                                ExecObject meshOracle,
+                                WholeArrayIn scalars,
+                                WholeArrayIn colorMap,
+                                WholeArrayInOut opacities);
+  using ExecutionSignature = void(_1, _2, _3, _4, _5);
+
+  // Interpolates the previous slice where the light ray towards point crosses it. False when the
+  // ray leaves the map before that.
+  template <typename OpacityPortalType>
+  VTKM_EXEC bool InterpolatePreviousSlice(const OpacityPortalType& opacities,
+                                          const vtkm::Vec3f_32& point,
+                                          vtkm::Vec3f_32& crossing,
+                                          vtkm::Float32& opacity) const
+  {
+    const vtkm::IdComponent a = this->Axis;
+    const vtkm::Float32 sliceCoord =
+      this->Origin[a] + static_cast<vtkm::Float32>(this->PreviousSlice) * this->Spacing[a];
+    const vtkm::Vec3f_32 toLight = GetToLight(this->Light, point);
+    const vtkm::Float32 t = (sliceCoord - point[a]) / toLight[a];
+    crossing = point + t * toLight;
+    crossing[a] = sliceCoord;
+
+    vtkm::Id3 cell;
+    vtkm::Vec3f_32 weights;
+    cell[a] = this->PreviousSlice;
+    weights[a] = 0.0f;
+    for (vtkm::IdComponent k = 1; k < 3; ++k)
+    {
+      const vtkm::IdComponent b = (a + k) % 3;
+      const vtkm::Id numCells = this->PointDims[b] - 1;
+      const vtkm::Float32 u = (crossing[b] - this->Origin[b]) / this->Spacing[b];
+      const vtkm::Float32 eps = 1e-4f;
+      if (u < -eps || u > static_cast<vtkm::Float32>(numCells) + eps)
       {
-        break;
+        return false;
       }
-      vtkm::Id cellIndices[8];
-      vtkm::Vec<vtkm::Float32, 8> values;
-      vtkm::Float32 scalar = 0.f;
+      cell[b] = vtkm::Max(vtkm::Id(0), vtkm::Min(numCells - 1, static_cast<vtkm::Id>(u)));
+      weights[b] = vtkm::Max(0.0f, vtkm::Min(1.0f, u - static_cast<vtkm::Float32>(cell[b])));
+    }
 
-      const vtkm::Int32 numIndices = oracle.GetCellIndices(cellIndices, cellId);
-      for (vtkm::Int32 i = 0; i < numIndices; ++i)
+    const vtkm::IdComponent b = (a + 1) % 3;
+    const vtkm::IdComponent c = (a + 2) % 3;
+    vtkm::Float32 corners[2][2];
+    for (vtkm::Id j = 0; j < 2; ++j)
+    {
+      for (vtkm::Id i = 0; i < 2; ++i)
       {
-        vtkm::Id j = cellIndices[i];
-        j = (j >= scalars.GetNumberOfValues()) ? (scalars.GetNumberOfValues() - 1) : j;
-        values[i] = static_cast<vtkm::Float32>(scalars.Get(j));
+        vtkm::Id3 ijk = cell;
+        ijk[b] += i;
+        ijk[c] += j;
+        corners[j][i] = opacities.Get(GetMapPointIndex(ijk, this->PointDims));
       }
+    }
+    opacity = vtkm::Lerp(vtkm::Lerp(corners[0][0], corners[0][1], weights[b]),
+                         vtkm::Lerp(corners[1][0], corners[1][1], weights[b]),
+                         weights[c]);
+    return true;
+  }
 
-      scalar = oracle.Interpolate(values, pcoords);
-      scalar = (scalar - MinScalar) * InverseDeltaScalar;
-      vtkm::Id colorIndex =
-        static_cast<vtkm::Id>(scalar * static_cast<vtkm::Float32>(colorMapSize));
-      constexpr vtkm::Id zero = 0;
-      colorIndex = vtkm::Max(zero, vtkm::Min(colorMapSize, colorIndex));
-      vtkm::Vec<vtkm::Float32, 4> sampleColor = colorMap.Get(colorIndex);
-
-      vtkm::Float32 localOpacity = sampleColor[3] / MaxDensity;
-      opacity = opacity + (1.0f - opacity) * localOpacity;
+  template <typename OracleType,
+            typename ScalarPortalType,
+            typename ColorMapType,
+            typename OpacityPortalType>
+  VTKM_EXEC void operator()(const vtkm::Id& sliceId,
+                            const OracleType& oracle,
+                            const ScalarPortalType& scalars,
+                            const ColorMapType& colorMap,
+                            OpacityPortalType& opacities) const
+  {
+    const vtkm::IdComponent a = this->Axis;
+    const vtkm::IdComponent b = (a + 1) % 3;
+    const vtkm::IdComponent c = (a + 2) % 3;
+    vtkm::Id3 ijk;
+    ijk[a] = this->Slice;
+    ijk[b] = sliceId % this->PointDims[b];
+    ijk[c] = sliceId / this->PointDims[b];
+    const vtkm::Id pointIndex = GetMapPointIndex(ijk, this->PointDims);
+    const vtkm::Vec3f_32 point = GetMapPoint(ijk, this->Origin, this->Spacing);
+
+    vtkm::Vec3f_32 start;
+    vtkm::Float32 opacity;
+    if (this->PreviousSlice < 0 ||
+        !this->InterpolatePreviousSlice(opacities, point, start, opacity))
+    {
+      // A directional light starts its segment a diagonal of the map away, outside of it
+      vtkm::Vec3f_32 from = point + GetToLight(this->Light, point);
+      if (this->Light[3] == 0.0f)
+      {
+        const vtkm::Vec3f_64 diagonal{ this->MapBounds.X.Length(),
+                                       this->MapBounds.Y.Length(),
+                                       this->MapBounds.Z.Length() };
+        const vtkm::Float32 reach = static_cast<vtkm::Float32>(vtkm::Magnitude(diagonal));
+        from = point + reach * vtkm::Normal(GetToLight(this->Light, point));
+      }
+      vtkm::Float32 tMin, tMax;
+      beams::Intersections::SegmentAABB(from, point, this->MapBounds, tMin, tMax);
+      start = from + tMin * vtkm::Normal(point - from);
+      opacity = opacities.Get(pointIndex);
     }
+    opacities.Set(pointIndex,
+                  TraverseCells(oracle,
+                                scalars,
+                                colorMap,
+                                start,
+                                point,
+                                this->StepSize,
+                                this->MinScalar,
+                                this->InverseDeltaScalar,
+                                this->MaxDensity,
+                                opacity,
+                                this->MaxOpacity));
   }
 
   const vtkm::Float32 StepSize;
   vtkm::Float32 MinScalar;
   vtkm::Float32 InverseDeltaScalar;
   vtkm::Float32 MaxDensity;
-  vtkm::Vec3f LightLoc;
+  vtkm::Vec4f_32 Light;
   vtkm::Bounds MapBounds;
+  vtkm::Vec3f_32 Origin;
+  vtkm::Vec3f_32 Spacing;
+  vtkm::Id3 PointDims;
+  vtkm::IdComponent Axis;
+  vtkm::Id Slice;
+  vtkm::Id PreviousSlice;
+  vtkm::Float32 MaxOpacity;
 };
 
+//
+// Decides which light rays of the previous local map have to be marched again now that the lights
+// moved. rayLights holds the homogeneous light every ray was last marched for. A ray is marched
+// again when its path through the block moved by more than a map cell since, or when the opacity
+// differences to its neighbors in the previous map, which are large along the shadow edges, could
+// have changed its opacity by more than tolerance over the move. The others keep their opacity,
+// the marched ones start from zero.
+//
+struct MovedRayFinder : public vtkm::worklet::WorkletMapField
+{
+  VTKM_CONT
+  MovedRayFinder(const vtkm::Vec3f_32& origin,
+                 const vtkm::Vec3f_32& spacing,
+                 const vtkm::Id3& pointDims,
+                 vtkm::Float32 reach,
+                 vtkm::Float32 tolerance)
+    : Origin(origin)
+    , Spacing(spacing)
+    , PointDims(pointDims)
+    , Reach(reach)
+    , Tolerance(tolerance)
+  {
+    this->MinSpacing = vtkm::Min(spacing[0], vtkm::Min(spacing[1], spacing[2]));
+  }
+
+  using ControlSignature = void(FieldIn rayIds,
+                                WholeArrayIn lights,
+                                WholeArrayIn previousOpacities,
+                                FieldInOut rayLights,
+                                FieldOut needsMarch,
+                                FieldOut opacities);
+  using ExecutionSignature = void(_1, _2, _3, _4, _5, _6);
+
+  template <typename LightPortalType, typename OpacityPortalType>
+  VTKM_EXEC void operator()(const vtkm::Id& rayId,
+                            const LightPortalType& lights,
+                            const OpacityPortalType& previousOpacities,
+                            vtkm::Vec4f_32& rayLight,
+                            vtkm::UInt8& needsMarch,
+                            vtkm::Float32& opacity) const
+  {
+    const vtkm::Id numVertices = this->PointDims[0] * this->PointDims[1] * this->PointDims[2];
+    const vtkm::Id vertex = rayId % numVertices;
+    const vtkm::Id offset = rayId - vertex;
+    const vtkm::Vec4f_32 light = lights.Get(rayId / numVertices);
+    vtkm::Id3 ijk;
+    ijk[0] = vertex % this->PointDims[0];
+    ijk[1] = (vertex / this->PointDims[0]) % this->PointDims[1];
+    ijk[2] = vertex / (this->PointDims[0] * this->PointDims[1]);
+    const vtkm::Vec3f_32 point = GetMapPoint(ijk, this->Origin, this->Spacing);
+
+    // The path is no longer than the diagonal of the block, nor than the way to a point light.
+    // A vertex on the light gives NaN, and is marched like any other that can not be compared.
+    const vtkm::Vec3f_32 toLight = GetToLight(light, point);
+    const vtkm::Vec3f_32 toRayLight = GetToLight(rayLight, point);
+    vtkm::Float32 length = this->Reach;
+    if (light[3] != 0.0f)
+    {
+      length = vtkm::Min(length, vtkm::Magnitude(toLight));
+    }
+    const vtkm::Float32 sinAngle =
+      vtkm::Magnitude(vtkm::Cross(vtkm::Normal(toLight), vtkm::Normal(toRayLight)));
+    const vtkm::Float32 moved = length * sinAngle / this->MinSpacing;
+
+    const vtkm::Float32 previous = previousOpacities.Get(rayId);
+    vtkm::Float32 maxDelta = 0.0f;
+    for (vtkm::IdComponent a = 0; a < 3; ++a)
+    {
+      for (vtkm::Id side = -1; side <= 1; side += 2)
+      {
+        vtkm::Id3 neighbor = ijk;
+        neighbor[a] += side;
+        if (neighbor[a] >= 0 && neighbor[a] < this->PointDims[a])
+        {
+          const vtkm::Float32 other =
+            previousOpacities.Get(offset + GetMapPointIndex(neighbor, this->PointDims));
+          maxDelta = vtkm::Max(maxDelta, vtkm::Abs(other - previous));
+        }
+      }
+    }
+
+    const bool isStale = light[3] != rayLight[3] || !(moved <= 1.0f) ||
+      moved * maxDelta > this->Tolerance;
+    needsMarch = isStale ? 1 : 0;
+    opacity = isStale ? 0.0f : previous;
+    if (isStale)
+    {
+      rayLight = light;
+    }
+  }
+
+  vtkm::Vec3f_32 Origin;
+  vtkm::Vec3f_32 Spacing;
+  vtkm::Id3 PointDims;
+  vtkm::Float32 Reach;
+  vtkm::Float32 Tolerance;
+  vtkm::Float32 MinSpacing;
+};
+
+// Flags the map cells a data cell overlaps when the color map makes some of the scalars between
+// its corners visible, or its own scalar for a cell field. Phase 4 only shades visible samples, so
+// only the vertices of flagged map cells are ever read back.
+struct ShadedMapCellMarker : public vtkm::worklet::WorkletMapField
+{
+  using ControlSignature = void(FieldIn cellIds,
+                                ExecObject meshOracle,
+                                WholeArrayIn scalars,
+                                WholeArrayIn visibleColors,
+                                WholeArrayOut shadedMapCells);
+  using ExecutionSignature = void(_1, _2, _3, _4, _5);
+
+  VTKM_CONT
+  ShadedMapCellMarker(const vtkm::Float32& minScalar,
+                      const vtkm::Float32& maxScalar,
+                      const vtkm::Vec3f_32& mapOrigin,
+                      const vtkm::Vec3f_32& mapSpacing,
+                      const vtkm::Id3& mapDims,
+                      bool isCellField)
+    : MinScalar(minScalar)
+    , MapOrigin(mapOrigin)
+    , MapSpacing(mapSpacing)
+    , MapDims(mapDims)
+    , IsCellField(isCellField)
+  {
+    if ((maxScalar - minScalar) != 0.0f)
+    {
+      InverseDeltaScalar = 1.0f / (maxScalar - minScalar);
+    }
+    else
+    {
+      InverseDeltaScalar = minScalar;
+    }
+  }
+
+  template <typename OracleType,
+            typename ScalarPortalType,
+            typename VisiblePortalType,
+            typename ShadedPortalType>
+  VTKM_EXEC void operator()(const vtkm::Id& cellId,
+                            const OracleType& oracle,
+                            const ScalarPortalType& scalars,
+                            const VisiblePortalType& visibleColors,
+                            ShadedPortalType& shadedMapCells) const
+  {
+    // Trilinear interpolation stays between the smallest and the largest corner scalar. A cell
+    // field has a single scalar for the whole cell.
+    vtkm::Id cellIndices[8];
+    vtkm::Int32 numIndices = 1;
+    cellIndices[0] = cellId;
+    if (!this->IsCellField)
+    {
+      numIndices = oracle.GetCellIndices(cellIndices, cellId);
+    }
+    vtkm::Float32 minValue = vtkm::Infinity32();
+    vtkm::Float32 maxValue = vtkm::NegativeInfinity32();
+    for (vtkm::Int32 i = 0; i < numIndices; ++i)
+    {
+      vtkm::Id j = cellIndices[i];
+      j = (j >= scalars.GetNumberOfValues()) ? (scalars.GetNumberOfValues() - 1) : j;
+      const vtkm::Float32 value = static_cast<vtkm::Float32>(scalars.Get(j));
+      minValue = vtkm::Min(minValue, value);
+      maxValue = vtkm::Max(maxValue, value);
+    }
+    const vtkm::Id minIndex = this->GetColorIndex(minValue, visibleColors.GetNumberOfValues() - 2);
+    const vtkm::Id maxIndex = this->GetColorIndex(maxValue, visibleColors.GetNumberOfValues() - 2);
+    if (visibleColors.Get(maxIndex + 1) == visibleColors.Get(minIndex))
+    {
+      return;
+    }
+
+    const vtkm::Id3 cellDims = oracle.GetCellDims();
+    const vtkm::Id3 cell{ cellId % cellDims[0],
+                          (cellId / cellDims[0]) % cellDims[1],
+                          cellId / (cellDims[0] * cellDims[1]) };
+    vtkm::Id3 first;
+    vtkm::Id3 last;
+    for (vtkm::Int32 d = 0; d < 3; ++d)
+    {
+      first[d] = this->GetMapCell(d, oracle.GetPlane(d, cell[d]));
+      last[d] = this->GetMapCell(d, oracle.GetPlane(d, cell[d] + 1));
+    }
+    for (vtkm::Id k = first[2]; k <= last[2]; ++k)
+    {
+      for (vtkm::Id j = first[1]; j <= last[1]; ++j)
+      {
+        for (vtkm::Id i = first[0]; i <= last[0]; ++i)
+        {
+          shadedMapCells.Set((k * this->MapDims[1] + j) * this->MapDims[0] + i, vtkm::UInt8(1));
+        }
+      }
+    }
+  }
+
+  VTKM_EXEC vtkm::Id GetColorIndex(vtkm::Float32 value, vtkm::Id colorMapSize) const
+  {
+    const vtkm::Float32 scalar = (value - this->MinScalar) * this->InverseDeltaScalar;
+    const vtkm::Id colorIndex =
+      static_cast<vtkm::Id>(scalar * static_cast<vtkm::Float32>(colorMapSize));
+    constexpr vtkm::Id zero = 0;
+    return vtkm::Max(zero, vtkm::Min(colorMapSize, colorIndex));
+  }
+
+  VTKM_EXEC vtkm::Id GetMapCell(vtkm::Int32 dim, vtkm::Float32 coordinate) const
+  {
+    const vtkm::Float32 index = (coordinate - this->MapOrigin[dim]) / this->MapSpacing[dim];
+    constexpr vtkm::Id zero = 0;
+    return vtkm::Max(zero,
+                     vtkm::Min(this->MapDims[dim] - 1, static_cast<vtkm::Id>(vtkm::Floor(index))));
+  }
+
+  vtkm::Float32 MinScalar;
+  vtkm::Float32 InverseDeltaScalar;
+  vtkm::Vec3f_32 MapOrigin;
+  vtkm::Vec3f_32 MapSpacing;
+  vtkm::Id3 MapDims;
+  bool IsCellField;
+};
+
+// A vertex needs the opacities of the other blocks unless the local march already saturated it,
+// or none of the map cells around it is ever shaded
+struct RemoteVertexFinder : public vtkm::worklet::WorkletMapField
+{
+  using ControlSignature = void(FieldIn localOpacities,
+                                WholeArrayIn shadedMapCells,
+                                FieldOut needsRemote);
+  using ExecutionSignature = void(InputIndex, _1, _2, _3);
+
+  VTKM_CONT
+  RemoteVertexFinder(const vtkm::Id3& mapDims, vtkm::Float32 maxOpacity)
+    : MapDims(mapDims)
+    , MaxOpacity(maxOpacity)
+  {
+  }
+
+  template <typename ShadedPortalType>
+  VTKM_EXEC void operator()(vtkm::Id rayId,
+                            const vtkm::Float32& localOpacity,
+                            const ShadedPortalType& shadedMapCells,
+                            vtkm::UInt8& needsRemote) const
+  {
+    needsRemote = 0;
+    if (localOpacity >= this->MaxOpacity)
+    {
+      return;
+    }
+
+    // The maps of the lights come one after the other over the same vertices
+    const vtkm::Id3 pdims{ this->MapDims + vtkm::Id3{ 1, 1, 1 } };
+    const vtkm::Id3 vertex{ rayId % pdims[0],
+                            (rayId / pdims[0]) % pdims[1],
+                            (rayId / (pdims[0] * pdims[1])) % pdims[2] };
+    vtkm::Id3 first;
+    vtkm::Id3 last;
+    for (vtkm::Int32 d = 0; d < 3; ++d)
+    {
+      first[d] = vtkm::Max(vtkm::Id(0), vertex[d] - 1);
+      last[d] = vtkm::Min(this->MapDims[d] - 1, vertex[d]);
+    }
+    for (vtkm::Id k = first[2]; k <= last[2]; ++k)
+    {
+      for (vtkm::Id j = first[1]; j <= last[1]; ++j)
+      {
+        for (vtkm::Id i = first[0]; i <= last[0]; ++i)
+        {
+          if (shadedMapCells.Get((k * this->MapDims[1] + j) * this->MapDims[0] + i) != 0)
+          {
+            needsRemote = 1;
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  vtkm::Id3 MapDims;
+  vtkm::Float32 MaxOpacity;
+};
+
+// Where the light ray towards samplePoint leaves a block. Every worklet listing hits goes through
+// here, so ranks tracing the same ray always agree on its hits.
+template <typename BoundsMapExec>
+VTKM_EXEC bool FindBlockHit(const BoundsMapExec& boundsMap,
+                            vtkm::Id block,
+                            const vtkm::Vec3f& lightLoc,
+                            const vtkm::Vec3f& samplePoint,
+                            bool useGlancingHits,
+                            vtkm::Float32& rayT,
+                            vtkm::Vec3f& point)
+{
+  vtkm::Vec3f dir = samplePoint - lightLoc;
+  vtkm::Normalize(dir);
+
+  vtkm::Float32 tMin, tMax;
+  bool hitsBlock =
+    boundsMap.FindSegmentBlockIntersections(block, lightLoc, samplePoint, tMin, tMax);
+  if (!hitsBlock)
+    return false;
+
+  if ((!useGlancingHits) && beams::Intersections::ApproxEquals(tMin, tMax))
+    return false;
+
+  rayT = tMax;
+  point = lightLoc + dir * tMax;
+  return true;
+}
+
 struct CountNonLocalBlockHits : public vtkm::worklet::WorkletMapField
 {
-  using ControlSignature = void(FieldIn samplePoints, ExecObject boundMap, FieldOut numBlocks);
-  using ExecutionSignature = void(_1, _2, _3);
+  using ControlSignature = void(FieldIn lightLocations,
+                                FieldIn samplePoints,
+                                FieldIn needsRemote,
+                                ExecObject boundMap,
+                                WholeArrayIn transparentBlocks,
+                                FieldOut numBlocks);
+  using ExecutionSignature = void(_1, _2, _3, _4, _5, _6);
 
   VTKM_CONT
   CountNonLocalBlockHits(const vtkm::Id& selfBlockId,
-                         const vtkm::Vec3f& lightLoc,
+                         const vtkm::Id& numBlocks,
                          bool useGlancingHits)
     : SelfBlockId(selfBlockId)
-    , LightLocation(lightLoc)
+    , NumBlocks(numBlocks)
     , UseGlancingHits(useGlancingHits)
   {
   }
-  template <typename BoundsMapExec>
-  VTKM_EXEC void operator()(const vtkm::Vec3f& samplePoint,
+  template <typename BoundsMapExec, typename TransparentPortal>
+  VTKM_EXEC void operator()(const vtkm::Vec3f& lightLocation,
+                            const vtkm::Vec3f& samplePoint,
+                            const vtkm::UInt8& needsRemote,
                             const BoundsMapExec& boundsMap,
+                            const TransparentPortal& transparentBlocks,
                             vtkm::Id& numBlocks) const
   {
-    vtkm::Vec3f origin = this->LightLocation;
-    numBlocks = boundsMap.FindNumSegmentBlockIntersections(
-      origin, samplePoint, this->UseGlancingHits, this->SelfBlockId);
+    numBlocks = 0;
+    if (needsRemote == 0)
+      return;
+
+    for (vtkm::Id block = 0; block < this->NumBlocks; block++)
+    {
+      if (block == this->SelfBlockId || transparentBlocks.Get(block) != 0)
+        continue;
+
+      vtkm::Float32 rayT;
+      vtkm::Vec3f point;
+      if (FindBlockHit(
+            boundsMap, block, lightLocation, samplePoint, this->UseGlancingHits, rayT, point))
+        numBlocks++;
+    }
   }
 
   vtkm::Id SelfBlockId;
-  vtkm::Vec3f LightLocation;
+  vtkm::Id NumBlocks;
   bool UseGlancingHits;
 };
 
-struct HitSort
+// The sort key of a hit: the ray id in the high word and the bits of RayT in the low one, flipped
+// so that they order like the float they hold. Sorting the keys orders the hits by ray, then by
+// distance from the light.
+struct HitSortKey : public vtkm::worklet::WorkletMapField
 {
-  VTKM_EXEC_CONT bool operator()(const TransmittanceRayBlockHit& h1,
-                                 const TransmittanceRayBlockHit& h2) const
+  using ControlSignature = void(FieldIn hits, FieldOut keys);
+  using ExecutionSignature = void(_1, _2);
+
+  VTKM_EXEC void operator()(const TransmittanceRayBlockHit& hit, vtkm::UInt64& key) const
   {
-    if (h1.RayId == h2.RayId)
-    {
-      return h1.RayT < h2.RayT;
-    }
-    else
+    union
     {
-      return h1.RayId < h2.RayId;
-    }
+      vtkm::Float32 Value;
+      vtkm::UInt32 Bits;
+    } rayT;
+    rayT.Value = hit.RayT;
+    const vtkm::UInt32 signBit = 0x80000000u;
+    const vtkm::UInt32 bits = (rayT.Bits & signBit) ? ~rayT.Bits : (rayT.Bits | signBit);
+    key = (static_cast<vtkm::UInt64>(static_cast<vtkm::UInt32>(hit.RayId)) << 32) | bits;
   }
 };
 
+// Sorts the keys of the hits with the indices as payload, and moves the hits themselves once
+template <typename Device>
+void SortHits(vtkm::cont::ArrayHandle<TransmittanceRayBlockHit>& hits)
+{
+  vtkm::cont::Invoker invoker{ Device() };
+  vtkm::cont::ArrayHandle<vtkm::UInt64> keys;
+  invoker(HitSortKey{}, hits, keys);
+  vtkm::cont::ArrayHandle<vtkm::Id> order;
+  vtkm::cont::Algorithm::Copy(vtkm::cont::ArrayHandleIndex(hits.GetNumberOfValues()), order);
+  vtkm::cont::Algorithm::SortByKey(keys, order);
+
+  vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> sortedHits;
+  vtkm::cont::Algorithm::Copy(vtkm::cont::make_ArrayHandlePermutation(order, hits), sortedHits);
+  hits = sortedHits;
+}
+
 struct CalculateNonLocalBlockHits : public vtkm::worklet::WorkletMapField
 {
-  using ControlSignature = void(FieldIn samplePoints,
+  using ControlSignature = void(FieldIn lightLocations,
+                                FieldIn samplePoints,
+                                FieldIn needsRemote,
                                 ExecObject boundMap,
+                                WholeArrayIn transparentBlocks,
                                 FieldIn hitOffsets,
                                 WholeArrayInOut hits);
-  using ExecutionSignature = void(InputIndex, _1 samplePoint, _2 boundsMap, _3 hitOffset, _4 hits);
+  using ExecutionSignature = void(InputIndex, _1, _2, _3, _4, _5, _6, _7);
 
   VTKM_CONT
   CalculateNonLocalBlockHits(const vtkm::Id& selfBlockId,
                              const vtkm::Id& numBlocks,
-                             const vtkm::Vec3f& lightLoc,
                              bool useGlancingHits)
     : SelfBlockId(selfBlockId)
     , NumBlocks(numBlocks)
-    , LightLoc(lightLoc)
     , UseGlancingHits(useGlancingHits)
   {
   }
 
-  template <typename BoundsMapExec, typename HitsPortal>
+  template <typename BoundsMapExec, typename TransparentPortal, typename HitsPortal>
   VTKM_EXEC void operator()(vtkm::Id inputIndex,
+                            const vtkm::Vec3f& lightLocation,
                             const vtkm::Vec3f& samplePoint,
+                            const vtkm::UInt8& needsRemote,
                             const BoundsMapExec& boundsMap,
+                            const TransparentPortal& transparentBlocks,
                             const vtkm::Id& offset,
                             HitsPortal& hits) const
   {
-    vtkm::Id rayId = inputIndex;
-    vtkm::Vec3f origin = LightLoc;
-    vtkm::Vec3f dir = samplePoint - origin;
-    vtkm::Normalize(dir);
-
-    vtkm::Float32 tMin, tMax;
-
-    boundsMap.FindSegmentBlockIntersections(this->SelfBlockId, origin, samplePoint, tMin, tMax);
+    if (needsRemote == 0)
+      return;
 
+    vtkm::Id rayId = inputIndex;
     vtkm::Id hitOffset = offset;
     for (vtkm::Id block = 0; block < this->NumBlocks; block++)
     {
-      if (block == this->SelfBlockId)
+      if (block == this->SelfBlockId || transparentBlocks.Get(block) != 0)
         continue;
 
-      bool hitsBlock = boundsMap.FindSegmentBlockIntersections(
-        block, origin, samplePoint, tMin, tMax, this->SelfBlockId);
-
+      vtkm::Float32 rayT;
+      vtkm::Vec3f point;
+      bool hitsBlock = FindBlockHit(
+        boundsMap, block, lightLocation, samplePoint, this->UseGlancingHits, rayT, point);
       if (!hitsBlock)
         continue;
 
-      if ((!this->UseGlancingHits) && beams::Intersections::ApproxEquals(tMin, tMax))
-        continue;
-
       TransmittanceRayBlockHit hit;
       hit.RayId = rayId;
       hit.BlockId = block;
       hit.FromBlockId = this->SelfBlockId;
-      hit.RayT = tMax;
-      hit.Point = origin + dir * tMax;
+      hit.RayT = rayT;
+      hit.Point = point;
       hits.Set(hitOffset, hit);
       hitOffset++;
     }
@@ -448,6 +1132,51 @@ struct CalculateNonLocalBlockHits : public vtkm::worklet::WorkletMapField
 
   vtkm::Id SelfBlockId;
   vtkm::Id NumBlocks;
+  bool UseGlancingHits;
+};
+
+// The hits the map vertices of another block make on one block, one per vertex
+struct CalculateBlockHits : public vtkm::worklet::WorkletMapField
+{
+  using ControlSignature = void(FieldIn samplePoints,
+                                ExecObject boundMap,
+                                FieldOut hitsBlock,
+                                FieldOut hits);
+  using ExecutionSignature = void(InputIndex, _1, _2, _3, _4);
+
+  VTKM_CONT
+  CalculateBlockHits(const vtkm::Id& blockId,
+                     const vtkm::Id& fromBlockId,
+                     const vtkm::Vec3f& lightLoc,
+                     bool useGlancingHits)
+    : BlockId(blockId)
+    , FromBlockId(fromBlockId)
+    , LightLoc(lightLoc)
+    , UseGlancingHits(useGlancingHits)
+  {
+  }
+
+  template <typename BoundsMapExec>
+  VTKM_EXEC void operator()(vtkm::Id inputIndex,
+                            const vtkm::Vec3f& samplePoint,
+                            const BoundsMapExec& boundsMap,
+                            vtkm::UInt8& hitsBlock,
+                            TransmittanceRayBlockHit& hit) const
+  {
+    vtkm::Float32 rayT = 0.0f;
+    vtkm::Vec3f point = samplePoint;
+    hitsBlock = FindBlockHit(
+      boundsMap, this->BlockId, this->LightLoc, samplePoint, this->UseGlancingHits, rayT, point);
+    hit.RayId = static_cast<int>(inputIndex);
+    hit.BlockId = static_cast<int>(this->BlockId);
+    hit.FromBlockId = static_cast<int>(this->FromBlockId);
+    hit.RayT = rayT;
+    hit.Point = point;
+    hit.Opacity = 0.0f;
+  }
+
+  vtkm::Id BlockId;
+  vtkm::Id FromBlockId;
   vtkm::Vec3f LightLoc;
   bool UseGlancingHits;
 };
@@ -484,6 +1213,31 @@ public:
   bool GlancingHits;
 };
 
+// The opacity every vertex collects in front of the block, composed from the answered hits of
+// its light ray. The hits of a ray are contiguous and ordered by RayT.
+struct RemoteOpacityAccumulator : public vtkm::worklet::WorkletMapField
+{
+  using ControlSignature = void(FieldIn hitCounts,
+                                FieldIn hitOffsets,
+                                WholeArrayIn hits,
+                                FieldOut opacities);
+  using ExecutionSignature = void(_1, _2, _3, _4);
+
+  template <typename HitsPortal>
+  VTKM_EXEC void operator()(const vtkm::Id& hitCount,
+                            const vtkm::Id& hitOffset,
+                            const HitsPortal& hits,
+                            vtkm::Float32& opacity) const
+  {
+    opacity = 0.0f;
+    for (vtkm::Id i = 0; i < hitCount; ++i)
+    {
+      const vtkm::Float32 localOpacity = hits.Get(hitOffset + i).Opacity;
+      opacity = opacity + (1.0f - opacity) * localOpacity;
+    }
+  }
+};
+
 template <typename ShadowMapEstimatorType>
 struct TransmittanceFetcher2 : public vtkm::worklet::WorkletMapField
 {
@@ -504,7 +1258,8 @@ public:
 
   VTKM_EXEC void operator()(TransmittanceRayBlockHit& pullHit) const
   {
-    pullHit.Opacity = this->ShadowMapEstimator.GetEstimateUsingVerticesT(pullHit.Point);
+    pullHit.Opacity = this->ShadowMapEstimator.GetEstimateUsingVerticesT(
+      pullHit.Point, this->ShadowMapEstimator.GetRayLight(pullHit.RayId));
   }
 
   int SelfBlockId;
@@ -524,6 +1279,39 @@ vtkm::Float32 GetMaxAlpha(const vtkm::cont::ArrayHandle<vtkm::Vec<vtkm::Float32,
   return maxAlpha;
 }
 
+// The largest alpha the color map reaches for scalars in blockRange, using the same lookup as
+// TransmittanceMapGenerator. A block for which this is 0 cannot attenuate any light.
+vtkm::Float32 GetMaxAlphaInRange(
+  const vtkm::cont::ArrayHandle<vtkm::Vec<vtkm::Float32, 4>>& colorMap,
+  const vtkm::Range& scalarRange,
+  const vtkm::Range& blockRange)
+{
+  const vtkm::Id colorMapSize = colorMap.GetNumberOfValues() - 1;
+  const vtkm::Float32 minScalar = vtkm::Float32(scalarRange.Min);
+  const vtkm::Float32 deltaScalar = vtkm::Float32(scalarRange.Max - scalarRange.Min);
+  const vtkm::Float32 inverseDeltaScalar = deltaScalar != 0.0f ? 1.0f / deltaScalar : minScalar;
+  auto toColorIndex = [&](vtkm::Float64 value) {
+    vtkm::Float32 scalar = (vtkm::Float32(value) - minScalar) * inverseDeltaScalar;
+    vtkm::Id colorIndex = static_cast<vtkm::Id>(scalar * static_cast<vtkm::Float32>(colorMapSize));
+    constexpr vtkm::Id zero = 0;
+    return vtkm::Max(zero, vtkm::Min(colorMapSize, colorIndex));
+  };
+  vtkm::Id minIndex = toColorIndex(blockRange.Min);
+  vtkm::Id maxIndex = toColorIndex(blockRange.Max);
+  if (minIndex > maxIndex)
+  {
+    vtkm::Swap(minIndex, maxIndex);
+  }
+
+  vtkm::Float32 maxAlpha = 0.f;
+  auto portal = colorMap.ReadPortal();
+  for (vtkm::Id i = minIndex; i <= maxIndex; ++i)
+  {
+    maxAlpha = vtkm::Max(maxAlpha, portal.Get(i)[3]);
+  }
+  return maxAlpha;
+}
+
 void SaveTransmittance(const vtkm::cont::DataSet& ds, const std::string& suffix)
 {
   auto mpi = pilot::mpi::Environment::Get();
@@ -547,6 +1335,19 @@ VTKM_EXEC_CONT vtkm::Vec<vtkm::Float32, S> ToVecf32(const vtkm::Vec<T, S>& v)
   return r;
 }
 
+// The origin, extent and vertex spacing of a map with dims cells over bounds
+VTKM_CONT inline void GetMapGeometry(const vtkm::Bounds& bounds,
+                                     const vtkm::Id3& dims,
+                                     vtkm::Vec3f_32& origin,
+                                     vtkm::Vec3f_32& size,
+                                     vtkm::Vec3f_32& spacing)
+{
+  origin = ToVecf32(vtkm::Vec3f_64{ bounds.X.Min, bounds.Y.Min, bounds.Z.Min });
+  size = ToVecf32(vtkm::Vec3f_64{
+    bounds.X.Max - bounds.X.Min, bounds.Y.Max - bounds.Y.Min, bounds.Z.Max - bounds.Z.Min });
+  spacing = size / dims;
+}
+
 vtkm::cont::DataSet CreateDataSetForOpacityMap(const vtkm::Vec3f_32& origin,
                                                const vtkm::Vec3f_32& size,
                                                const vtkm::Id3& dims)
@@ -562,68 +1363,382 @@ vtkm::cont::DataSet CreateDataSetForOpacityMap(const vtkm::Vec3f_32& origin,
   return dataSet;
 }
 
-template <typename Device, typename OracleType, typename Precision>
-beams::rendering::TransmittanceMapEstimator<Device, beams::rendering::TransmittanceLocator<Device>>
-GenerateEstimator(const vtkm::Bounds& bounds,
-                  const vtkm::Id3& dims,
-                  vtkm::cont::DataSet& dataSet,
-                  beams::rendering::LightRays<Precision, Device>& lightRays,
-                  const vtkm::Range& scalarRange,
-                  const vtkm::cont::Field* scalarField,
-                  vtkm::rendering::raytracing::Lights& lights,
-                  OracleType& oracle,
-                  const vtkm::cont::ArrayHandle<vtkm::Vec<vtkm::Float32, 4>>& correctedColorMap,
-                  vtkm::cont::ArrayHandle<vtkm::Float32>& opacities,
-                  vtkm::cont::Token& token)
-{
-  using CoordinatesArrayHandle = vtkm::cont::ArrayHandleUniformPointCoordinates;
-  // Generate uniform dataset within same bounds as the data set to render
-  // but with the size of dims
+// Adds the map of every light as its own point field, transmittance for the first light and
+// transmittance1, transmittance2, ... for the others
+void AddTransmittanceFields(vtkm::cont::DataSet& dataSet,
+                            const vtkm::cont::ArrayHandle<vtkm::Float32>& opacities)
+{
+  const vtkm::Id numVertices = dataSet.GetNumberOfPoints();
+  const vtkm::Id numLights = opacities.GetNumberOfValues() / numVertices;
+  for (vtkm::Id light = 0; light < numLights; ++light)
+  {
+    std::string name = "transmittance";
+    if (light > 0)
+    {
+      name += std::to_string(light);
+    }
+    dataSet.AddPointField(
+      name, vtkm::cont::make_ArrayHandleView(opacities, light * numVertices, numVertices));
+  }
+}
+
+// Marches the given light rays through the local block and composes what they collect into their
+// opacities
+template <typename Device,
+          typename OracleType,
+          typename IdsType,
+          typename PointsType,
+          typename OpacitiesType>
+void GenerateTransmittanceMap(
+  const vtkm::Bounds& bounds,
+  const vtkm::Range& scalarRange,
+  const vtkm::cont::Field* scalarField,
+  vtkm::rendering::raytracing::Lights& lights,
+  OracleType& oracle,
+  const vtkm::cont::ArrayHandle<vtkm::Vec<vtkm::Float32, 4>>& correctedColorMap,
+  vtkm::Float32 maxOpacity,
+  const IdsType& rayIds,
+  const PointsType& rayOrigins,
+  const PointsType& rayDirs,
+  const PointsType& rayDests,
+  OpacitiesType opacities)
+{
   vtkm::Vec3f_32 size = ToVecf32(vtkm::Vec3f_64{
     bounds.X.Max - bounds.X.Min, bounds.Y.Max - bounds.Y.Min, bounds.Z.Max - bounds.Z.Min });
   vtkm::Float32 numSteps = 128.0f;
   vtkm::Float32 stepSize = vtkm::Magnitude(size) / numSteps;
   // FMT_VAR(size);
   // FMT_VAR(stepSize);
-  vtkm::Id3 pdims{ dims + vtkm::Id3{ 1, 1, 1 } };
 
-  // Find the centers of the cells of the created uniform dataset
-  auto lightColor = lights.Colors[0];
-  auto lightLoc = lights.Locations[0];
-
-  auto coordinates =
-    dataSet.GetCoordinateSystem().GetData().AsArrayHandle<CoordinatesArrayHandle>();
   const vtkm::Float32 maxDensity = GetMaxAlpha(correctedColorMap);
   vtkm::cont::Invoker photonMapGenInvoker{ Device() };
   photonMapGenInvoker(TransmittanceMapGenerator{ stepSize,
                                                  vtkm::Float32(scalarRange.Min),
                                                  vtkm::Float32(scalarRange.Max),
                                                  maxDensity,
-                                                 lightLoc,
-                                                 bounds },
-                      lightRays.Ids,
-                      lightRays.Origins,
-                      lightRays.Dirs,
-                      lightRays.Dests,
+                                                 bounds,
+                                                 maxOpacity },
+                      rayIds,
+                      rayOrigins,
+                      rayDirs,
+                      rayDests,
                       lights,
                       oracle,
                       vtkm::rendering::raytracing::GetScalarFieldArray(*scalarField),
                       correctedColorMap,
                       opacities);
+}
 
-  dataSet.AddPointField("transmittance", opacities);
+// Marches the light rays of the map vertices [begin, begin + count) through the local block and
+// composes what they collect into opacities
+template <typename Device, typename OracleType, typename Precision>
+void MarchTransmittanceMap(
+  const vtkm::Bounds& bounds,
+  beams::rendering::LightRays<Precision, Device>& lightRays,
+  const vtkm::Range& scalarRange,
+  const vtkm::cont::Field* scalarField,
+  vtkm::rendering::raytracing::Lights& lights,
+  OracleType& oracle,
+  const vtkm::cont::ArrayHandle<vtkm::Vec<vtkm::Float32, 4>>& correctedColorMap,
+  vtkm::cont::ArrayHandle<vtkm::Float32>& opacities,
+  vtkm::Float32 maxOpacity,
+  vtkm::Id begin,
+  vtkm::Id count)
+{
+  GenerateTransmittanceMap<Device>(
+    bounds,
+    scalarRange,
+    scalarField,
+    lights,
+    oracle,
+    correctedColorMap,
+    maxOpacity,
+    vtkm::cont::make_ArrayHandleView(lightRays.Ids, begin, count),
+    vtkm::cont::make_ArrayHandleView(lightRays.Origins, begin, count),
+    vtkm::cont::make_ArrayHandleView(lightRays.Dirs, begin, count),
+    vtkm::cont::make_ArrayHandleView(lightRays.Dests, begin, count),
+    vtkm::cont::make_ArrayHandleView(opacities, begin, count));
+}
 
+// Starts opacities from previousOpacities, the local map of an earlier frame, and only marches
+// the light rays MovedRayFinder finds stale. rayLights are the homogeneous lights the rays of
+// previousOpacities were marched for, and are updated for the marched ones. Returns how many
+// rays were marched.
+template <typename Device, typename OracleType, typename Precision>
+vtkm::Id UpdateTransmittanceMap(
+  const vtkm::Bounds& bounds,
+  const vtkm::Id3& dims,
+  beams::rendering::LightRays<Precision, Device>& lightRays,
+  const vtkm::Range& scalarRange,
+  const vtkm::cont::Field* scalarField,
+  vtkm::rendering::raytracing::Lights& lights,
+  const std::vector<vtkm::Vec4f_32>& homogeneousLights,
+  OracleType& oracle,
+  const vtkm::cont::ArrayHandle<vtkm::Vec<vtkm::Float32, 4>>& correctedColorMap,
+  const vtkm::cont::ArrayHandle<vtkm::Float32>& previousOpacities,
+  vtkm::cont::ArrayHandle<vtkm::Vec4f_32>& rayLights,
+  vtkm::cont::ArrayHandle<vtkm::Float32>& opacities,
+  vtkm::Float32 maxOpacity,
+  vtkm::Float32 tolerance)
+{
+  vtkm::Vec3f_32 origin, size, spacing;
+  GetMapGeometry(bounds, dims, origin, size, spacing);
+  const vtkm::Id3 pdims{ dims + vtkm::Id3{ 1, 1, 1 } };
+  const vtkm::Id numRays = previousOpacities.GetNumberOfValues();
+
+  vtkm::cont::ArrayHandle<vtkm::UInt8> needsMarch;
+  vtkm::cont::Invoker invoker{ Device() };
+  invoker(MovedRayFinder{ origin, spacing, pdims, vtkm::Magnitude(size), tolerance },
+          vtkm::cont::ArrayHandleIndex(numRays),
+          vtkm::cont::make_ArrayHandle(homogeneousLights, vtkm::CopyFlag::On),
+          previousOpacities,
+          rayLights,
+          needsMarch,
+          opacities);
+
+  vtkm::cont::ArrayHandle<vtkm::Id> marchIds;
+  vtkm::cont::Algorithm::CopyIf(vtkm::cont::ArrayHandleIndex(numRays), needsMarch, marchIds);
+  GenerateTransmittanceMap<Device>(
+    bounds,
+    scalarRange,
+    scalarField,
+    lights,
+    oracle,
+    correctedColorMap,
+    maxOpacity,
+    vtkm::cont::make_ArrayHandlePermutation(marchIds, lightRays.Ids),
+    vtkm::cont::make_ArrayHandlePermutation(marchIds, lightRays.Origins),
+    vtkm::cont::make_ArrayHandlePermutation(marchIds, lightRays.Dirs),
+    vtkm::cont::make_ArrayHandlePermutation(marchIds, lightRays.Dests),
+    vtkm::cont::make_ArrayHandlePermutation(marchIds, opacities));
+  return marchIds.GetNumberOfValues();
+}
+
+// Generates the map of the vertices over bounds like MarchTransmittanceMap, composing onto the
+// opacities they already have, but sweeps it with TransmittanceMapSweeper. The sweep runs along
+// the axis the light is farthest from the block on, relative to its extent, so most rays cross
+// the previous slice inside the block. For a directional light that is the axis it travels the
+// most along, and the slices stream through the block in the light direction.
+template <typename Device, typename OracleType>
+void SweepTransmittanceMap(
+  const vtkm::Bounds& bounds,
+  const vtkm::Id3& dims,
+  const vtkm::Range& scalarRange,
+  const vtkm::cont::Field* scalarField,
+  const vtkm::Vec4f_32& light,
+  OracleType& oracle,
+  const vtkm::cont::ArrayHandle<vtkm::Vec<vtkm::Float32, 4>>& correctedColorMap,
+  vtkm::cont::ArrayHandle<vtkm::Float32>& opacities,
+  vtkm::Float32 maxOpacity)
+{
+  vtkm::Vec3f_32 origin, size, spacing;
+  GetMapGeometry(bounds, dims, origin, size, spacing);
+  const vtkm::Id3 pdims{ dims + vtkm::Id3{ 1, 1, 1 } };
+  vtkm::Float32 numSteps = 128.0f;
+  vtkm::Float32 stepSize = vtkm::Magnitude(size) / numSteps;
+  const vtkm::Float32 maxDensity = GetMaxAlpha(correctedColorMap);
+
+  const vtkm::Vec3f_32 center = origin + 0.5f * size;
+  vtkm::IdComponent axis = 0;
+  vtkm::Float32 maxDistance = -1.0f;
+  for (vtkm::IdComponent i = 0; i < 3; ++i)
+  {
+    const vtkm::Float32 distance = vtkm::Abs(light[i] - center[i] * light[3]) / size[i];
+    if (distance > maxDistance)
+    {
+      axis = i;
+      maxDistance = distance;
+    }
+  }
+
+  // Slices on either side of the light sweep away from it, the closest ones first. A directional
+  // light is on the same side of all of them, and they go in the direction it travels.
+  const vtkm::Id numSlices = pdims[axis];
+  std::vector<vtkm::Float32> offsets(static_cast<std::size_t>(numSlices));
+  std::vector<vtkm::Float32> distances(static_cast<std::size_t>(numSlices));
+  std::vector<vtkm::Id> order(static_cast<std::size_t>(numSlices));
+  for (vtkm::Id k = 0; k < numSlices; ++k)
+  {
+    const vtkm::Float32 sliceCoord = origin[axis] + static_cast<vtkm::Float32>(k) * spacing[axis];
+    const vtkm::Float32 offset = sliceCoord * light[3] - light[axis];
+    offsets[static_cast<std::size_t>(k)] = offset;
+    distances[static_cast<std::size_t>(k)] =
+      light[3] != 0.0f ? vtkm::Abs(offset) : (offset > 0.0f ? sliceCoord : -sliceCoord);
+    order[static_cast<std::size_t>(k)] = k;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](vtkm::Id k1, vtkm::Id k2) {
+    return distances[static_cast<std::size_t>(k1)] < distances[static_cast<std::size_t>(k2)];
+  });
+
+  const vtkm::Id sliceSize = pdims[(axis + 1) % 3] * pdims[(axis + 2) % 3];
+  vtkm::cont::ArrayHandleCounting<vtkm::Id> sliceIds(0, 1, sliceSize);
+  auto scalars = vtkm::rendering::raytracing::GetScalarFieldArray(*scalarField);
+  vtkm::cont::Invoker invoker{ Device() };
+  for (vtkm::Id slice : order)
+  {
+    // The previous slice has to lie strictly between this one and the light
+    const vtkm::Float32 offset = offsets[static_cast<std::size_t>(slice)];
+    const vtkm::Id previous = offset > 0.0f ? slice - 1 : slice + 1;
+    const bool hasPrevious = offset != 0.0f && previous >= 0 && previous < numSlices &&
+      offsets[static_cast<std::size_t>(previous)] * offset > 0.0f;
+    invoker(TransmittanceMapSweeper{ stepSize,
+                                     vtkm::Float32(scalarRange.Min),
+                                     vtkm::Float32(scalarRange.Max),
+                                     maxDensity,
+                                     light,
+                                     bounds,
+                                     origin,
+                                     spacing,
+                                     pdims,
+                                     axis,
+                                     slice,
+                                     hasPrevious ? previous : -1,
+                                     maxOpacity },
+            sliceIds,
+            oracle,
+            scalars,
+            correctedColorMap,
+            opacities);
+  }
+}
+
+template <typename Device>
+beams::rendering::TransmittanceMapEstimator<Device, beams::rendering::TransmittanceLocator<Device>>
+MakeTransmittanceEstimator(const vtkm::cont::ArrayHandleUniformPointCoordinates& coordinates,
+                           const vtkm::Id3& dims,
+                           const vtkm::rendering::raytracing::Lights& lights,
+                           const vtkm::cont::ArrayHandle<vtkm::Float32>& opacities,
+                           vtkm::cont::Token& token)
+{
+  vtkm::Id3 pdims{ dims + vtkm::Id3{ 1, 1, 1 } };
   TransmittanceLocator<Device> locator(coordinates, pdims, token);
   TransmittanceMapEstimator<Device, TransmittanceLocator<Device>> transmittanceMapEstimator(
-    coordinates, opacities, locator, lightColor, token);
-
+    coordinates,
+    opacities,
+    locator,
+    vtkm::cont::make_ArrayHandle(lights.Colors, vtkm::CopyFlag::On),
+    token);
   return transmittanceMapEstimator;
 }
 
-template <typename TransmittanceEstimator, typename Device>
-void GetNonLocalHits(TransmittanceEstimator& transmittanceEstimator,
-                     const vtkm::rendering::raytracing::Lights& lights,
+// Composes the local map onto the opacities the vertices collected before entering the block
+template <typename Device>
+void ComposeTransmittanceMaps(const vtkm::cont::ArrayHandle<vtkm::Float32>& localOpacities,
+                              vtkm::cont::ArrayHandle<vtkm::Float32>& opacities)
+{
+  vtkm::cont::Invoker invoker{ Device() };
+  invoker(TransmittanceMapComposer{}, localOpacities, opacities);
+}
+
+// The light rays of the map vertices over bounds that still need the opacities of the other
+// blocks, as decided by RemoteVertexFinder from the local maps and the cells Phase 4 shades
+template <typename Device, typename OracleType>
+void FindRemoteVertices(const vtkm::Bounds& bounds,
+                        const vtkm::Id3& dims,
+                        const vtkm::Range& scalarRange,
+                        const vtkm::cont::Field* scalarField,
+                        vtkm::Id numCells,
+                        OracleType& oracle,
+                        const vtkm::cont::ArrayHandle<vtkm::Vec<vtkm::Float32, 4>>& colorMap,
+                        const vtkm::cont::ArrayHandle<vtkm::Float32>& localOpacities,
+                        vtkm::Float32 maxOpacity,
+                        vtkm::cont::ArrayHandle<vtkm::UInt8>& needsRemote)
+{
+  vtkm::Vec3f_32 origin, size, spacing;
+  GetMapGeometry(bounds, dims, origin, size, spacing);
+
+  // How many of the colors before each index are visible, so a cell tests its whole range of
+  // colors with two lookups
+  const vtkm::Id colorMapSize = colorMap.GetNumberOfValues();
+  std::vector<vtkm::Id> visibleColorsV(static_cast<std::size_t>(colorMapSize + 1), 0);
+  auto colorMapP = colorMap.ReadPortal();
+  for (vtkm::Id i = 0; i < colorMapSize; ++i)
+  {
+    visibleColorsV[static_cast<std::size_t>(i + 1)] =
+      visibleColorsV[static_cast<std::size_t>(i)] + (colorMapP.Get(i)[3] > 0.0f ? 1 : 0);
+  }
+  vtkm::cont::ArrayHandle<vtkm::Id> visibleColors =
+    vtkm::cont::make_ArrayHandle(visibleColorsV, vtkm::CopyFlag::On);
+
+  vtkm::cont::ArrayHandle<vtkm::UInt8> shadedMapCells;
+  shadedMapCells.Allocate(dims[0] * dims[1] * dims[2]);
+  vtkm::cont::Algorithm::Fill(shadedMapCells, vtkm::UInt8(0));
+  vtkm::cont::Invoker invoker{ Device() };
+  invoker(ShadedMapCellMarker{ vtkm::Float32(scalarRange.Min),
+                               vtkm::Float32(scalarRange.Max),
+                               origin,
+                               spacing,
+                               dims,
+                               scalarField->IsCellField() },
+          vtkm::cont::ArrayHandleIndex(numCells),
+          oracle,
+          vtkm::rendering::raytracing::GetScalarFieldArray(*scalarField),
+          visibleColors,
+          shadedMapCells);
+  invoker(RemoteVertexFinder{ dims, maxOpacity }, localOpacities, shadedMapCells, needsRemote);
+}
+
+// Fills in the Opacity of every hit from the replicated maps of GatherOpacityMaps, with one
+// estimator per block laid out over the bounds of that block like the local one
+template <typename Device>
+void EvaluateReplicatedHits(const beams::rendering::BoundsMap& boundsMap,
+                            const vtkm::Id3& dims,
+                            const vtkm::rendering::raytracing::Lights& lights,
+                            const std::vector<vtkm::Float32>& opacityMaps,
+                            std::vector<TransmittanceRayBlockHit>& hits)
+{
+  using EstimatorType = TransmittanceMapEstimator<Device, TransmittanceLocator<Device>>;
+  const vtkm::Id3 pdims{ dims + vtkm::Id3{ 1, 1, 1 } };
+  const vtkm::Id numVertices = pdims[0] * pdims[1] * pdims[2];
+
+  std::map<vtkm::Id, std::vector<std::size_t>> blockHits;
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    blockHits[hits[i].BlockId].push_back(i);
+  }
+
+  vtkm::cont::Invoker invoker{ Device() };
+  for (const auto& entry : blockHits)
+  {
+    const vtkm::Id blockId = entry.first;
+    const std::vector<std::size_t>& hitIds = entry.second;
+    const vtkm::Bounds& bounds = boundsMap.BlockBounds[static_cast<std::size_t>(blockId)];
+    vtkm::Vec3f_32 origin, size, spacing;
+    GetMapGeometry(bounds, dims, origin, size, spacing);
+    vtkm::cont::ArrayHandleUniformPointCoordinates coordinates(pdims, origin, spacing);
+    vtkm::cont::ArrayHandle<vtkm::Float32> opacities = vtkm::cont::make_ArrayHandle(
+      opacityMaps.data() + blockId * numVertices, numVertices, vtkm::CopyFlag::Off);
+
+    std::vector<TransmittanceRayBlockHit> queriesV(hitIds.size());
+    for (std::size_t i = 0; i < hitIds.size(); ++i)
+    {
+      queriesV[i] = hits[hitIds[i]];
+    }
+    vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> queries =
+      vtkm::cont::make_ArrayHandle(queriesV, vtkm::CopyFlag::On);
+    {
+      vtkm::cont::Token token;
+      EstimatorType estimator =
+        MakeTransmittanceEstimator<Device>(coordinates, dims, lights, opacities, token);
+      // The fetcher only interpolates, so it needs no step size
+      invoker(TransmittanceFetcher2<EstimatorType>{ static_cast<int>(blockId), 0.0f, estimator },
+              queries);
+    }
+
+    auto queriesP = queries.ReadPortal();
+    for (std::size_t i = 0; i < hitIds.size(); ++i)
+    {
+      hits[hitIds[i]].Opacity = queriesP.Get(static_cast<vtkm::Id>(i)).Opacity;
+    }
+  }
+}
+
+// The hits of the light rays towards the map vertices, of all the lights at once
+template <typename Precision, typename Device>
+void GetNonLocalHits(const beams::rendering::LightRays<Precision, Device>& lightRays,
                      const beams::rendering::BoundsMap& boundsMap,
+                     const vtkm::cont::ArrayHandle<vtkm::UInt8>& transparentBlocks,
+                     const vtkm::cont::ArrayHandle<vtkm::UInt8>& needsRemote,
                      bool useGlancingHits,
                      vtkm::cont::ArrayHandle<vtkm::Id>& hitCounts,
                      vtkm::cont::ArrayHandle<vtkm::Id>& hitOffsets,
@@ -632,22 +1747,127 @@ void GetNonLocalHits(TransmittanceEstimator& transmittanceEstimator,
   auto mpi = pilot::mpi::Environment::Get();
   vtkm::cont::Invoker invoker{ Device() };
 
-  invoker(CountNonLocalBlockHits{ mpi->Rank, lights.Locations[0], useGlancingHits },
-          transmittanceEstimator.LocationsHandle,
+  invoker(CountNonLocalBlockHits{ mpi->Rank, mpi->Size, useGlancingHits },
+          lightRays.Origins,
+          lightRays.Dests,
+          needsRemote,
           boundsMap,
+          transparentBlocks,
           hitCounts);
   vtkm::Id totalHitCount = vtkm::cont::Algorithm::Reduce(hitCounts, 0);
   vtkm::cont::Algorithm::ScanExclusive(hitCounts, hitOffsets);
   // Fmt::PrintArrayHandlelnr(1, "hitOffsets", hitOffsets);
 
   hits.Allocate(totalHitCount);
-  invoker(CalculateNonLocalBlockHits{ mpi->Rank, mpi->Size, lights.Locations[0], useGlancingHits },
-          transmittanceEstimator.LocationsHandle,
+  invoker(CalculateNonLocalBlockHits{ mpi->Rank, mpi->Size, useGlancingHits },
+          lightRays.Origins,
+          lightRays.Dests,
+          needsRemote,
           boundsMap,
+          transparentBlocks,
           hitOffsets,
           hits);
 }
 
+// GetNonLocalHits for the map vertices [begin, begin + count) only. Their hit counts are written
+// to the same range of hitCounts, and their hits are returned sorted.
+template <typename PointsArrayType, typename Device>
+std::vector<TransmittanceRayBlockHit> GetNonLocalHitsInRange(
+  const PointsArrayType& points,
+  const vtkm::rendering::raytracing::Lights& lights,
+  const beams::rendering::BoundsMap& boundsMap,
+  const vtkm::cont::ArrayHandle<vtkm::UInt8>& transparentBlocks,
+  bool useGlancingHits,
+  vtkm::Id begin,
+  vtkm::Id count,
+  vtkm::cont::ArrayHandle<vtkm::Id>& hitCounts)
+{
+  auto mpi = pilot::mpi::Environment::Get();
+  vtkm::cont::Invoker invoker{ Device() };
+  auto rangePoints = vtkm::cont::make_ArrayHandleView(points, begin, count);
+  auto lightLocations = vtkm::cont::make_ArrayHandleConstant(lights.Locations[0], count);
+  // The hits go out before the chunk is marched, so every vertex asks
+  auto needsRemote = vtkm::cont::make_ArrayHandleConstant(vtkm::UInt8(1), count);
+
+  vtkm::cont::ArrayHandle<vtkm::Id> rangeHitCounts;
+  vtkm::cont::ArrayHandle<vtkm::Id> rangeHitOffsets;
+  invoker(CountNonLocalBlockHits{ mpi->Rank, mpi->Size, useGlancingHits },
+          lightLocations,
+          rangePoints,
+          needsRemote,
+          boundsMap,
+          transparentBlocks,
+          rangeHitCounts);
+  vtkm::cont::Algorithm::CopySubRange(rangeHitCounts, 0, count, hitCounts, begin);
+  vtkm::Id totalHitCount = vtkm::cont::Algorithm::Reduce(rangeHitCounts, vtkm::Id(0));
+  vtkm::cont::Algorithm::ScanExclusive(rangeHitCounts, rangeHitOffsets);
+
+  vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> hits;
+  hits.Allocate(totalHitCount);
+  invoker(CalculateNonLocalBlockHits{ mpi->Rank, mpi->Size, useGlancingHits },
+          lightLocations,
+          rangePoints,
+          needsRemote,
+          boundsMap,
+          transparentBlocks,
+          rangeHitOffsets,
+          hits);
+  SortHits<Device>(hits);
+
+  // The worklets number the rays within the range
+  std::vector<TransmittanceRayBlockHit> hitsV(static_cast<std::size_t>(totalHitCount));
+  auto hitsP = hits.ReadPortal();
+  for (vtkm::Id i = 0; i < totalHitCount; ++i)
+  {
+    hitsV[static_cast<std::size_t>(i)] = hitsP.Get(i);
+    hitsV[static_cast<std::size_t>(i)].RayId += static_cast<int>(begin);
+  }
+  return hitsV;
+}
+
+// Rebuilds the opacity map vertices of a remote block the way its owner does, and lists the hits
+// their light rays make on the local block in vertex order. This matches the order in which the
+// owner lists its own hits on the local block.
+template <typename Device>
+std::vector<TransmittanceRayBlockHit> GetRemoteMapHits(
+  const beams::rendering::BoundsMap& boundsMap,
+  vtkm::Id remoteBlockId,
+  const vtkm::Id3& dims,
+  const vtkm::rendering::raytracing::Lights& lights,
+  bool useGlancingHits)
+{
+  auto mpi = pilot::mpi::Environment::Get();
+  vtkm::cont::Invoker invoker{ Device() };
+
+  const vtkm::Bounds& bounds = boundsMap.BlockBounds[static_cast<std::size_t>(remoteBlockId)];
+  vtkm::Vec3f_32 origin = ToVecf32(vtkm::Vec3f_64{ bounds.X.Min, bounds.Y.Min, bounds.Z.Min });
+  vtkm::Vec3f_32 size = ToVecf32(vtkm::Vec3f_64{
+    bounds.X.Max - bounds.X.Min, bounds.Y.Max - bounds.Y.Min, bounds.Z.Max - bounds.Z.Min });
+  vtkm::cont::DataSet remoteMapDataSet = CreateDataSetForOpacityMap(origin, size, dims);
+  auto coordinates = remoteMapDataSet.GetCoordinateSystem()
+                       .GetData()
+                       .AsArrayHandle<vtkm::cont::ArrayHandleUniformPointCoordinates>();
+
+  vtkm::cont::ArrayHandle<vtkm::UInt8> hitsBlock;
+  vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> allHits;
+  invoker(CalculateBlockHits{ mpi->Rank, remoteBlockId, lights.Locations[0], useGlancingHits },
+          coordinates,
+          boundsMap,
+          hitsBlock,
+          allHits);
+  vtkm::cont::ArrayHandle<TransmittanceRayBlockHit> blockHits;
+  vtkm::cont::Algorithm::CopyIf(allHits, hitsBlock, blockHits);
+
+  std::vector<TransmittanceRayBlockHit> blockHitsV(
+    static_cast<std::size_t>(blockHits.GetNumberOfValues()));
+  auto blockHitsP = blockHits.ReadPortal();
+  for (vtkm::Id i = 0; i < blockHitsP.GetNumberOfValues(); ++i)
+  {
+    blockHitsV[static_cast<std::size_t>(i)] = blockHitsP.Get(i);
+  }
+  return blockHitsV;
+}
+
 } // namespace rendering
 } // namespace beams
 
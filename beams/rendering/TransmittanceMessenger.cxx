@@ -0,0 +1,174 @@
+#include "TransmittanceMessenger.h"
+#include "BoundsMap.h"
+
+#include <vtkm/cont/ErrorBadValue.h>
+
+#include <algorithm>
+#include <string>
+
+namespace beams
+{
+namespace rendering
+{
+TransmittanceMessenger::TransmittanceMessenger(MPI_Comm comm,
+                                               std::size_t packetSize,
+                                               int numRecvs)
+  : pilot::mpi::Messenger(comm)
+{
+  numRecvs = std::max(1, std::min(numRecvs, this->GetNumRanks()));
+  this->RegisterTag(QUERY_TAG, numRecvs, packetSize);
+  this->RegisterTag(REPLY_TAG, numRecvs, packetSize);
+  this->InitializeBuffers();
+}
+
+void TransmittanceMessenger::Exchange(const beams::rendering::BoundsMap& boundsMap,
+                                      TransmittanceWireFormat format,
+                                      std::vector<TransmittanceRayBlockHit>& hits,
+                                      const TransmittanceHitEvaluator& evaluate)
+{
+  this->BeginEpoch();
+
+  // One request per owner rank, listing the hits sent to it
+  std::vector<int> owners(hits.size());
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    owners[i] = boundsMap.FindRank(hits[i].BlockId);
+  }
+  std::vector<int> requestOwners = owners;
+  std::sort(requestOwners.begin(), requestOwners.end());
+  requestOwners.erase(std::unique(requestOwners.begin(), requestOwners.end()), requestOwners.end());
+  for (std::vector<std::size_t>& request : this->Requests)
+  {
+    request.clear();
+  }
+  this->Requests.resize(requestOwners.size());
+  for (std::size_t i = 0; i < hits.size(); ++i)
+  {
+    auto owner = std::lower_bound(requestOwners.begin(), requestOwners.end(), owners[i]);
+    this->Requests[static_cast<std::size_t>(owner - requestOwners.begin())].push_back(i);
+  }
+
+  for (std::size_t requestId = 0; requestId < this->Requests.size(); ++requestId)
+  {
+    const std::vector<std::size_t>& request = this->Requests[requestId];
+    pilot::mpi::MessageBuffer& buffer = this->GetSendBuffer();
+    buffer.Write(static_cast<int>(requestId));
+    buffer.Write(request.size());
+    for (std::size_t i : request)
+    {
+      if (format == TransmittanceWireFormat::Compact)
+      {
+        const vtkm::Bounds& bounds =
+          boundsMap.BlockBounds[static_cast<std::size_t>(hits[i].BlockId)];
+        buffer.Write(QuantizePoint(hits[i].Point, bounds));
+      }
+      else
+      {
+        buffer.Write(hits[i]);
+      }
+    }
+    this->SendData(requestOwners[requestId], QUERY_TAG, buffer);
+  }
+  this->NumRepliesLeft = static_cast<int>(this->Requests.size());
+  this->BeginTermination(QUERY_TAG);
+
+  // Replies are sure to come while some are left, after that only the termination is polled
+  auto handle = [&](int source, int tag, pilot::mpi::MessageReader& message) {
+    this->HandleMessage(source, tag, message, boundsMap, format, hits);
+  };
+  while (this->NumRepliesLeft > 0 || !this->IsTerminated())
+  {
+    this->RecvData(handle, this->NumRepliesLeft > 0);
+    this->AnswerQueries(format, evaluate);
+    this->CheckPendingSendRequests();
+  }
+}
+
+void TransmittanceMessenger::HandleMessage(int source,
+                                           int tag,
+                                           pilot::mpi::MessageReader& message,
+                                           const beams::rendering::BoundsMap& boundsMap,
+                                           TransmittanceWireFormat format,
+                                           std::vector<TransmittanceRayBlockHit>& hits)
+{
+  const int requestId = message.Read<int>();
+  const std::size_t count = message.Read<std::size_t>();
+  const bool isCompact = format == TransmittanceWireFormat::Compact;
+
+  if (tag == REPLY_TAG)
+  {
+    if (requestId < 0 || static_cast<std::size_t>(requestId) >= this->Requests.size() ||
+        this->Requests[static_cast<std::size_t>(requestId)].size() != count)
+    {
+      throw vtkm::cont::ErrorBadValue("Transmittance reply from rank " + std::to_string(source) +
+                                      " does not match any request");
+    }
+    for (std::size_t i : this->Requests[static_cast<std::size_t>(requestId)])
+    {
+      hits[i].Opacity =
+        isCompact ? DequantizeOpacity(message.Read<vtkm::UInt16>()) : message.Read<vtkm::Float32>();
+    }
+    this->NumRepliesLeft--;
+    return;
+  }
+
+  // Queries are only collected here, and evaluated together once the received ones are handled
+  const vtkm::Id localBlock = boundsMap.GetLocalBlockId();
+  const vtkm::Bounds& bounds = boundsMap.BlockBounds[static_cast<std::size_t>(localBlock)];
+  this->QueryMessages.push_back({ source, requestId, count });
+  const std::size_t begin = this->Queries.size();
+  this->Queries.resize(begin + count);
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    TransmittanceRayBlockHit& query = this->Queries[begin + i];
+    if (isCompact)
+    {
+      query.RayId = static_cast<int>(i);
+      query.BlockId = static_cast<int>(localBlock);
+      query.FromBlockId = source;
+      query.Point = DequantizePoint(message.Read<QuantizedPoint>(), bounds);
+      query.RayT = 0.0f;
+      query.Opacity = 0.0f;
+    }
+    else
+    {
+      query = message.Read<TransmittanceRayBlockHit>();
+    }
+  }
+}
+
+void TransmittanceMessenger::AnswerQueries(TransmittanceWireFormat format,
+                                           const TransmittanceHitEvaluator& evaluate)
+{
+  if (this->QueryMessages.empty())
+  {
+    return;
+  }
+  evaluate(this->Queries);
+
+  std::size_t begin = 0;
+  for (const QueryMessage& queryMessage : this->QueryMessages)
+  {
+    pilot::mpi::MessageBuffer& buffer = this->GetSendBuffer();
+    buffer.Write(queryMessage.RequestId);
+    buffer.Write(queryMessage.Count);
+    for (std::size_t i = 0; i < queryMessage.Count; ++i)
+    {
+      const vtkm::Float32 opacity = this->Queries[begin + i].Opacity;
+      if (format == TransmittanceWireFormat::Compact)
+      {
+        buffer.Write(QuantizeOpacity(opacity));
+      }
+      else
+      {
+        buffer.Write(opacity);
+      }
+    }
+    this->SendData(queryMessage.Source, REPLY_TAG, buffer);
+    begin += queryMessage.Count;
+  }
+  this->QueryMessages.clear();
+  this->Queries.clear();
+}
+} // namespace rendering
+} // namespace beams
@@ -1,352 +1,65 @@
-#ifndef beams_mpi_transmittancemessenger_h
-#define beams_mpi_transmittancemessenger_h
+#ifndef beams_rendering_transmittance_messenger_h
+#define beams_rendering_transmittance_messenger_h
 
-#include "mpi/Messenger.h"
+#include "TransmittanceExchange.h"
+
+#include <pilot/mpi/Messenger.h>
 
-#include <list>
-#include <map>
-#include <set>
 #include <vector>
 
 namespace beams
 {
 namespace rendering
 {
+struct BoundsMap;
+
+//
+// Transmittance queries and replies as asynchronous messages. Every rank sends its hits to the
+// owners of the blocks they hit, one message per owner, and answers the queries of other ranks
+// as they come in. A rank does not need to know who will query it: the queries are terminated
+// with the messenger, and each query message gets exactly one reply.
+//
 class TransmittanceMessenger : public pilot::mpi::Messenger
 {
-  //sendRank, message
-  using MsgCommType = std::pair<int, std::vector<int>>;
-
-  //particle + blockIDs.
-  using ParticleCommType = std::pair<ParticleType, std::vector<vtkm::Id>>;
-
-  //sendRank, vector of ParticleCommType.
-  using ParticleRecvCommType = std::pair<int, std::vector<ParticleCommType>>;
-
 public:
-  VTKM_CONT ParticleMessenger(vtkmdiy::mpi::communicator& comm,
-                              const vtkm::filter::flow::internal::BoundsMap& bm,
-                              int msgSz = 1,
-                              int numParticles = 128,
-                              int numBlockIds = 2);
-  VTKM_CONT ~ParticleMessenger() {}
-
-  VTKM_CONT void Exchange(const std::vector<ParticleType>& outData,
-                          const std::unordered_map<vtkm::Id, std::vector<vtkm::Id>>& outBlockIDsMap,
-                          vtkm::Id numLocalTerm,
-                          std::vector<ParticleType>& inData,
-                          std::unordered_map<vtkm::Id, std::vector<vtkm::Id>>& inDataBlockIDsMap,
-                          vtkm::Id& numTerminateMessages,
-                          bool blockAndWait = false);
-
-protected:
-#ifdef VTKM_ENABLE_MPI
-  static constexpr int MSG_TERMINATE = 1;
-
-  enum { MESSAGE_TAG = 0x42000, PARTICLE_TAG = 0x42001 };
-
-  VTKM_CONT void RegisterMessages(int msgSz, int nParticles, int numBlockIds);
-
-  // Send/Recv particles
-  VTKM_CONT
-  template <typename P,
-            template <typename, typename>
-            class Container,
-            typename Allocator = std::allocator<P>>
-  inline void SendParticles(int dst, const Container<P, Allocator>& c);
-
-  VTKM_CONT
-  template <typename P,
-            template <typename, typename>
-            class Container,
-            typename Allocator = std::allocator<P>>
-  inline void SendParticles(const std::unordered_map<int, Container<P, Allocator>>& m);
-
-  // Send/Recv messages.
-  VTKM_CONT void SendMsg(int dst, const std::vector<int>& msg);
-  VTKM_CONT void SendAllMsg(const std::vector<int>& msg);
-  VTKM_CONT bool RecvMsg(std::vector<MsgCommType>& msgs)
-  {
-    return RecvAny(&msgs, NULL, false);
-  }
-
-  // Send/Recv datasets.
-  VTKM_CONT bool RecvAny(std::vector<MsgCommType>* msgs,
-                         std::vector<ParticleRecvCommType>* recvParticles,
-                         bool blockAndWait);
-  const vtkm::filter::flow::internal::BoundsMap& BoundsMap;
-
-#endif
-
-  VTKM_CONT void SerialExchange(
-    const std::vector<ParticleType>& outData,
-    const std::unordered_map<vtkm::Id, std::vector<vtkm::Id>>& outBlockIDsMap,
-    vtkm::Id numLocalTerm,
-    std::vector<ParticleType>& inData,
-    std::unordered_map<vtkm::Id, std::vector<vtkm::Id>>& inDataBlockIDsMap,
-    bool blockAndWait) const;
-
-  static std::size_t CalcParticleBufferSize(std::size_t nParticles, std::size_t numBlockIds = 2);
-};
-
-//methods
-
-VTKM_CONT
-template <typename ParticleType>
-ParticleMessenger<ParticleType>::ParticleMessenger(
-  vtkmdiy::mpi::communicator& comm,
-  const vtkm::filter::flow::internal::BoundsMap& boundsMap,
-  int msgSz,
-  int numParticles,
-  int numBlockIds)
-  : Messenger(comm)
-#ifdef VTKM_ENABLE_MPI
-  , BoundsMap(boundsMap)
-#endif
-{
-#ifdef VTKM_ENABLE_MPI
-  this->RegisterMessages(msgSz, numParticles, numBlockIds);
-#else
-  (void)(boundsMap);
-  (void)(msgSz);
-  (void)(numParticles);
-  (void)(numBlockIds);
-#endif
-}
-
-template <typename ParticleType>
-std::size_t ParticleMessenger<ParticleType>::CalcParticleBufferSize(std::size_t nParticles,
-                                                                    std::size_t nBlockIds)
-{
-  ParticleType pTmp;
-  std::size_t pSize = ParticleType::Sizeof();
-
-#ifndef NDEBUG
-  vtkmdiy::MemoryBuffer buff;
-  ParticleType p;
-  vtkmdiy::save(buff, p);
-
-  //Make sure the buffer size is correct.
-  //If this fires, then the size of the class has changed.
-  VTKM_ASSERT(pSize == buff.size());
-#endif
-
-  return
-    // rank
-    sizeof(int)
-    //std::vector<ParticleType> p;
-    //p.size()
-    + sizeof(std::size_t)
-    //nParticles of ParticleType
-    + nParticles * pSize
-    // std::vector<vtkm::Id> blockIDs for each particle.
-    // blockIDs.size() for each particle
-    + nParticles * sizeof(std::size_t)
-    // nBlockIDs of vtkm::Id for each particle.
-    + nParticles * nBlockIds * sizeof(vtkm::Id);
-}
-
-VTKM_CONT
-template <typename ParticleType>
-void ParticleMessenger<ParticleType>::SerialExchange(
-  const std::vector<ParticleType>& outData,
-  const std::unordered_map<vtkm::Id, std::vector<vtkm::Id>>& outBlockIDsMap,
-  vtkm::Id vtkmNotUsed(numLocalTerm),
-  std::vector<ParticleType>& inData,
-  std::unordered_map<vtkm::Id, std::vector<vtkm::Id>>& inDataBlockIDsMap,
-  bool vtkmNotUsed(blockAndWait)) const
-{
-  for (auto& p : outData)
-  {
-    const auto& bids = outBlockIDsMap.find(p.ID)->second;
-    inData.emplace_back(p);
-    inDataBlockIDsMap[p.ID] = bids;
-  }
-}
-
-VTKM_CONT
-template <typename ParticleType>
-void ParticleMessenger<ParticleType>::Exchange(
-  const std::vector<ParticleType>& outData,
-  const std::unordered_map<vtkm::Id, std::vector<vtkm::Id>>& outBlockIDsMap,
-  vtkm::Id numLocalTerm,
-  std::vector<ParticleType>& inData,
-  std::unordered_map<vtkm::Id, std::vector<vtkm::Id>>& inDataBlockIDsMap,
-  vtkm::Id& numTerminateMessages,
-  bool blockAndWait)
-{
-  numTerminateMessages = 0;
-  inDataBlockIDsMap.clear();
-
-  if (this->GetNumRanks() == 1)
-    return this->SerialExchange(
-      outData, outBlockIDsMap, numLocalTerm, inData, inDataBlockIDsMap, blockAndWait);
-
-#ifdef VTKM_ENABLE_MPI
+  TransmittanceMessenger(MPI_Comm comm, std::size_t packetSize = 64 * 1024, int numRecvs = 16);
 
-  //dstRank, vector of (particles,blockIDs)
-  std::unordered_map<int, std::vector<ParticleCommType>> sendData;
+  // Collective, with the same contract as the exchanges in TransmittanceExchange.h
+  void Exchange(const beams::rendering::BoundsMap& boundsMap,
+                TransmittanceWireFormat format,
+                std::vector<TransmittanceRayBlockHit>& hits,
+                const TransmittanceHitEvaluator& evaluate);
 
-  for (const auto& p : outData)
+private:
+  enum
   {
-    const auto& bids = outBlockIDsMap.find(p.ID)->second;
-    int dstRank = this->BoundsMap.FindRank(bids[0]);
-    sendData[dstRank].emplace_back(std::make_pair(p, bids));
-  }
+    QUERY_TAG = 0x42100,
+    REPLY_TAG = 0x42101
+  };
 
-  //Do all the sends first.
-  if (numLocalTerm > 0)
-    this->SendAllMsg({ MSG_TERMINATE, static_cast<int>(numLocalTerm) });
-  this->SendParticles(sendData);
-  this->CheckPendingSendRequests();
-
-  //Check if we have anything coming in.
-  std::vector<ParticleRecvCommType> particleData;
-  std::vector<MsgCommType> msgData;
-  if (RecvAny(&msgData, &particleData, blockAndWait))
-  {
-    for (const auto& it : particleData)
-      for (const auto& v : it.second)
-      {
-        const auto& p = v.first;
-        const auto& bids = v.second;
-        inData.emplace_back(p);
-        inDataBlockIDsMap[p.ID] = bids;
-      }
-
-    for (const auto& m : msgData)
-    {
-      if (m.second[0] == MSG_TERMINATE)
-        numTerminateMessages += static_cast<vtkm::Id>(m.second[1]);
-    }
-  }
-#endif
-}
-
-
-#ifdef VTKM_ENABLE_MPI
-
-VTKM_CONT
-template <typename ParticleType>
-void ParticleMessenger<ParticleType>::RegisterMessages(int msgSz, int nParticles, int numBlockIds)
-{
-  //Determine buffer size for msg and particle tags.
-  std::size_t messageBuffSz = CalcMessageBufferSize(msgSz + 1);
-  std::size_t particleBuffSz = CalcParticleBufferSize(nParticles, numBlockIds);
-
-  int numRecvs = std::min(64, this->GetNumRanks() - 1);
-
-  this->RegisterTag(ParticleMessenger::MESSAGE_TAG, numRecvs, messageBuffSz);
-  this->RegisterTag(ParticleMessenger::PARTICLE_TAG, numRecvs, particleBuffSz);
-
-  this->InitializeBuffers();
-}
-
-VTKM_CONT
-template <typename ParticleType>
-void ParticleMessenger<ParticleType>::SendMsg(int dst, const std::vector<int>& msg)
-{
-  vtkmdiy::MemoryBuffer buff;
-
-  //Write data.
-  vtkmdiy::save(buff, this->GetRank());
-  vtkmdiy::save(buff, msg);
-  this->SendData(dst, ParticleMessenger::MESSAGE_TAG, buff);
-}
-
-VTKM_CONT
-template <typename ParticleType>
-void ParticleMessenger<ParticleType>::SendAllMsg(const std::vector<int>& msg)
-{
-  for (int i = 0; i < this->GetNumRanks(); i++)
-    if (i != this->GetRank())
-      this->SendMsg(i, msg);
-}
-
-VTKM_CONT
-template <typename ParticleType>
-bool ParticleMessenger<ParticleType>::RecvAny(std::vector<MsgCommType>* msgs,
-                                              std::vector<ParticleRecvCommType>* recvParticles,
-                                              bool blockAndWait)
-{
-  std::set<int> tags;
-  if (msgs)
-  {
-    tags.insert(ParticleMessenger::MESSAGE_TAG);
-    msgs->resize(0);
-  }
-  if (recvParticles)
-  {
-    tags.insert(ParticleMessenger::PARTICLE_TAG);
-    recvParticles->resize(0);
-  }
-
-  if (tags.empty())
-    return false;
-
-  std::vector<std::pair<int, vtkmdiy::MemoryBuffer>> buffers;
-  if (!this->RecvData(tags, buffers, blockAndWait))
-    return false;
-
-  for (auto& buff : buffers)
-  {
-    if (buff.first == ParticleMessenger::MESSAGE_TAG)
-    {
-      int sendRank;
-      std::vector<int> m;
-      vtkmdiy::load(buff.second, sendRank);
-      vtkmdiy::load(buff.second, m);
-      msgs->emplace_back(std::make_pair(sendRank, m));
-    }
-    else if (buff.first == ParticleMessenger::PARTICLE_TAG)
-    {
-      int sendRank;
-      std::vector<ParticleCommType> particles;
-
-      vtkmdiy::load(buff.second, sendRank);
-      vtkmdiy::load(buff.second, particles);
-      recvParticles->emplace_back(std::make_pair(sendRank, particles));
-    }
-  }
-
-  return true;
-}
-
-VTKM_CONT
-template <typename ParticleType>
-template <typename P, template <typename, typename> class Container, typename Allocator>
-inline void ParticleMessenger<ParticleType>::SendParticles(int dst,
-                                                           const Container<P, Allocator>& c)
-{
-  if (dst == this->GetRank())
+  struct QueryMessage
   {
-    VTKM_LOG_S(vtkm::cont::LogLevel::Error, "Error. Sending a particle to yourself.");
-    return;
-  }
-  if (c.empty())
-    return;
-
-  vtkmdiy::MemoryBuffer bb;
-  vtkmdiy::save(bb, this->GetRank());
-  vtkmdiy::save(bb, c);
-  this->SendData(dst, ParticleMessenger::PARTICLE_TAG, bb);
-}
-
-VTKM_CONT
-template <typename ParticleType>
-template <typename P, template <typename, typename> class Container, typename Allocator>
-inline void ParticleMessenger<ParticleType>::SendParticles(
-  const std::unordered_map<int, Container<P, Allocator>>& m)
-{
-  for (const auto& mit : m)
-    if (!mit.second.empty())
-      this->SendParticles(mit.first, mit.second);
-}
-#endif
-
-}
-}
-}
-} // vtkm::filter::flow::internal
+    int Source;
+    int RequestId;
+    std::size_t Count;
+  };
+
+  void HandleMessage(int source,
+                     int tag,
+                     pilot::mpi::MessageReader& message,
+                     const beams::rendering::BoundsMap& boundsMap,
+                     TransmittanceWireFormat format,
+                     std::vector<TransmittanceRayBlockHit>& hits);
+
+  void AnswerQueries(TransmittanceWireFormat format, const TransmittanceHitEvaluator& evaluate);
+
+  // Scratch space kept across exchanges
+  std::vector<std::vector<std::size_t>> Requests;
+  std::vector<QueryMessage> QueryMessages;
+  std::vector<TransmittanceRayBlockHit> Queries;
+  int NumRepliesLeft = 0;
+};
+} // namespace rendering
+} // namespace beams
 
-#endif // beams_mpi_transmittancemessenger_h
\ No newline at end of file
+#endif // beams_rendering_transmittance_messenger_h
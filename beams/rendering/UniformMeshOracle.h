@@ -0,0 +1,183 @@
+#ifndef beams_rendering_uniformmeshoracle_h
+#define beams_rendering_uniformmeshoracle_h
+
+#include <vtkm/CellShape.h>
+#include <vtkm/Math.h>
+#include <vtkm/cont/ArrayHandleUniformPointCoordinates.h>
+#include <vtkm/cont/CellSetStructured.h>
+#include <vtkm/cont/ExecutionObjectBase.h>
+#include <vtkm/exec/CellInterpolate.h>
+
+namespace beams
+{
+namespace rendering
+{
+//
+// Same interface as vtkm::rendering::raytracing::RectilinearMeshOracle, for meshes with uniform
+// point coordinates. Cells are located with one division per axis instead of a binary search,
+// and the grid planes are computed from the origin and spacing.
+//
+class UniformMeshOracleExecObj
+{
+public:
+  VTKM_CONT
+  UniformMeshOracleExecObj(const vtkm::cont::CellSetStructured<3>& cellset,
+                           const vtkm::cont::ArrayHandleUniformPointCoordinates& coordinates)
+  {
+    auto coordinatesP = coordinates.ReadPortal();
+    this->Origin = coordinatesP.GetOrigin();
+    this->Spacing = coordinatesP.GetSpacing();
+    this->PointDims = cellset.GetPointDimensions();
+    for (vtkm::Int32 i = 0; i < 3; ++i)
+    {
+      this->CellDims[i] = this->PointDims[i] - 1;
+      this->InvSpacing[i] = 1.0f / this->Spacing[i];
+      this->MaxPoint[i] =
+        this->Origin[i] + this->Spacing[i] * static_cast<vtkm::Float32>(this->CellDims[i]);
+    }
+  }
+
+  template <typename T>
+  VTKM_EXEC inline bool IsInside(const vtkm::Vec<T, 3>& point) const
+  {
+    bool inside = true;
+    if (point[0] < Origin[0] || point[0] > MaxPoint[0])
+      inside = false;
+    if (point[1] < Origin[1] || point[1] > MaxPoint[1])
+      inside = false;
+    if (point[2] < Origin[2] || point[2] > MaxPoint[2])
+      inside = false;
+    return inside;
+  }
+
+  VTKM_EXEC_CONT
+  vtkm::Float32 Interpolate(const vtkm::Vec<vtkm::Float32, 8>& scalars,
+                            const vtkm::Vec<vtkm::Float32, 3>& pcoords) const
+  {
+    vtkm::Float32 scalar;
+    vtkm::exec::CellInterpolate(scalars, pcoords, vtkm::CellShapeTagHexahedron(), scalar);
+    return scalar;
+  }
+
+  VTKM_EXEC
+  inline vtkm::Id GetCellIndex(const vtkm::Vec<vtkm::Id, 3>& cell) const
+  {
+    return (cell[2] * (CellDims[1]) + cell[1]) * (CellDims[0]) + cell[0];
+  }
+
+  VTKM_EXEC_CONT
+  vtkm::Int32 GetCellIndices(vtkm::Id cellIndices[8], const vtkm::Id& cellIndex) const
+  {
+    vtkm::Id3 cellId;
+    cellId[0] = cellIndex % CellDims[0];
+    cellId[1] = (cellIndex / CellDims[0]) % CellDims[1];
+    cellId[2] = cellIndex / (CellDims[0] * CellDims[1]);
+    cellIndices[0] = (cellId[2] * PointDims[1] + cellId[1]) * PointDims[0] + cellId[0];
+    cellIndices[1] = cellIndices[0] + 1;
+    cellIndices[2] = cellIndices[1] + PointDims[0];
+    cellIndices[3] = cellIndices[2] - 1;
+    cellIndices[4] = cellIndices[0] + PointDims[0] * PointDims[1];
+    cellIndices[5] = cellIndices[4] + 1;
+    cellIndices[6] = cellIndices[5] + PointDims[0];
+    cellIndices[7] = cellIndices[6] - 1;
+    return 8;
+  }
+
+  VTKM_EXEC_CONT
+  vtkm::UInt8 GetCellShape(const vtkm::Id& vtkmNotUsed(cellId)) const
+  {
+    return vtkm::UInt8(vtkm::CELL_SHAPE_HEXAHEDRON);
+  }
+
+  VTKM_EXEC_CONT
+  vtkm::Id3 GetCellDims() const { return CellDims; }
+
+  VTKM_EXEC_CONT
+  vtkm::Float32 GetPlane(vtkm::Int32 dim, vtkm::Id index) const
+  {
+    return Origin[dim] + Spacing[dim] * static_cast<vtkm::Float32>(index);
+  }
+
+  template <typename T>
+  VTKM_EXEC_CONT void LocateCell(const vtkm::Vec<T, 3>& point, vtkm::Vec<vtkm::Id, 3>& cell) const
+  {
+    for (vtkm::Int32 dim = 0; dim < 3; ++dim)
+    {
+      const vtkm::Float32 temp =
+        (static_cast<vtkm::Float32>(point[dim]) - Origin[dim]) * InvSpacing[dim];
+      const vtkm::Id index = static_cast<vtkm::Id>(vtkm::Floor(temp));
+      cell[dim] = vtkm::Max(vtkm::Id(0), vtkm::Min(CellDims[dim] - 1, index));
+    }
+  }
+
+  template <typename T>
+  VTKM_EXEC_CONT void FindCellImpl(const vtkm::Vec<T, 3>& point,
+                                   vtkm::Id& cellId,
+                                   vtkm::Vec<T, 3>& pcoords) const
+  {
+    cellId = -1;
+    if (!IsInside(point))
+    {
+      return;
+    }
+
+    vtkm::Vec<vtkm::Id, 3> cell;
+    LocateCell(point, cell);
+    for (vtkm::Int32 i = 0; i < 3; ++i)
+    {
+      pcoords[i] = static_cast<T>((static_cast<vtkm::Float32>(point[i]) - GetPlane(i, cell[i])) *
+                                  InvSpacing[i]);
+    }
+    cellId = GetCellIndex(cell);
+  }
+
+  VTKM_EXEC_CONT
+  void FindCell(const vtkm::Vec<vtkm::Float32, 3>& point,
+                vtkm::Id& cellId,
+                vtkm::Vec<vtkm::Float32, 3>& pcoords) const
+  {
+    FindCellImpl(point, cellId, pcoords);
+  }
+
+  VTKM_EXEC_CONT
+  void FindCell(const vtkm::Vec<vtkm::Float64, 3>& point,
+                vtkm::Id& cellId,
+                vtkm::Vec<vtkm::Float64, 3>& pcoords) const
+  {
+    FindCellImpl(point, cellId, pcoords);
+  }
+
+protected:
+  vtkm::Vec3f_32 Origin;
+  vtkm::Vec3f_32 Spacing;
+  vtkm::Vec3f_32 InvSpacing;
+  vtkm::Vec3f_32 MaxPoint;
+  vtkm::Id3 PointDims;
+  vtkm::Id3 CellDims;
+};
+
+class UniformMeshOracle : public vtkm::cont::ExecutionObjectBase
+{
+public:
+  VTKM_CONT
+  UniformMeshOracle(const vtkm::cont::CellSetStructured<3>& cellSet,
+                    const vtkm::cont::ArrayHandleUniformPointCoordinates& coordinates)
+    : CellSet(cellSet)
+    , Coordinates(coordinates)
+  {
+  }
+
+  template <typename Device>
+  VTKM_CONT UniformMeshOracleExecObj PrepareForExecution(Device, vtkm::cont::Token&) const
+  {
+    return UniformMeshOracleExecObj(this->CellSet, this->Coordinates);
+  }
+
+private:
+  vtkm::cont::CellSetStructured<3> CellSet;
+  vtkm::cont::ArrayHandleUniformPointCoordinates Coordinates;
+};
+} // namespace rendering
+} // namespace beams
+
+#endif // beams_rendering_uniformmeshoracle_h
@@ -3,6 +3,7 @@
 #include <vtkm/Math.h>
 #include <vtkm/cont/EnvironmentTracker.h>
 #include <vtkm/cont/ErrorBadValue.h>
+#include <vtkm/thirdparty/diy/mpi-cast.h>
 
 #include <limits.h>
 #include <unistd.h>
@@ -28,9 +29,34 @@ Environment::Environment()
   , XRank(0)
   , YRank(0)
   , ZRank(0)
+  , NodeComm(MPI_COMM_NULL)
+  , NodeLeaderComm(MPI_COMM_NULL)
+  , NodeRank(0)
+  , NodeSize(0)
+  , NodeId(0)
+  , NumNodes(0)
 {
 }
 
+Environment::~Environment()
+{
+  // The members are destroyed after this, so the communicators are freed before Env finalizes MPI
+  int finalized;
+  MPI_Finalized(&finalized);
+  if (finalized)
+  {
+    return;
+  }
+  if (this->NodeLeaderComm != MPI_COMM_NULL)
+  {
+    MPI_Comm_free(&this->NodeLeaderComm);
+  }
+  if (this->NodeComm != MPI_COMM_NULL)
+  {
+    MPI_Comm_free(&this->NodeComm);
+  }
+}
+
 pilot::Result<bool, std::string> Environment::Initialize(int argc, char* argv[])
 {
   if (this->Rank == UNINTIALIZED_RANK)
@@ -43,10 +69,36 @@ pilot::Result<bool, std::string> Environment::Initialize(int argc, char* argv[])
     vtkm::cont::EnvironmentTracker::SetCommunicator(*(this->Comm));
     this->Rank = this->Comm->rank();
     this->Size = this->Comm->size();
+    this->SplitByNode();
   }
   return pilot::Result<bool, std::string>::Success(true);
 }
 
+void Environment::SplitByNode()
+{
+  MPI_Comm comm = vtkmdiy::mpi::mpi_cast(this->Comm->handle());
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, this->Rank, MPI_INFO_NULL, &this->NodeComm);
+  MPI_Comm_rank(this->NodeComm, &this->NodeRank);
+  MPI_Comm_size(this->NodeComm, &this->NodeSize);
+
+  bool isLeader = this->NodeRank == 0;
+  MPI_Comm_split(comm, isLeader ? 0 : MPI_UNDEFINED, this->Rank, &this->NodeLeaderComm);
+  int nodeInfo[2] = { 0, 0 };
+  if (isLeader)
+  {
+    MPI_Comm_rank(this->NodeLeaderComm, &nodeInfo[0]);
+    MPI_Comm_size(this->NodeLeaderComm, &nodeInfo[1]);
+  }
+  MPI_Bcast(nodeInfo, 2, MPI_INT, 0, this->NodeComm);
+  this->NodeId = nodeInfo[0];
+  this->NumNodes = nodeInfo[1];
+
+  this->RankNodeIds.resize(this->Size);
+  this->RankNodeRanks.resize(this->Size);
+  MPI_Allgather(&this->NodeId, 1, MPI_INT, this->RankNodeIds.data(), 1, MPI_INT, comm);
+  MPI_Allgather(&this->NodeRank, 1, MPI_INT, this->RankNodeRanks.data(), 1, MPI_INT, comm);
+}
+
 void Environment::ReshapeAsLine()
 {
   this->Shape = TopologyShape::Line;
@@ -5,8 +5,11 @@
 
 #include <vtkm/thirdparty/diy/diy.h>
 
+#include <mpi.h>
+
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace pilot
 {
@@ -17,6 +20,8 @@ struct Environment
 public:
   static std::shared_ptr<Environment> Get();
 
+  ~Environment();
+
   pilot::Result<bool, std::string> Initialize(int argc, char* argv[]);
 
   void ReshapeAsLine();
@@ -39,8 +44,22 @@ public:
   int YRank;
   int ZRank;
 
+  // The ranks sharing a node with this one, from MPI_Comm_split_type(MPI_COMM_TYPE_SHARED)
+  MPI_Comm NodeComm;
+  // Node rank 0 of every node, MPI_COMM_NULL on the other ranks. A node's id is its rank here.
+  MPI_Comm NodeLeaderComm;
+  int NodeRank;
+  int NodeSize;
+  int NodeId;
+  int NumNodes;
+  // The node id and node rank of every rank
+  std::vector<int> RankNodeIds;
+  std::vector<int> RankNodeRanks;
+
 private:
   Environment();
+
+  void SplitByNode();
 };
 
 using EnvironmentPtr = std::shared_ptr<Environment>;
@@ -0,0 +1,391 @@
+#include <pilot/mpi/Messenger.h>
+
+#include <vtkm/cont/ErrorBadValue.h>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+
+namespace pilot
+{
+namespace mpi
+{
+void MessageReader::CheckRemaining(std::size_t size) const
+{
+  if (size > this->GetRemaining())
+  {
+    throw vtkm::cont::ErrorBadValue(fmt::format(
+      "Cannot read {} bytes from a message with {} bytes left", size, this->GetRemaining()));
+  }
+}
+
+Messenger::Messenger(MPI_Comm comm)
+  : Comm(comm)
+{
+  MPI_Comm_rank(comm, &this->Rank);
+  MPI_Comm_size(comm, &this->NumRanks);
+}
+
+Messenger::~Messenger()
+{
+  // Nothing can be released once MPI is gone
+  int finalized;
+  MPI_Finalized(&finalized);
+  if (finalized)
+  {
+    return;
+  }
+  this->CleanupRequests();
+}
+
+void Messenger::RegisterTag(int tag, int numRecvs, std::size_t bufferSize)
+{
+  if (bufferSize <= sizeof(PacketHeader))
+  {
+    throw vtkm::cont::ErrorBadValue(fmt::format(
+      "Receive buffers of tag {} must be larger than {} bytes", tag, sizeof(PacketHeader)));
+  }
+  this->TagBufferSizes[tag] = bufferSize;
+  this->TagNumRecvs[tag] = numRecvs;
+}
+
+void Messenger::InitializeBuffers()
+{
+  for (const auto& tagNumRecvs : this->TagNumRecvs)
+  {
+    const int tag = tagNumRecvs.first;
+    for (int i = 0; i < tagNumRecvs.second; ++i)
+    {
+      this->RecvBuffers.push_back({ tag, std::vector<char>(this->TagBufferSizes[tag]) });
+    }
+  }
+  this->RecvRequests.resize(this->RecvBuffers.size(), MPI_REQUEST_NULL);
+  for (std::size_t i = 0; i < this->RecvBuffers.size(); ++i)
+  {
+    this->PostRecv(i);
+  }
+}
+
+void Messenger::CleanupRequests()
+{
+  for (MPI_Request& request : this->RecvRequests)
+  {
+    if (request != MPI_REQUEST_NULL)
+    {
+      MPI_Cancel(&request);
+      MPI_Wait(&request, MPI_STATUS_IGNORE);
+    }
+  }
+  this->RecvRequests.clear();
+  this->RecvBuffers.clear();
+
+  MPI_Waitall(
+    static_cast<int>(this->SendRequests.size()), this->SendRequests.data(), MPI_STATUSES_IGNORE);
+  for (std::size_t bufferIndex : this->SendRequestBuffers)
+  {
+    this->FreeSendBuffers.push_back(bufferIndex);
+  }
+  this->SendRequests.clear();
+  this->SendRequestBuffers.clear();
+
+  if (this->TerminationRequest != MPI_REQUEST_NULL)
+  {
+    MPI_Wait(&this->TerminationRequest, MPI_STATUS_IGNORE);
+  }
+}
+
+MessageBuffer& Messenger::GetSendBuffer()
+{
+  MessageBuffer& buffer = *this->SendBuffers[this->AcquireSendBuffer()];
+  // Room for the header of the first packet, filled in when the message is sent
+  buffer.Data.clear();
+  buffer.Data.resize(sizeof(PacketHeader));
+  return buffer;
+}
+
+void Messenger::SendData(int dst, int tag, MessageBuffer& buffer)
+{
+  auto bufferSize = this->TagBufferSizes.find(tag);
+  if (bufferSize == this->TagBufferSizes.end())
+  {
+    throw vtkm::cont::ErrorBadValue(fmt::format("Cannot send with unregistered tag {}", tag));
+  }
+  const std::size_t packetCapacity = bufferSize->second - sizeof(PacketHeader);
+  const std::size_t messageSize = buffer.Data.size() - sizeof(PacketHeader);
+  const std::size_t numPackets =
+    std::max(std::size_t(1), (messageSize + packetCapacity - 1) / packetCapacity);
+
+  std::vector<int>& sentPackets = this->SentPackets[tag];
+  sentPackets.resize(static_cast<std::size_t>(this->NumRanks), 0);
+  sentPackets[static_cast<std::size_t>(dst)] += static_cast<int>(numPackets);
+
+  PacketHeader header;
+  header.Epoch = this->Epoch;
+  header.MessageId = this->NextMessageId++;
+  header.NumPackets = static_cast<int>(numPackets);
+  header.Packet = 0;
+  header.MessageSize = messageSize;
+  header.Offset = 0;
+  if (numPackets == 1)
+  {
+    std::memcpy(buffer.Data.data(), &header, sizeof(PacketHeader));
+    this->PostSend(dst, tag, buffer.PoolIndex);
+    return;
+  }
+
+  const char* message = buffer.Data.data() + sizeof(PacketHeader);
+  for (std::size_t packet = 0; packet < numPackets; ++packet)
+  {
+    header.Packet = static_cast<int>(packet);
+    header.Offset = packet * packetCapacity;
+    const std::size_t packetSize = std::min(packetCapacity, messageSize - header.Offset);
+    std::size_t packetIndex = this->AcquireSendBuffer();
+    MessageBuffer& packetBuffer = *this->SendBuffers[packetIndex];
+    packetBuffer.Data.clear();
+    packetBuffer.Write(&header, 1);
+    packetBuffer.Write(message + header.Offset, packetSize);
+    this->PostSend(dst, tag, packetIndex);
+  }
+  buffer.Data.clear();
+  this->FreeSendBuffers.push_back(buffer.PoolIndex);
+}
+
+bool Messenger::RecvData(const MessageHandler& handle, bool blockAndWait)
+{
+  // Packets held back in the previous epoch come first
+  bool isHandled = false;
+  const std::size_t numHeld = this->HeldPackets.size();
+  for (std::size_t i = 0; i < numHeld; ++i)
+  {
+    HeldPacket packet = std::move(this->HeldPackets.front());
+    this->HeldPackets.pop_front();
+    isHandled |=
+      this->HandlePacket(packet.Source, packet.Tag, packet.Data.data(), packet.Data.size(), handle);
+  }
+
+  if (this->RecvRequests.empty())
+  {
+    return isHandled;
+  }
+  const int numRequests = static_cast<int>(this->RecvRequests.size());
+  this->CompletedIndices.resize(this->RecvRequests.size());
+  this->CompletedStatuses.resize(this->RecvRequests.size());
+  int numCompleted;
+  if (blockAndWait && !isHandled)
+  {
+    MPI_Waitsome(numRequests,
+                 this->RecvRequests.data(),
+                 &numCompleted,
+                 this->CompletedIndices.data(),
+                 this->CompletedStatuses.data());
+  }
+  else
+  {
+    MPI_Testsome(numRequests,
+                 this->RecvRequests.data(),
+                 &numCompleted,
+                 this->CompletedIndices.data(),
+                 this->CompletedStatuses.data());
+  }
+  if (numCompleted == MPI_UNDEFINED)
+  {
+    return isHandled;
+  }
+
+  for (int i = 0; i < numCompleted; ++i)
+  {
+    const std::size_t recvIndex = static_cast<std::size_t>(this->CompletedIndices[i]);
+    MPI_Status& status = this->CompletedStatuses[i];
+    int size;
+    MPI_Get_count(&status, MPI_BYTE, &size);
+    RecvBuffer& buffer = this->RecvBuffers[recvIndex];
+    isHandled |= this->HandlePacket(
+      status.MPI_SOURCE, buffer.Tag, buffer.Data.data(), static_cast<std::size_t>(size), handle);
+    this->PostRecv(recvIndex);
+  }
+  return isHandled;
+}
+
+void Messenger::CheckPendingSendRequests()
+{
+  if (this->SendRequests.empty())
+  {
+    return;
+  }
+  const int numRequests = static_cast<int>(this->SendRequests.size());
+  this->CompletedSendIndices.resize(this->SendRequests.size());
+  int numCompleted;
+  MPI_Testsome(numRequests,
+               this->SendRequests.data(),
+               &numCompleted,
+               this->CompletedSendIndices.data(),
+               MPI_STATUSES_IGNORE);
+  if (numCompleted == MPI_UNDEFINED || numCompleted == 0)
+  {
+    return;
+  }
+
+  // Completed requests are set to MPI_REQUEST_NULL, keep the others in order
+  std::size_t numPending = 0;
+  for (std::size_t i = 0; i < this->SendRequests.size(); ++i)
+  {
+    if (this->SendRequests[i] == MPI_REQUEST_NULL)
+    {
+      this->FreeSendBuffers.push_back(this->SendRequestBuffers[i]);
+      continue;
+    }
+    this->SendRequests[numPending] = this->SendRequests[i];
+    this->SendRequestBuffers[numPending] = this->SendRequestBuffers[i];
+    numPending++;
+  }
+  this->SendRequests.resize(numPending);
+  this->SendRequestBuffers.resize(numPending);
+}
+
+void Messenger::BeginEpoch()
+{
+  if (this->TerminationTag >= 0 && !this->IsTerminated())
+  {
+    throw vtkm::cont::ErrorBadValue(
+      fmt::format("Rank {} left epoch {} before it terminated", this->Rank, this->Epoch));
+  }
+  this->Epoch++;
+  this->SentPackets.clear();
+  this->ReceivedPackets.clear();
+  this->TerminationTag = -1;
+  this->HasTerminationCount = false;
+  this->ExpectedPackets = 0;
+}
+
+void Messenger::BeginTermination(int tag)
+{
+  if (this->TerminationTag >= 0)
+  {
+    throw vtkm::cont::ErrorBadValue(
+      fmt::format("Epoch {} is already terminating tag {}", this->Epoch, this->TerminationTag));
+  }
+  // Every rank learns how many packets were sent to it in total, and is done once it has them all
+  this->TerminationTag = tag;
+  std::vector<int>& sentPackets = this->SentPackets[tag];
+  sentPackets.resize(static_cast<std::size_t>(this->NumRanks), 0);
+  MPI_Ireduce_scatter_block(sentPackets.data(),
+                            &this->ExpectedPackets,
+                            1,
+                            MPI_INT,
+                            MPI_SUM,
+                            this->Comm,
+                            &this->TerminationRequest);
+}
+
+bool Messenger::IsTerminated()
+{
+  if (this->TerminationTag < 0)
+  {
+    return false;
+  }
+  if (!this->HasTerminationCount)
+  {
+    int isDone;
+    MPI_Test(&this->TerminationRequest, &isDone, MPI_STATUS_IGNORE);
+    this->HasTerminationCount = isDone != 0;
+  }
+  return this->HasTerminationCount &&
+    this->ReceivedPackets[this->TerminationTag] == this->ExpectedPackets;
+}
+
+std::size_t Messenger::AcquireSendBuffer()
+{
+  if (this->FreeSendBuffers.empty())
+  {
+    this->CheckPendingSendRequests();
+  }
+  if (this->FreeSendBuffers.empty())
+  {
+    this->SendBuffers.emplace_back(new MessageBuffer());
+    this->SendBuffers.back()->PoolIndex = this->SendBuffers.size() - 1;
+    return this->SendBuffers.size() - 1;
+  }
+  std::size_t bufferIndex = this->FreeSendBuffers.back();
+  this->FreeSendBuffers.pop_back();
+  return bufferIndex;
+}
+
+void Messenger::PostSend(int dst, int tag, std::size_t bufferIndex)
+{
+  MessageBuffer& buffer = *this->SendBuffers[bufferIndex];
+  MPI_Request request;
+  MPI_Isend(buffer.Data.data(),
+            static_cast<int>(buffer.Data.size()),
+            MPI_BYTE,
+            dst,
+            tag,
+            this->Comm,
+            &request);
+  this->SendRequests.push_back(request);
+  this->SendRequestBuffers.push_back(bufferIndex);
+}
+
+void Messenger::PostRecv(std::size_t recvIndex)
+{
+  RecvBuffer& buffer = this->RecvBuffers[recvIndex];
+  MPI_Irecv(buffer.Data.data(),
+            static_cast<int>(buffer.Data.size()),
+            MPI_BYTE,
+            MPI_ANY_SOURCE,
+            buffer.Tag,
+            this->Comm,
+            &this->RecvRequests[recvIndex]);
+}
+
+bool Messenger::HandlePacket(int source,
+                             int tag,
+                             const char* data,
+                             std::size_t size,
+                             const MessageHandler& handle)
+{
+  PacketHeader header;
+  std::memcpy(&header, data, sizeof(PacketHeader));
+  if (header.Epoch > this->Epoch)
+  {
+    this->HeldPackets.push_back({ source, tag, std::vector<char>(data, data + size) });
+    return false;
+  }
+  if (header.Epoch < this->Epoch)
+  {
+    throw vtkm::cont::ErrorBadValue(fmt::format("Rank {} got a message of epoch {} in epoch {}",
+                                                this->Rank,
+                                                header.Epoch,
+                                                this->Epoch));
+  }
+  this->ReceivedPackets[tag]++;
+
+  const char* payload = data + sizeof(PacketHeader);
+  const std::size_t payloadSize = size - sizeof(PacketHeader);
+  if (header.NumPackets == 1)
+  {
+    MessageReader reader(payload, payloadSize);
+    handle(source, tag, reader);
+    return true;
+  }
+
+  // Message ids are unique per sender
+  const std::uint64_t key = (std::uint64_t(std::uint32_t(source)) << 32) |
+    std::uint64_t(std::uint32_t(header.MessageId));
+  PartialMessage& message = this->PartialMessages[key];
+  if (message.Data.empty())
+  {
+    message.Data.resize(header.MessageSize);
+    message.NumPacketsLeft = header.NumPackets;
+  }
+  std::memcpy(message.Data.data() + header.Offset, payload, payloadSize);
+  if (--message.NumPacketsLeft > 0)
+  {
+    return false;
+  }
+  MessageReader reader(message.Data.data(), message.Data.size());
+  handle(source, tag, reader);
+  this->PartialMessages.erase(key);
+  return true;
+}
+}
+}
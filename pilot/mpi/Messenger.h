@@ -0,0 +1,233 @@
+#pragma once
+
+#include <mpi.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace pilot
+{
+namespace mpi
+{
+// The bytes a message is packed into. A buffer keeps its capacity when it is reused, so packing
+// into a pooled buffer does not allocate once the pool is warm.
+class MessageBuffer
+{
+public:
+  template <typename T>
+  void Write(const T* values, std::size_t count)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be packed");
+    const std::size_t size = count * sizeof(T);
+    const std::size_t position = this->Data.size();
+    this->Data.resize(position + size);
+    if (size > 0)
+    {
+      std::memcpy(this->Data.data() + position, values, size);
+    }
+  }
+
+  template <typename T>
+  void Write(const T& value)
+  {
+    this->Write(&value, 1);
+  }
+
+  std::vector<char> Data;
+
+private:
+  friend class Messenger;
+
+  std::size_t PoolIndex = 0;
+};
+
+// Reads the values of a received message in the order they were written
+class MessageReader
+{
+public:
+  MessageReader(const char* data, std::size_t size)
+    : Data(data)
+    , Size(size)
+    , Position(0)
+  {
+  }
+
+  template <typename T>
+  void Read(T* values, std::size_t count)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be packed");
+    const std::size_t size = count * sizeof(T);
+    this->CheckRemaining(size);
+    if (size > 0)
+    {
+      std::memcpy(values, this->Data + this->Position, size);
+    }
+    this->Position += size;
+  }
+
+  template <typename T>
+  T Read()
+  {
+    T value;
+    this->Read(&value, 1);
+    return value;
+  }
+
+  std::size_t GetRemaining() const { return this->Size - this->Position; }
+
+private:
+  void CheckRemaining(std::size_t size) const;
+
+  const char* Data;
+  std::size_t Size;
+  std::size_t Position;
+};
+
+//
+// Asynchronous point to point messages over a communicator.
+//
+// Every tag has a pool of receives that are posted once and re-posted as soon as their message is
+// handled. Messages larger than the receive buffers of their tag are split into packets and put
+// back together on arrival. Sends are packed into pooled buffers that go back to the pool when
+// MPI is done with them. Progress is made with MPI_Testsome over the posted requests.
+//
+// Messages are grouped into epochs. Within an epoch any rank can send to any other without the
+// receivers knowing how many messages to expect: a rank that has posted its last message of a
+// terminated tag calls BeginTermination, and keeps receiving until IsTerminated, at which point
+// every message of that tag sent to it in the epoch has been handled. Messages that arrive from
+// ranks already in the next epoch are held back until this rank gets there.
+//
+class Messenger
+{
+public:
+  // The source rank, the tag and the payload of a complete message
+  using MessageHandler = std::function<void(int, int, MessageReader&)>;
+
+  explicit Messenger(MPI_Comm comm);
+  Messenger(const Messenger&) = delete;
+  Messenger& operator=(const Messenger&) = delete;
+  virtual ~Messenger();
+
+  int GetRank() const { return this->Rank; }
+
+  int GetNumRanks() const { return this->NumRanks; }
+
+protected:
+  // All ranks must register the same tags with the same buffer sizes, before InitializeBuffers
+  void RegisterTag(int tag, int numRecvs, std::size_t bufferSize);
+
+  // Posts the receives of every registered tag
+  void InitializeBuffers();
+
+  // Cancels the posted receives and waits for the pending sends
+  void CleanupRequests();
+
+  // An empty buffer from the send pool. It belongs to the messenger again once passed to SendData.
+  MessageBuffer& GetSendBuffer();
+
+  void SendData(int dst, int tag, MessageBuffer& buffer);
+
+  // Hands every complete message received so far to handle, which may send messages itself. When
+  // blockAndWait is set and nothing is there yet, waits for at least one packet. Returns whether
+  // a message was handled.
+  bool RecvData(const MessageHandler& handle, bool blockAndWait);
+
+  // Returns the buffers of the completed sends to the pool
+  void CheckPendingSendRequests();
+
+  // Moves every rank into the next epoch. The previous one must be terminated.
+  void BeginEpoch();
+
+  // Collective over the epoch, called once this rank has sent its last message with tag
+  void BeginTermination(int tag);
+
+  // True once every message with tag sent to this rank in the epoch has been handled
+  bool IsTerminated();
+
+private:
+  struct PacketHeader
+  {
+    int Epoch;
+    int MessageId;
+    int NumPackets;
+    int Packet;
+    std::uint64_t MessageSize;
+    std::uint64_t Offset;
+  };
+
+  struct RecvBuffer
+  {
+    int Tag;
+    std::vector<char> Data;
+  };
+
+  struct PartialMessage
+  {
+    int NumPacketsLeft;
+    std::vector<char> Data;
+  };
+
+  struct HeldPacket
+  {
+    int Source;
+    int Tag;
+    std::vector<char> Data;
+  };
+
+  std::size_t AcquireSendBuffer();
+
+  void PostSend(int dst, int tag, std::size_t bufferIndex);
+
+  void PostRecv(std::size_t recvIndex);
+
+  bool HandlePacket(int source,
+                    int tag,
+                    const char* data,
+                    std::size_t size,
+                    const MessageHandler& handle);
+
+  MPI_Comm Comm;
+  int Rank;
+  int NumRanks;
+  int Epoch = 0;
+  int NextMessageId = 0;
+
+  std::map<int, std::size_t> TagBufferSizes;
+  std::map<int, int> TagNumRecvs;
+  std::vector<RecvBuffer> RecvBuffers;
+  std::vector<MPI_Request> RecvRequests;
+  std::map<std::uint64_t, PartialMessage> PartialMessages;
+  std::deque<HeldPacket> HeldPackets;
+
+  std::vector<std::unique_ptr<MessageBuffer>> SendBuffers;
+  std::vector<std::size_t> FreeSendBuffers;
+  std::vector<MPI_Request> SendRequests;
+  std::vector<std::size_t> SendRequestBuffers;
+
+  // Packets of the current epoch sent to each rank and received, by tag
+  std::map<int, std::vector<int>> SentPackets;
+  std::map<int, int> ReceivedPackets;
+
+  // Termination of the current epoch
+  int TerminationTag = -1;
+  MPI_Request TerminationRequest = MPI_REQUEST_NULL;
+  bool HasTerminationCount = false;
+  int ExpectedPackets = 0;
+
+  // Scratch space for MPI_Testsome. Handlers can send while receives are being handled, so
+  // sends have their own.
+  std::vector<int> CompletedIndices;
+  std::vector<MPI_Status> CompletedStatuses;
+  std::vector<int> CompletedSendIndices;
+};
+}
+}